@@ -0,0 +1,238 @@
+/**
+ * cd_bench_replay.c - Replay of workload traces recorded by cd_wq_workqueue_trace_start()
+ *
+ * Part of the libcd - bringing you support for C programs with queue processors, from Data And Signal's Piotr Gregor
+ *
+ * Data And Signal - IT Solutions
+ * http://www.dataandsignal.com
+ * 2020
+ *
+ * Re-drives a workqueue with synthetic jobs submitted at recorded times, each busy for recorded
+ * duration of the original job, so that worker counts and queue modes can be compared offline.
+ * Result is printed as a single line JSON object, like in cd_bench_wq.c.
+ *
+ */
+
+#include "../include/cd_wq.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <sched.h>
+
+
+struct cd_replay_config {
+	const char	*path;
+	uint32_t	workers;			/* 0 - as many as were recorded */
+	uint32_t	group_threads;		/* if not 0, replay on grouped workqueue with this many threads */
+	uint8_t		lazy;				/* start workers lazily */
+	double		speed;				/* submit times are divided by this */
+};
+
+struct cd_replay_job {
+	struct cd_wq_trace_record	rec;
+	uint64_t					submit_ns;	/* in replay */
+	uint64_t					start_ns;
+	uint64_t					end_ns;
+};
+
+static uint64_t cd_replay_done;
+
+static uint64_t cd_replay_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * CD_NANOSEC_PER_SEC + (uint64_t) ts.tv_nsec;
+}
+
+static int cd_replay_cmp_submit(const void *a, const void *b)
+{
+	uint64_t x = ((const struct cd_replay_job *) a)->rec.submit_ns, y = ((const struct cd_replay_job *) b)->rec.submit_ns;
+
+	return (x > y) - (x < y);
+}
+
+static int cd_replay_cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+static uint64_t cd_replay_percentile(uint64_t *sorted, uint32_t n, double p)
+{
+	if (n == 0)
+		return 0;
+	return sorted[(uint32_t) (p * (n - 1))];
+}
+
+static void* cd_replay_f(void *arg)
+{
+	struct cd_replay_job *j = arg;
+	uint64_t end;
+
+	j->start_ns = cd_replay_now_ns();
+	end = j->start_ns + (j->rec.end_ns - j->rec.start_ns);							/* same cost as recorded */
+	while (cd_replay_now_ns() < end)
+		;
+	j->end_ns = cd_replay_now_ns();
+	__atomic_fetch_add(&cd_replay_done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/* @brief   Sleep until @t, spin for the last bit, so submit times are kept to a few us. */
+static void cd_replay_wait_until(uint64_t t)
+{
+	struct timespec	ts;
+	uint64_t		now = cd_replay_now_ns();
+
+	if (t > now + 100000) {
+		t -= 50000;
+		ts.tv_sec = t / CD_NANOSEC_PER_SEC;
+		ts.tv_nsec = t % CD_NANOSEC_PER_SEC;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		t += 50000;
+	}
+	while (cd_replay_now_ns() < t)
+		;
+}
+
+static struct cd_replay_job* cd_replay_load(const char *path, struct cd_wq_trace_header *h, uint32_t *n)
+{
+	struct cd_replay_job	*jobs = NULL, *tmp;
+	struct cd_wq_trace_record rec;
+	uint32_t				size = 0;
+	FILE					*f;
+
+	f = fopen(path, "rb");
+	if (f == NULL) {
+		perror(path);
+		return NULL;
+	}
+	if (fread(h, sizeof(*h), 1, f) != 1 || memcmp(h->magic, CD_WQ_TRACE_MAGIC, sizeof(h->magic)) != 0 || h->version != CD_WQ_TRACE_VERSION) {
+		fprintf(stderr, "%s: not a workqueue trace\n", path);
+		fclose(f);
+		return NULL;
+	}
+
+	*n = 0;
+	while (fread(&rec, sizeof(rec), 1, f) == 1) {
+		if (*n == size) {
+			size = size ? 2 * size : 1024;
+			tmp = realloc(jobs, size * sizeof(struct cd_replay_job));
+			if (tmp == NULL) {
+				free(jobs);
+				fclose(f);
+				return NULL;
+			}
+			jobs = tmp;
+		}
+		memset(&jobs[*n], 0, sizeof(struct cd_replay_job));
+		jobs[(*n)++].rec = rec;
+	}
+	fclose(f);
+	return jobs;
+}
+
+static void cd_replay_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s -f trace [-w workers] [-g group threads] [-l] [-s speed]\n"
+			"  -w  number of workers, default: as recorded\n"
+			"  -g  replay on a grouped workqueue with this many group threads\n"
+			"  -l  start workers lazily\n"
+			"  -s  replay arrivals this many times faster (job costs are kept)\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct cd_replay_config		cfg = { .path = NULL, .workers = 0, .group_threads = 0, .lazy = 0, .speed = 1.0 };
+	struct cd_wq_queue_options	options = { 0 };
+	struct cd_wq_trace_header	h;
+	struct cd_replay_job		*jobs;
+	struct cd_workqueue			*wq = NULL;
+	struct cd_wq_group			*g = NULL;
+	uint64_t					*wait, *rec_wait, t0, end = 0, rec_end = 0;
+	uint32_t					n = 0, i;
+	int							opt;
+
+	while ((opt = getopt(argc, argv, "f:w:g:ls:h")) != -1) {
+		switch (opt) {
+			case 'f': cfg.path = optarg; break;
+			case 'w': cfg.workers = strtoul(optarg, NULL, 10); break;
+			case 'g': cfg.group_threads = strtoul(optarg, NULL, 10); break;
+			case 'l': cfg.lazy = 1; break;
+			case 's': cfg.speed = strtod(optarg, NULL); break;
+			default:
+				cd_replay_usage(argv[0]);
+				return -1;
+		}
+	}
+
+	if (cfg.path == NULL || cfg.speed <= 0) {
+		cd_replay_usage(argv[0]);
+		return -1;
+	}
+
+	jobs = cd_replay_load(cfg.path, &h, &n);
+	if (jobs == NULL || n == 0) {
+		fprintf(stderr, "%s: no records\n", cfg.path);
+		free(jobs);
+		return -1;
+	}
+	qsort(jobs, n, sizeof(struct cd_replay_job), cd_replay_cmp_submit);
+	if (cfg.workers == 0)
+		cfg.workers = h.workers_n ? h.workers_n : 1;
+
+	if (cfg.group_threads) {
+		g = cd_wq_group_create(cfg.group_threads, "replay");
+		assert(g != NULL);
+		wq = cd_wq_workqueue_create_grouped(g, 1, "replay", NULL);
+	} else {
+		options.CD_WQ_QUEUE_OPTION_STOP = CD_WQ_QUEUE_OPTION_STOP_SOFT;
+		options.CD_WQ_QUEUE_OPTION_START = cfg.lazy ? CD_WQ_QUEUE_OPTION_START_LAZY : CD_WQ_QUEUE_OPTION_START_EAGER;
+		wq = cd_wq_workqueue_create_options(cfg.workers, "replay", &options);
+	}
+	assert(wq != NULL);
+
+	t0 = cd_replay_now_ns();
+	for (i = 0; i < n; i++) {
+		cd_replay_wait_until(t0 + (uint64_t) (jobs[i].rec.submit_ns / cfg.speed));
+		jobs[i].submit_ns = cd_replay_now_ns();
+		while (cd_wq_queue_user(wq, CD_WORK_ASYNC, &jobs[i], jobs[i].rec.user_data_type, cd_replay_f, NULL) != CD_ERR_OK)
+			sched_yield();
+	}
+	while (__atomic_load_n(&cd_replay_done, __ATOMIC_ACQUIRE) < n)
+		sched_yield();
+
+	assert(cd_wq_workqueue_stop(wq) == CD_ERR_OK);
+	cd_wq_workqueue_free(&wq);
+	if (g)
+		assert(cd_wq_group_free(&g) == CD_ERR_OK);
+
+	wait = calloc(n, sizeof(uint64_t));
+	rec_wait = calloc(n, sizeof(uint64_t));
+	assert(wait && rec_wait);
+	for (i = 0; i < n; i++) {
+		wait[i] = jobs[i].start_ns - jobs[i].submit_ns;
+		rec_wait[i] = jobs[i].rec.start_ns > jobs[i].rec.submit_ns ? jobs[i].rec.start_ns - jobs[i].rec.submit_ns : 0;
+		if (jobs[i].end_ns - t0 > end)
+			end = jobs[i].end_ns - t0;
+		if (jobs[i].rec.end_ns - jobs[0].rec.submit_ns > rec_end)
+			rec_end = jobs[i].rec.end_ns - jobs[0].rec.submit_ns;
+	}
+	qsort(wait, n, sizeof(uint64_t), cd_replay_cmp_u64);
+	qsort(rec_wait, n, sizeof(uint64_t), cd_replay_cmp_u64);
+
+	printf("{\"bench\":\"replay\",\"jobs\":%u,\"workers\":%u,\"group_threads\":%u,\"lazy\":%u,\"speed\":%.2f,"
+			"\"recorded_workers\":%u,\"recorded_makespan_ns\":%lu,\"recorded_wait_p50_ns\":%lu,\"recorded_wait_p99_ns\":%lu,"
+			"\"makespan_ns\":%lu,\"wait_p50_ns\":%lu,\"wait_p99_ns\":%lu,\"wait_max_ns\":%lu}\n",
+			n, cfg.group_threads ? 0 : cfg.workers, cfg.group_threads, cfg.lazy, cfg.speed,
+			h.workers_n, rec_end, cd_replay_percentile(rec_wait, n, 0.5), cd_replay_percentile(rec_wait, n, 0.99),
+			end, cd_replay_percentile(wait, n, 0.5), cd_replay_percentile(wait, n, 0.99), wait[n - 1]);
+
+	free(rec_wait);
+	free(wait);
+	free(jobs);
+	return 0;
+}
@@ -0,0 +1,668 @@
+/**
+ * cd_bench_wq.c - Microbenchmarks for cd_wq
+ *
+ * Part of the libcd - bringing you support for C programs with queue processors, from Data And Signal's Piotr Gregor
+ *
+ * Data And Signal - IT Solutions
+ * http://www.dataandsignal.com
+ * 2020
+ *
+ * Every result is printed to stdout as a single line JSON object, so output of two runs
+ * can be diffed or fed to a script to catch regressions in cd_wq.c.
+ *
+ */
+
+#include "../include/cd_wq.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+
+struct cd_bench_config {
+	uint32_t	jobs;				/* number of jobs per run */
+	uint32_t	workers_max;		/* scaling runs go 1, 2, 4, ... up to this */
+	uint32_t	producers_max;		/* producer runs go 1, 2, 4, ... up to this */
+	uint32_t	reps;				/* repetitions of each run, median is reported */
+	uint32_t	samples;			/* number of samples for wake-up latency */
+	uint32_t	cost_ns;			/* busy time of a single job in scaling and drain runs */
+	const char	*only;				/* run only the benchmark with this name */
+};
+
+struct cd_bench_sample {
+	uint64_t	submit_ns;
+	uint64_t	start_ns;
+	uint64_t	end_ns;
+	uint32_t	cost_ns;
+};
+
+struct cd_bench_producer {
+	struct cd_workqueue	*wq;
+	pthread_barrier_t	*barrier;
+	uint32_t			jobs;
+};
+
+static uint64_t cd_bench_done;
+
+static uint64_t cd_bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * CD_NANOSEC_PER_SEC + (uint64_t) ts.tv_nsec;
+}
+
+static void cd_bench_spin_ns(uint32_t ns)
+{
+	uint64_t end = cd_bench_now_ns() + ns;
+
+	while (cd_bench_now_ns() < end)
+		;
+}
+
+static int cd_bench_cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+static uint64_t cd_bench_percentile(uint64_t *sorted, uint32_t n, double p)
+{
+	uint32_t idx;
+
+	if (n == 0)
+		return 0;
+	idx = (uint32_t) (p * (n - 1));
+	return sorted[idx];
+}
+
+static uint64_t cd_bench_median(uint64_t *v, uint32_t n)
+{
+	qsort(v, n, sizeof(uint64_t), cd_bench_cmp_u64);
+	return v[n / 2];
+}
+
+static void cd_bench_wait_done(uint64_t expected)
+{
+	while (__atomic_load_n(&cd_bench_done, __ATOMIC_ACQUIRE) < expected)
+		sched_yield();
+}
+
+static void* cd_bench_nop_f(void *arg)
+{
+	(void) arg;
+	__atomic_fetch_add(&cd_bench_done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void* cd_bench_sample_f(void *arg)
+{
+	struct cd_bench_sample *s = arg;
+
+	s->start_ns = cd_bench_now_ns();
+	if (s->cost_ns)
+		cd_bench_spin_ns(s->cost_ns);
+	s->end_ns = cd_bench_now_ns();
+	__atomic_fetch_add(&cd_bench_done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void cd_bench_print_latency(const char *bench, uint32_t workers, uint64_t *lat, uint32_t n)
+{
+	qsort(lat, n, sizeof(uint64_t), cd_bench_cmp_u64);
+	printf("{\"bench\":\"%s\",\"workers\":%u,\"samples\":%u,\"p50_ns\":%lu,\"p90_ns\":%lu,\"p99_ns\":%lu,\"p999_ns\":%lu,\"max_ns\":%lu}\n",
+			bench, workers, n,
+			cd_bench_percentile(lat, n, 0.5), cd_bench_percentile(lat, n, 0.9),
+			cd_bench_percentile(lat, n, 0.99), cd_bench_percentile(lat, n, 0.999),
+			lat[n - 1]);
+	fflush(stdout);
+}
+
+static void* cd_bench_producer_f(void *arg)
+{
+	struct cd_bench_producer *p = arg;
+	uint32_t i;
+
+	pthread_barrier_wait(p->barrier);
+	for (i = 0; i < p->jobs; i++) {
+		while (cd_wq_queue_user(p->wq, CD_WORK_ASYNC, NULL, 0, cd_bench_nop_f, NULL) != CD_ERR_OK)
+			sched_yield();
+	}
+	return NULL;
+}
+
+/* @brief   Enqueue throughput with @producers threads submitting concurrently.
+ * @details Reports both the rate at which jobs are accepted and the rate at which they are completed. */
+static void cd_bench_enqueue(struct cd_bench_config *cfg, const char *bench, uint32_t workers, uint32_t producers)
+{
+	uint64_t			*enq_ns, *e2e_ns, t0, t1, t2;
+	uint32_t			r, i, jobs;
+	struct cd_workqueue	*wq;
+	pthread_barrier_t	barrier;
+	pthread_t			*tids;
+	struct cd_bench_producer *p;
+
+	enq_ns = calloc(cfg->reps, sizeof(uint64_t));
+	e2e_ns = calloc(cfg->reps, sizeof(uint64_t));
+	tids = calloc(producers, sizeof(pthread_t));
+	p = calloc(producers, sizeof(struct cd_bench_producer));
+	assert(enq_ns && e2e_ns && tids && p);
+
+	jobs = (cfg->jobs / producers) * producers;
+	for (r = 0; r < cfg->reps; r++) {
+		wq = cd_wq_workqueue_default_create(workers, "bench enqueue");
+		assert(wq != NULL);
+		pthread_barrier_init(&barrier, NULL, producers + 1);
+		__atomic_store_n(&cd_bench_done, 0, __ATOMIC_RELEASE);
+
+		for (i = 0; i < producers; i++) {
+			p[i].wq = wq;
+			p[i].barrier = &barrier;
+			p[i].jobs = jobs / producers;
+			assert(cd_launch_thread(&tids[i], cd_bench_producer_f, &p[i], PTHREAD_CREATE_JOINABLE) == CD_ERR_OK);
+		}
+
+		pthread_barrier_wait(&barrier);
+		t0 = cd_bench_now_ns();
+		for (i = 0; i < producers; i++)
+			pthread_join(tids[i], NULL);
+		t1 = cd_bench_now_ns();
+		cd_bench_wait_done(jobs);
+		t2 = cd_bench_now_ns();
+
+		enq_ns[r] = t1 - t0;
+		e2e_ns[r] = t2 - t0;
+
+		assert(cd_wq_workqueue_stop(wq) == CD_ERR_OK);
+		cd_wq_workqueue_free(&wq);
+		pthread_barrier_destroy(&barrier);
+	}
+
+	t1 = cd_bench_median(enq_ns, cfg->reps);
+	t2 = cd_bench_median(e2e_ns, cfg->reps);
+	printf("{\"bench\":\"%s\",\"workers\":%u,\"producers\":%u,\"jobs\":%u,\"enqueue_ns\":%lu,\"complete_ns\":%lu,\"enqueue_ops_per_sec\":%.0f,\"complete_ops_per_sec\":%.0f}\n",
+			bench, workers, producers, jobs, t1, t2,
+			(double) jobs * CD_NANOSEC_PER_SEC / (t1 ? t1 : 1),
+			(double) jobs * CD_NANOSEC_PER_SEC / (t2 ? t2 : 1));
+	fflush(stdout);
+
+	free(p);
+	free(tids);
+	free(e2e_ns);
+	free(enq_ns);
+}
+
+/* @brief   Submit-to-completion latency of a burst of jobs submitted from a single thread. */
+static void cd_bench_latency(struct cd_bench_config *cfg, uint32_t workers)
+{
+	struct cd_bench_sample	*s;
+	uint64_t				*lat;
+	struct cd_workqueue		*wq;
+	uint32_t				i;
+
+	s = calloc(cfg->jobs, sizeof(struct cd_bench_sample));
+	lat = calloc(cfg->jobs, sizeof(uint64_t));
+	assert(s && lat);
+
+	wq = cd_wq_workqueue_default_create(workers, "bench latency");
+	assert(wq != NULL);
+	__atomic_store_n(&cd_bench_done, 0, __ATOMIC_RELEASE);
+
+	for (i = 0; i < cfg->jobs; i++) {
+		s[i].submit_ns = cd_bench_now_ns();
+		assert(cd_wq_queue_user(wq, CD_WORK_ASYNC, &s[i], 0, cd_bench_sample_f, NULL) == CD_ERR_OK);
+	}
+	cd_bench_wait_done(cfg->jobs);
+
+	assert(cd_wq_workqueue_stop(wq) == CD_ERR_OK);
+	cd_wq_workqueue_free(&wq);
+
+	for (i = 0; i < cfg->jobs; i++)
+		lat[i] = s[i].end_ns - s[i].submit_ns;
+	cd_bench_print_latency("latency", workers, lat, cfg->jobs);
+
+	free(lat);
+	free(s);
+}
+
+/* @brief   Time from submitting a job to an idle (parked) worker until that worker starts it. */
+static void cd_bench_wakeup(struct cd_bench_config *cfg)
+{
+	struct cd_bench_sample	s;
+	uint64_t				*lat;
+	struct cd_workqueue		*wq;
+	uint32_t				i;
+
+	lat = calloc(cfg->samples, sizeof(uint64_t));
+	assert(lat);
+
+	wq = cd_wq_workqueue_default_create(1, "bench wakeup");
+	assert(wq != NULL);
+	__atomic_store_n(&cd_bench_done, 0, __ATOMIC_RELEASE);
+
+	for (i = 0; i < cfg->samples; i++) {
+		usleep(200);											/* let the worker park on its condition variable */
+		memset(&s, 0, sizeof(s));
+		s.submit_ns = cd_bench_now_ns();
+		assert(cd_wq_queue_user(wq, CD_WORK_ASYNC, &s, 0, cd_bench_sample_f, NULL) == CD_ERR_OK);
+		cd_bench_wait_done(i + 1);
+		lat[i] = s.start_ns - s.submit_ns;
+	}
+
+	assert(cd_wq_workqueue_stop(wq) == CD_ERR_OK);
+	cd_wq_workqueue_free(&wq);
+
+	cd_bench_print_latency("wakeup", 1, lat, cfg->samples);
+	free(lat);
+}
+
+/* @brief   Time from creating the workqueue until its first job is done, with all workers started by init or lazily. */
+static void cd_bench_startup(struct cd_bench_config *cfg, uint8_t option_start)
+{
+	struct cd_wq_queue_options	options = { 0 };
+	struct cd_bench_sample		s;
+	struct cd_wq_stats			stats;
+	uint64_t					*run_ns, t0, started_n = 0;
+	struct cd_workqueue			*wq;
+	uint32_t					r;
+
+	run_ns = calloc(cfg->reps, sizeof(uint64_t));
+	assert(run_ns);
+
+	options.CD_WQ_QUEUE_OPTION_STOP = CD_WQ_QUEUE_OPTION_STOP_SOFT;
+	options.CD_WQ_QUEUE_OPTION_START = option_start;
+
+	for (r = 0; r < cfg->reps; r++) {
+		__atomic_store_n(&cd_bench_done, 0, __ATOMIC_RELEASE);
+		memset(&s, 0, sizeof(s));
+
+		t0 = cd_bench_now_ns();
+		wq = cd_wq_workqueue_create_options(cfg->workers_max, "bench startup", &options);
+		assert(wq != NULL);
+		assert(cd_wq_queue_user(wq, CD_WORK_ASYNC, &s, 0, cd_bench_sample_f, NULL) == CD_ERR_OK);
+		cd_bench_wait_done(1);
+		run_ns[r] = cd_bench_now_ns() - t0;
+
+		assert(cd_wq_workqueue_stats(wq, &stats) == CD_ERR_OK);
+		started_n += stats.workers_active_n;
+		assert(cd_wq_workqueue_stop(wq) == CD_ERR_OK);
+		cd_wq_workqueue_free(&wq);
+	}
+
+	printf("{\"bench\":\"startup\",\"mode\":\"%s\",\"workers\":%u,\"first_done_ns\":%lu,\"started_avg\":%lu}\n",
+			option_start == CD_WQ_QUEUE_OPTION_START_LAZY ? "lazy" : "eager",
+			cfg->workers_max, cd_bench_median(run_ns, cfg->reps), started_n / cfg->reps);
+	fflush(stdout);
+
+	free(run_ns);
+}
+
+/* @brief   Duration of cd_wq_workqueue_stop() with @jobs queued jobs, for both stop options. */
+static void cd_bench_stop(struct cd_bench_config *cfg, uint32_t workers, uint8_t option_stop)
+{
+	struct cd_bench_sample	*s;
+	uint64_t				*stop_ns, t0, executed = 0;
+	struct cd_workqueue		*wq;
+	uint32_t				r, i, jobs = cfg->jobs / 10;
+
+	s = calloc(jobs, sizeof(struct cd_bench_sample));
+	stop_ns = calloc(cfg->reps, sizeof(uint64_t));
+	assert(s && stop_ns);
+
+	for (r = 0; r < cfg->reps; r++) {
+		wq = cd_wq_workqueue_create(workers, "bench stop", option_stop);
+		assert(wq != NULL);
+		__atomic_store_n(&cd_bench_done, 0, __ATOMIC_RELEASE);
+
+		for (i = 0; i < jobs; i++) {
+			s[i].cost_ns = cfg->cost_ns;
+			assert(cd_wq_queue_user(wq, CD_WORK_ASYNC, &s[i], 0, cd_bench_sample_f, NULL) == CD_ERR_OK);
+		}
+
+		t0 = cd_bench_now_ns();
+		assert(cd_wq_workqueue_stop(wq) == CD_ERR_OK);
+		stop_ns[r] = cd_bench_now_ns() - t0;
+		executed += __atomic_load_n(&cd_bench_done, __ATOMIC_ACQUIRE);
+		cd_wq_workqueue_free(&wq);
+	}
+
+	printf("{\"bench\":\"stop\",\"mode\":\"%s\",\"workers\":%u,\"jobs\":%u,\"cost_ns\":%u,\"stop_ns\":%lu,\"executed_avg\":%lu}\n",
+			option_stop == CD_WQ_QUEUE_OPTION_STOP_SOFT ? "soft" : "hard",
+			workers, jobs, cfg->cost_ns, cd_bench_median(stop_ns, cfg->reps), executed / cfg->reps);
+	fflush(stdout);
+
+	free(stop_ns);
+	free(s);
+}
+
+/* @brief   Time to complete @jobs jobs of fixed cost with a growing number of workers. */
+static void cd_bench_scaling(struct cd_bench_config *cfg)
+{
+	struct cd_bench_sample	*s;
+	uint64_t				*run_ns, t0, base_ns = 0, median;
+	struct cd_workqueue		*wq;
+	uint32_t				r, i, workers, jobs = cfg->jobs / 10;
+
+	s = calloc(jobs, sizeof(struct cd_bench_sample));
+	run_ns = calloc(cfg->reps, sizeof(uint64_t));
+	assert(s && run_ns);
+
+	for (workers = 1; workers <= cfg->workers_max; workers *= 2) {
+		for (r = 0; r < cfg->reps; r++) {
+			wq = cd_wq_workqueue_default_create(workers, "bench scaling");
+			assert(wq != NULL);
+			__atomic_store_n(&cd_bench_done, 0, __ATOMIC_RELEASE);
+
+			t0 = cd_bench_now_ns();
+			for (i = 0; i < jobs; i++) {
+				s[i].cost_ns = cfg->cost_ns;
+				assert(cd_wq_queue_user(wq, CD_WORK_ASYNC, &s[i], 0, cd_bench_sample_f, NULL) == CD_ERR_OK);
+			}
+			cd_bench_wait_done(jobs);
+			run_ns[r] = cd_bench_now_ns() - t0;
+
+			assert(cd_wq_workqueue_stop(wq) == CD_ERR_OK);
+			cd_wq_workqueue_free(&wq);
+		}
+
+		median = cd_bench_median(run_ns, cfg->reps);
+		if (workers == 1)
+			base_ns = median;
+		printf("{\"bench\":\"scaling\",\"workers\":%u,\"jobs\":%u,\"cost_ns\":%u,\"run_ns\":%lu,\"ops_per_sec\":%.0f,\"speedup\":%.2f}\n",
+				workers, jobs, cfg->cost_ns, median,
+				(double) jobs * CD_NANOSEC_PER_SEC / (median ? median : 1),
+				(double) base_ns / (median ? median : 1));
+		fflush(stdout);
+	}
+
+	free(run_ns);
+	free(s);
+}
+
+struct cd_bench_range {
+	struct cd_workqueue	*wq;
+	uint32_t			lo;
+	uint32_t			hi;
+	uint32_t			cost_ns;
+};
+
+/* @brief   Divide and conquer over [lo, hi), each leaf costs cost_ns. */
+static void* cd_bench_range_f(void *arg)
+{
+	struct cd_bench_range		*r = arg, left, right;
+	struct cd_wq_wait_group		wg = CD_WQ_WAIT_GROUP_INITIALIZER;
+	uint32_t					mid;
+
+	if (r->hi - r->lo <= 4) {
+		cd_bench_spin_ns((r->hi - r->lo) * r->cost_ns);
+		return NULL;
+	}
+
+	mid = r->lo + (r->hi - r->lo) / 2;
+	left = (struct cd_bench_range) { r->wq, r->lo, mid, r->cost_ns };
+	right = (struct cd_bench_range) { r->wq, mid, r->hi, r->cost_ns };
+	assert(cd_wq_spawn_user(r->wq, &wg, CD_WORK_ASYNC, &left, 0, cd_bench_range_f, NULL) == CD_ERR_OK);
+	cd_bench_range_f(&right);															/* do the other half here */
+	assert(cd_wq_sync(r->wq, &wg) == CD_ERR_OK);
+	return NULL;
+}
+
+/* @brief   Time of recursive fork-join over @jobs / 10 leaves of fixed cost with a growing number of workers. */
+static void cd_bench_forkjoin(struct cd_bench_config *cfg)
+{
+	struct cd_bench_range	root;
+	struct cd_wq_wait_group	wg = CD_WQ_WAIT_GROUP_INITIALIZER;
+	uint64_t				*run_ns, t0, base_ns = 0, median;
+	struct cd_workqueue		*wq;
+	uint32_t				r, workers, leaves = cfg->jobs / 10;
+
+	run_ns = calloc(cfg->reps, sizeof(uint64_t));
+	assert(run_ns);
+
+	for (workers = 1; workers <= cfg->workers_max; workers *= 2) {
+		for (r = 0; r < cfg->reps; r++) {
+			wq = cd_wq_workqueue_default_create(workers, "bench forkjoin");
+			assert(wq != NULL);
+
+			root = (struct cd_bench_range) { wq, 0, leaves, cfg->cost_ns };
+			t0 = cd_bench_now_ns();
+			assert(cd_wq_spawn_user(wq, &wg, CD_WORK_ASYNC, &root, 0, cd_bench_range_f, NULL) == CD_ERR_OK);
+			assert(cd_wq_sync(wq, &wg) == CD_ERR_OK);
+			run_ns[r] = cd_bench_now_ns() - t0;
+
+			assert(cd_wq_workqueue_stop(wq) == CD_ERR_OK);
+			cd_wq_workqueue_free(&wq);
+		}
+
+		median = cd_bench_median(run_ns, cfg->reps);
+		if (workers == 1)
+			base_ns = median;
+		printf("{\"bench\":\"forkjoin\",\"workers\":%u,\"leaves\":%u,\"cost_ns\":%u,\"run_ns\":%lu,\"speedup\":%.2f}\n",
+				workers, leaves, cfg->cost_ns, median, (double) base_ns / (median ? median : 1));
+		fflush(stdout);
+	}
+
+	free(run_ns);
+}
+
+#define CD_BENCH_PAYLOAD_WORDS 6
+
+static int		cd_bench_tlb_fd[256];					/* dTLB load miss counter of each worker, -1 - not available */
+static uint32_t	cd_bench_gate;
+
+/* @brief   Open counter of dTLB load misses of calling thread, user space only. */
+static void* cd_bench_tlb_open(uint32_t worker_idx, void *arg)
+{
+	struct perf_event_attr attr;
+
+	(void) arg;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	cd_bench_tlb_fd[worker_idx] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	return NULL;
+}
+
+static void cd_bench_tlb_close(void *ctx, uint32_t worker_idx, void *arg)
+{
+	(void) ctx;
+	(void) arg;
+	if (cd_bench_tlb_fd[worker_idx] >= 0)
+		close(cd_bench_tlb_fd[worker_idx]);
+	cd_bench_tlb_fd[worker_idx] = -1;
+}
+
+/* @brief   Sum of counters of @workers, -1 if any of them couldn't be opened (no perf_event access). */
+static int64_t cd_bench_tlb_read(uint32_t workers)
+{
+	uint64_t	v, sum = 0;
+	uint32_t	i;
+
+	for (i = 0; i < workers; i++) {
+		if (cd_bench_tlb_fd[i] < 0 || read(cd_bench_tlb_fd[i], &v, sizeof(v)) != sizeof(v))
+			return -1;
+		sum += v;
+	}
+	return sum;
+}
+
+static void* cd_bench_gate_f(void *arg)
+{
+	(void) arg;
+	while (!__atomic_load_n(&cd_bench_gate, __ATOMIC_ACQUIRE))
+		usleep(50);
+	return NULL;
+}
+
+static void* cd_bench_payload_f(void *arg)
+{
+	uint64_t	*v = arg, sum = 0;
+	uint32_t	i;
+
+	for (i = 0; i < CD_BENCH_PAYLOAD_WORDS; i++)
+		sum += v[i];
+	__atomic_fetch_add(&cd_bench_done, 1 + (sum == 0), __ATOMIC_RELEASE);				/* sum is never 0, keeps the loads */
+	return NULL;
+}
+
+/* @brief   Drain of a queue filled up with works with inline payload, from malloc or from huge pages.
+ * @details Workers are held by gate jobs while the queue is filled, so the drain chases @cfg->jobs works
+ *          allocated up front. dTLB load misses of the workers are counted over the drain, with perf_event. */
+static void cd_bench_hugepage(struct cd_bench_config *cfg, int huge)
+{
+	struct cd_wq_queue_options	options = { 0 };
+	struct cd_alloc_huge		h;
+	struct cd_workqueue			*wq;
+	uint64_t					*run_ns, *miss_n, t0, payload[CD_BENCH_PAYLOAD_WORDS] = { 1, 2, 3, 4, 5, 6 }, hugetlb_n = 0, thp_n = 0;
+	int64_t						m0, m1;
+	uint32_t					r, i, workers = 2, perf = 1;
+
+	run_ns = calloc(cfg->reps, sizeof(uint64_t));
+	miss_n = calloc(cfg->reps, sizeof(uint64_t));
+	assert(run_ns && miss_n);
+
+	options.CD_WQ_QUEUE_OPTION_STOP = CD_WQ_QUEUE_OPTION_STOP_SOFT;
+	options.f_worker_init = cd_bench_tlb_open;
+	options.f_worker_deinit = cd_bench_tlb_close;
+
+	for (r = 0; r < cfg->reps; r++) {
+		if (huge) {
+			assert(cd_alloc_huge_init(&h) == CD_ERR_OK);
+			options.allocator = &h.allocator;
+		}
+		__atomic_store_n(&cd_bench_done, 0, __ATOMIC_RELEASE);
+		__atomic_store_n(&cd_bench_gate, 0, __ATOMIC_RELEASE);
+
+		wq = cd_wq_workqueue_create_options(workers, "bench hugepage", &options);
+		assert(wq != NULL);
+		for (i = 0; i < workers; i++)
+			assert(cd_wq_queue_user(wq, CD_WORK_ASYNC, NULL, 0, cd_bench_gate_f, NULL) == CD_ERR_OK);
+		for (i = 0; i < cfg->jobs; i++)
+			assert(cd_wq_queue_user_inline(wq, CD_WORK_ASYNC, payload, sizeof(payload), 0, cd_bench_payload_f, NULL) == CD_ERR_OK);
+
+		m0 = cd_bench_tlb_read(workers);
+		t0 = cd_bench_now_ns();
+		__atomic_store_n(&cd_bench_gate, 1, __ATOMIC_RELEASE);
+		cd_bench_wait_done(cfg->jobs);
+		run_ns[r] = cd_bench_now_ns() - t0;
+		m1 = cd_bench_tlb_read(workers);
+		if (m0 < 0 || m1 < 0)
+			perf = 0;
+		else
+			miss_n[r] = m1 - m0;
+
+		assert(cd_wq_workqueue_stop(wq) == CD_ERR_OK);
+		cd_wq_workqueue_free(&wq);
+		if (huge) {
+			hugetlb_n = h.hugetlb_pages_n;
+			thp_n = h.thp_pages_n;
+			cd_alloc_huge_deinit(&h);
+		}
+	}
+
+	printf("{\"bench\":\"hugepage\",\"allocator\":\"%s\",\"workers\":%u,\"jobs\":%u,\"drain_ns\":%lu,",
+			huge ? "huge" : "system", workers, cfg->jobs, cd_bench_median(run_ns, cfg->reps));
+	if (perf)
+		printf("\"dtlb_load_misses\":%lu,", cd_bench_median(miss_n, cfg->reps));
+	else
+		printf("\"dtlb_load_misses\":null,");										/* n/a: no perf_event access (perf_event_paranoid, container) */
+	printf("\"hugetlb_pages\":%lu,\"thp_pages\":%lu}\n", hugetlb_n, thp_n);
+	fflush(stdout);
+
+	free(miss_n);
+	free(run_ns);
+}
+
+static int cd_bench_selected(struct cd_bench_config *cfg, const char *name)
+{
+	return cfg->only == NULL || strcmp(cfg->only, name) == 0;
+}
+
+static void cd_bench_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-n jobs] [-w max workers] [-p max producers] [-r reps] [-s wakeup samples] [-c job cost ns] [-b enqueue|submit|latency|wakeup|startup|stop|scaling|forkjoin|hugepage]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct cd_bench_config cfg = {
+		.jobs = 100000,
+		.workers_max = 8,
+		.producers_max = 64,
+		.reps = 3,
+		.samples = 1000,
+		.cost_ns = 1000,
+		.only = NULL
+	};
+	uint32_t	n;
+	int			opt;
+
+	while ((opt = getopt(argc, argv, "n:w:p:r:s:c:b:h")) != -1) {
+		switch (opt) {
+			case 'n': cfg.jobs = strtoul(optarg, NULL, 10); break;
+			case 'w': cfg.workers_max = strtoul(optarg, NULL, 10); break;
+			case 'p': cfg.producers_max = strtoul(optarg, NULL, 10); break;
+			case 'r': cfg.reps = strtoul(optarg, NULL, 10); break;
+			case 's': cfg.samples = strtoul(optarg, NULL, 10); break;
+			case 'c': cfg.cost_ns = strtoul(optarg, NULL, 10); break;
+			case 'b': cfg.only = optarg; break;
+			default:
+				cd_bench_usage(argv[0]);
+				return -1;
+		}
+	}
+
+	if (cfg.jobs < 10 || cfg.workers_max == 0 || cfg.workers_max > 255 || cfg.producers_max == 0 || cfg.reps == 0 || cfg.samples == 0) {
+		cd_bench_usage(argv[0]);
+		return -1;
+	}
+
+	if (cd_bench_selected(&cfg, "enqueue")) {
+		for (n = 1; n <= cfg.producers_max && n <= 8; n *= 2)
+			cd_bench_enqueue(&cfg, "enqueue", 2, n);
+	}
+
+	if (cd_bench_selected(&cfg, "submit")) {								/* many producers, as many workers as they'd spread over */
+		for (n = 1; n <= cfg.producers_max; n *= 2)
+			cd_bench_enqueue(&cfg, "submit", cfg.workers_max, n);
+	}
+
+	if (cd_bench_selected(&cfg, "latency")) {
+		cd_bench_latency(&cfg, 1);
+		cd_bench_latency(&cfg, 4);
+	}
+
+	if (cd_bench_selected(&cfg, "wakeup"))
+		cd_bench_wakeup(&cfg);
+
+	if (cd_bench_selected(&cfg, "startup")) {
+		cd_bench_startup(&cfg, CD_WQ_QUEUE_OPTION_START_EAGER);
+		cd_bench_startup(&cfg, CD_WQ_QUEUE_OPTION_START_LAZY);
+	}
+
+	if (cd_bench_selected(&cfg, "stop")) {
+		cd_bench_stop(&cfg, 4, CD_WQ_QUEUE_OPTION_STOP_SOFT);
+		cd_bench_stop(&cfg, 4, CD_WQ_QUEUE_OPTION_STOP_HARD);
+	}
+
+	if (cd_bench_selected(&cfg, "scaling"))
+		cd_bench_scaling(&cfg);
+
+	if (cd_bench_selected(&cfg, "forkjoin"))
+		cd_bench_forkjoin(&cfg);
+
+	if (cd_bench_selected(&cfg, "hugepage")) {
+		cd_bench_hugepage(&cfg, 0);
+		cd_bench_hugepage(&cfg, 1);
+	}
+
+	return 0;
+}
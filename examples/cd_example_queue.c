@@ -46,6 +46,7 @@ int main(void)
 	struct cd_workqueue *wq = NULL;
 	struct task t[9] = { 0 };
 	struct cd_work *w[9] = { 0 };
+	struct cd_wq_wait_group wg = CD_WQ_WAIT_GROUP_INITIALIZER;
 
 	pthread_mutex_init(&counter_mutex, NULL);
 
@@ -59,6 +60,7 @@ int main(void)
 
 	for (int i = 0; i < 9; i++) {
 		w[i] = cd_wq_work_create(CD_WORK_ASYNC, (void *) &t[i], 0, my_function, NULL);
+		cd_wq_work_set_wait_group(w[i], &wg);
 	}
 
 	for (int i = 0; i < 9; i++) {
@@ -68,8 +70,8 @@ int main(void)
 		}
 	}
 
-	// Let the queue process at least 1 task
-	usleep(2000);
+	// Wait for all the tasks to be processed (sleeps once, woken by the last task)
+	cd_wq_wait_group_wait(&wg, 0);
 
 	// Note, cd_wq_workqueue_stop() must wait for workers to finish (or terminate) processing of tasks if any of them have not yet been processed.
 	// You can configure queue's behaviour in such cases with cd_wq_configure():
@@ -42,6 +42,7 @@
 
 #include "cd_list.h"
 #include "cd_hash.h"
+#include "cd_alloc.h"
 #include "cd_wq.h"
 #include "cd_log.h"
 
@@ -64,7 +65,8 @@ enum cd_error {
 	CD_ERR_FOPEN_STDOUT,
 	CD_ERR_FOPEN_STDERR,
 	CD_ERR_FREOPEN_STDOUT,
-	CD_ERR_FREOPEN_STDERR
+	CD_ERR_FREOPEN_STDERR,
+	CD_ERR_FULL				/* bounded queue or window has no room now, retry once it drains */
 };
 
 
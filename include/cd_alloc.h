@@ -0,0 +1,110 @@
+/**
+ * cd_alloc.h - Pluggable memory allocation
+ *
+ * Part of the libcd - bringing you support for C programs with queue processors, from Data And Signal's Piotr Gregor
+ *
+ * Data And Signal - IT Solutions
+ * http://www.dataandsignal.com
+ * 2020
+ *
+ */
+
+#ifndef CD_ALLOC_H
+#define CD_ALLOC_H
+
+
+#include "cd.h"
+
+
+/* @brief   Subsystem an internal allocation is made for, passed to the allocator so it can account or route by it. */
+enum cd_alloc_tag {
+	CD_ALLOC_TAG_WORKQUEUE,     /* workqueues, groups, worker tables, names */
+	CD_ALLOC_TAG_WORK,          /* cd_work created by the library */
+	CD_ALLOC_TAG_QUEUE,         /* worker heaps, completion rings, reorder buffers, strands, rate limits */
+	CD_ALLOC_TAG_SCRATCH,       /* worker arenas, accumulators, trace buffers */
+	CD_ALLOC_TAG_LOG,
+	CD_ALLOC_TAG_N
+};
+
+/* @brief   Allocator used for all memory libcd allocates itself.
+ * @details f_alloc returns @size bytes aligned to @align (a power of 2, at least sizeof(void*)), or NULL.
+ *          f_free gets pointers returned by f_alloc of the same allocator, with the same @tag, and never NULL.
+ *          Both may be called concurrently from any thread. Objects remember the allocator they were
+ *          created with and release their memory to it, so it must outlive them. */
+struct cd_allocator {
+	void*   (*f_alloc)(void *ctx, size_t size, size_t align, enum cd_alloc_tag tag);
+	void    (*f_free)(void *ctx, void *p, enum cd_alloc_tag tag);
+	void    *ctx;
+};
+
+extern const struct cd_allocator cd_alloc_system;	/* malloc, aligned_alloc and free */
+
+/* @brief   Set allocator used by objects created from now on, unless they are given their own. NULL - cd_alloc_system. */
+void cd_alloc_set_default(const struct cd_allocator *a);
+const struct cd_allocator* cd_alloc_get_default(void);
+
+/* @brief   Allocate from @a, NULL @a - from the default allocator. */
+void* cd_alloc(const struct cd_allocator *a, size_t size, enum cd_alloc_tag tag);
+void* cd_alloc_aligned(const struct cd_allocator *a, size_t size, size_t align, enum cd_alloc_tag tag);
+char* cd_alloc_strdup(const struct cd_allocator *a, const char *s, enum cd_alloc_tag tag);
+void cd_free(const struct cd_allocator *a, void *p, enum cd_alloc_tag tag);
+
+const char* cd_alloc_tag_name(enum cd_alloc_tag tag);
+
+struct cd_alloc_counters {
+	uint64_t        bytes;          /* allocated and not freed yet */
+	uint64_t        bytes_peak;
+	uint64_t        allocs_n;
+	uint64_t        frees_n;
+};
+
+/* @brief   Debug allocator, counts bytes and allocations per subsystem on top of @backing.
+ * @details Each allocation carries a small header with its size, so frees are accounted exactly.
+ *          Counters are updated atomically and can be read at any time. */
+struct cd_alloc_debug {
+	struct cd_allocator         allocator;      /* pass &allocator wherever struct cd_allocator is wanted */
+	const struct cd_allocator   *backing;
+	struct cd_alloc_counters    tags[CD_ALLOC_TAG_N];
+};
+
+/* @brief   @backing NULL - cd_alloc_system. */
+void cd_alloc_debug_init(struct cd_alloc_debug *d, const struct cd_allocator *backing);
+
+/* @brief   Number of allocations not freed yet, over all subsystems. */
+uint64_t cd_alloc_debug_outstanding(const struct cd_alloc_debug *d);
+
+void cd_alloc_debug_print(const struct cd_alloc_debug *d, FILE *stream);
+
+
+#define CD_ALLOC_HUGE_PAGE (2 * 1024 * 1024)
+#define CD_ALLOC_HUGE_MIN_SHIFT 4			/* smallest block of huge page allocator is 16 bytes */
+#define CD_ALLOC_HUGE_CLASSES 13			/* 16 B .. 64 KB, bigger allocations get their own mapping */
+
+struct cd_alloc_huge_chunk;
+
+/* @brief   Allocator backed by 2 MB huge pages, for workqueue's memory (worker tables, queues, works).
+ * @details Memory is mapped in 2 MB chunks, with MAP_HUGETLB if the system has huge pages reserved
+ *          (vm.nr_hugepages), otherwise as anonymous memory advised with MADV_HUGEPAGE for transparent huge pages.
+ *          Each chunk is carved into blocks of one power of 2 size class, so blocks of the same kind sit
+ *          densely in few pages and a working set of many small objects needs few TLB entries.
+ *          Freed blocks are reused for the same class, their chunks stay mapped until cd_alloc_huge_deinit().
+ *          Allocations bigger than the largest class get a mapping of their own, unmapped when freed.
+ *          Alignment of CD_ALLOC_HUGE_PAGE or more is not supported, such allocation fails (NULL). */
+struct cd_alloc_huge {
+	struct cd_allocator         allocator;      /* pass &allocator wherever struct cd_allocator is wanted */
+	pthread_mutex_t             lock;
+	void                        *free[CD_ALLOC_HUGE_CLASSES];      /* freed blocks of each class, linked through their first word */
+	struct cd_alloc_huge_chunk  *current[CD_ALLOC_HUGE_CLASSES];   /* chunk being carved for each class */
+	struct cd_alloc_huge_chunk  *chunks;        /* all mapped chunks */
+	uint8_t                     hugetlb;        /* try MAP_HUGETLB, cleared once it fails */
+	uint64_t                    hugetlb_pages_n;    /* mapped 2 MB pages from huge page pool */
+	uint64_t                    thp_pages_n;        /* mapped 2 MB ranges advised for transparent huge pages */
+};
+
+enum cd_error cd_alloc_huge_init(struct cd_alloc_huge *h);
+
+/* @brief   Unmap all memory, nothing allocated from @h may be in use. */
+void cd_alloc_huge_deinit(struct cd_alloc_huge *h);
+
+
+#endif // CD_ALLOC_H
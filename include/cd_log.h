@@ -21,6 +21,8 @@
 
 
 void cd_util_calc_timespec_diff(struct timespec *t1, struct timespec *t2, struct timespec *dt) __attribute__ ((nonnull(1,2,3)));
+uint64_t cd_util_now_ns(void);									/* CLOCK_MONOTONIC time in nanoseconds */
+void cd_util_ns_to_timespec(uint64_t ns, struct timespec *ts) __attribute__ ((nonnull(2)));
 int cd_util_dt(char *buf);
 int cd_util_dt_detail(char *buf);
 int cd_util_openlog(const char *dir, const char *name);
@@ -15,6 +15,8 @@
 
 #include "cd.h"
 #include "cd_list.h"
+#include "cd_hash.h"
+#include "cd_alloc.h"
 
 
 enum cd_work_sync_async_type {
@@ -22,54 +24,461 @@ enum cd_work_sync_async_type {
 	CD_WORK_ASYNC               /* worker thread is not responsible for the calling of user's destructor - call to user's destructor must be handled by work's processing callback  */
 };
 
+struct cd_work;
+struct cd_wq_ordered;
+struct cd_wq_wait_group;
+
+#define CD_WQ_WORKER_NAME_LEN 16	/* including terminating null, kernel's limit for thread names */
+
+/* @brief   Attributes of worker threads. Zeroed fields mean system defaults. */
+struct cd_wq_worker_attr {
+	size_t  stack_size;                     /* rounded up to page size and PTHREAD_STACK_MIN */
+	size_t  guard_size;
+	int     sched_policy;                   /* SCHED_OTHER, SCHED_BATCH, SCHED_IDLE, or (needs CAP_SYS_NICE) SCHED_FIFO, SCHED_RR */
+	int     sched_priority;                 /* for SCHED_FIFO and SCHED_RR */
+	char    name[CD_WQ_WORKER_NAME_LEN];    /* thread name prefix, "/<worker index>" is appended, empty - workqueue's name */
+};
+
+/* @brief   Options of the workqueue. First two members keep their place and meaning of the original struct,
+ *          newer ones are only ever appended, so code which sets them by name or zeroes the struct keeps working. */
 struct cd_wq_queue_options {
 	uint8_t CD_WQ_QUEUE_OPTION_STOP;
-	uint8_t CD_WQ_QUEUE_OPTION_SOME_OTHER_OPTION;
+	union {
+		uint8_t CD_WQ_QUEUE_OPTION_ORDER;
+		uint8_t CD_WQ_QUEUE_OPTION_SOME_OTHER_OPTION;	/* deprecated, former name of the (then unused) CD_WQ_QUEUE_OPTION_ORDER */
+	};
+	uint8_t CD_WQ_QUEUE_OPTION_START;
+	uint8_t CD_WQ_QUEUE_OPTION_DTOR;
+	const struct cd_wq_worker_attr *worker_attr;	/* applied to all workers by init, NULL - system defaults, ignored for grouped workqueues */
+	uint32_t arena_size;							/* initial size of worker's scratch arena, 0 - CD_WQ_ARENA_SIZE */
+	void* (*f_worker_init)(uint32_t worker_idx, void *worker_arg);	/* called on worker's thread when it starts, returns worker's context, may be NULL */
+	void (*f_worker_deinit)(void *ctx, uint32_t worker_idx, void *worker_arg);	/* called on worker's thread when it exits, may be NULL */
+	void *worker_arg;
+	const struct cd_allocator *allocator;			/* for all memory of the workqueue and of works queued with cd_wq_queue_user*(), NULL - default allocator */
+	void (*f_expired)(struct cd_work *work);	/* called for work dropped because its deadline passed before it started, may be NULL */
 };
 
 #define CD_WQ_QUEUE_OPTION_STOP_HARD 0
 #define CD_WQ_QUEUE_OPTION_STOP_SOFT 1
 
+#define CD_WQ_QUEUE_OPTION_ORDER_FIFO 0		/* workers process their queues in order of enqueuing */
+#define CD_WQ_QUEUE_OPTION_ORDER_EDF 1		/* workers process their queues earliest deadline first, work with no deadline goes last (in FIFO order) */
+
 #define cd_wq_set_option(wq, opt, val) if (wq) { wq->options.##opt = val; }
 
 #define cd_wq_clear_flag(wq, flag_mask) if (wq) { wq->flags &= (~flag) }
 #define cd_wq_configure(wq, flag, val) if (wq) { cd_wq_clear_flag(wq, flag_mask); wq->flags |= (val << flag) }
 
+#define CD_WQ_DEQUE_SIZE 256		/* capacity of worker's local deque, must be a power of 2 */
+#define CD_WQ_PRODUCER_CURSORS_BITS 3	/* log2 of number of workqueues each producer thread keeps own round-robin position for */
+#define CD_WQ_QUEUE_OPTION_START_EAGER 0	/* all workers are started by init */
+#define CD_WQ_QUEUE_OPTION_START_LAZY 1		/* workers are started on demand (when work is queued and no started worker is idle), up to workers_n */
+
+#define CD_WQ_QUEUE_OPTION_DTOR_INLINE 0		/* worker calls SYNC destructor right after work's callback */
+#define CD_WQ_QUEUE_OPTION_DTOR_DEFERRED 1	/* SYNC destructors are called in batches by workqueue's reclaim thread, workers go on to next job */
+
+#define CD_WQ_HEAP_INIT_SIZE 64		/* initial capacity of worker's EDF heap, it grows as needed */
+#define CD_WQ_COALESCE_BITS 8		/* log2 of number of buckets in coalescing index */
+#define CD_WQ_COALESCE_LOCKS 16		/* number of locks guarding buckets of coalescing index, must be a power of 2 */
+#define CD_WQ_RATE_TYPES_BITS 4		/* log2 of number of buckets in the table of per user_data_type rate limits */
+
+enum cd_wq_rate_policy {
+	CD_WQ_RATE_HOLD,				/* work exceeding the rate is held in the workqueue until it conforms */
+	CD_WQ_RATE_REJECT				/* work exceeding the rate is rejected by cd_wq_queue_work() with CD_ERR_BUSY */
+};
+
+/* @brief   Token bucket, kept as theoretical arrival time of the next work (GCRA).
+ * @details Work conforms at time t if t >= tat - burst_ns, which is the same as having a token in
+ *          a bucket of size burst refilled with one token every interval_ns. */
+struct cd_wq_rate_bucket {
+	uint64_t        interval_ns;	/* 1 s / rate, 0 - no limit */
+	uint64_t        burst_ns;		/* (burst - 1) * interval_ns */
+	uint64_t        tat;			/* theoretical arrival time, CLOCK_MONOTONIC ns */
+};
+
+struct cd_wq_rate_type {
+	struct cd_hlist_node		node;
+	int							user_data_type;
+	struct cd_wq_rate_bucket	bucket;
+};
+
+/* @brief   Chase-Lev work stealing deque.
+ * @details Owner pushes and pops at the bottom (LIFO), other workers steal from the top (FIFO).
+ *          Holds the work submitted by the jobs running on the owning worker. */
+struct cd_wq_deque {
+	int64_t         top;		/* written by thieves */
+	char            pad[64 - sizeof(int64_t)];	/* keep top and bottom on separate cache lines */
+	int64_t         bottom;		/* written by owner only */
+	struct cd_work  *buf[CD_WQ_DEQUE_SIZE];
+};
+
+/* @brief   Binary min-heap of works ordered by (deadline, seq), worker's queue in CD_WQ_QUEUE_OPTION_ORDER_EDF mode. */
+struct cd_wq_heap {
+	const struct cd_allocator *allocator;
+	struct cd_work  **v;
+	uint32_t        n;
+	uint32_t        size;
+};
+
+#define CD_WQ_ARENA_SIZE (64 * 1024)			/* default size of worker's scratch arena */
+#define CD_WQ_ARENA_MAX_SIZE (4 * 1024 * 1024)	/* arena grows up to this size when jobs need more than it has */
+#define CD_WQ_ARENA_ALIGN 16
+
+struct cd_wq_arena_chunk;
+
+/* @brief   Bump-pointer arena for scratch allocations of jobs, see cd_wq_arena_alloc(). */
+struct cd_wq_arena {
+	const struct cd_allocator *allocator;
+	char            *base;      /* allocated on first use */
+	size_t          size;
+	size_t          used;
+	struct cd_wq_arena_chunk *chunks;	/* allocations which didn't fit, freed on reset */
+	size_t          spilled;    /* bytes allocated in chunks since last reset */
+};
+
+/* @brief   Use of worker's mutex and condition variable.
+ * @details Collected only by library built with CD_WQ_LOCK_STATS defined (make lockstats), zero otherwise.
+ *          Updated with worker's mutex held. */
+struct cd_wq_lock_stats {
+	uint64_t        acquired_n;     /* mutex acquisitions */
+	uint64_t        contended_n;    /* acquisitions which found the mutex taken */
+	uint64_t        wait_ns;        /* time spent waiting for the mutex in contended acquisitions */
+	uint64_t        signaled_n;     /* condition variable signals sent to the worker */
+	uint64_t        parked_n;       /* waits of the worker on its condition variable */
+	uint64_t        parked_ns;      /* time the worker spent in them */
+};
+
 struct cd_worker {              /* thread wrapper */
 	struct cd_wq_queue_options	options;
 	uint8_t         idx;        /* index in workqueue table */
 	pthread_t       tid;
 	cd_fifo_queue    queue;      /* queue of work structs */
+	struct cd_wq_heap heap;      /* queue of work structs in CD_WQ_QUEUE_OPTION_ORDER_EDF mode */
+	uint64_t        seq;        /* number of works enqueued to this worker */
 	pthread_mutex_t mutex;
 	pthread_cond_t  signal;     /* signaled when new item is enqueued to this worker's queue */
 	uint8_t         active;		/* successfully created and waiting for work */
+	uint8_t         idle;       /* parked on the signal, waiting for work */
+	uint8_t         stopping;   /* told to stop, not joined yet */
 	struct cd_workqueue *wq;    /* owner */
+	struct cd_wq_deque local;   /* work submitted from inside of this worker's jobs */
+	uint64_t        done_n;     /* number of works processed, written by this worker only */
+	struct cd_wq_arena arena;   /* scratch memory of jobs, reset after each job */
+	void            *ctx;       /* returned by f_worker_init, owned by this worker's thread */
+	struct cd_wq_lock_stats lock_stats;
+};
+
+/* @brief   Result of processed work, see cd_wq_reap_completions(). */
+struct cd_wq_completion {
+	void            *user_data;     /* for identification only, SYNC work's user data has already been destructed */
+	int             user_data_type;
+	void            *ret;           /* value returned by work's f */
+	uint64_t        submit_ns;      /* CLOCK_MONOTONIC ns */
+	uint64_t        start_ns;
+	uint64_t        end_ns;
+};
+
+struct cd_wq_completion_cell {
+	uint64_t                seq;    /* position the cell is ready for, see cd_wq_completion_post() */
+	struct cd_wq_completion c;
+};
+
+/* @brief   Bounded lock-free MPMC ring of completions (Vyukov's queue).
+ * @details Workers post at the tail, reapers take from the head. Completions which don't fit
+ *          go to overflow list (under a mutex), so workers never wait for reapers. */
+struct cd_wq_completion_ring {
+	uint64_t                        head;       /* next position to reap */
+	char                            pad[64 - sizeof(uint64_t)];
+	uint64_t                        tail;       /* next position to post */
+	char                            pad2[64 - sizeof(uint64_t)];
+	uint64_t                        mask;       /* number of cells - 1 */
+	struct cd_wq_completion_cell    *cells;
+	int                             fd;         /* eventfd signaled on each completion, -1 if not used */
+	pthread_mutex_t                 overflow_lock;
+	cd_fifo_queue                   overflow;   /* finished works carrying their completion */
+	uint32_t                        overflow_pending_n;
+	uint64_t                        overflow_n; /* number of completions which didn't fit into the ring */
+};
+
+#define CD_WQ_TRACE_MAGIC "CDWQTRC1"
+#define CD_WQ_TRACE_VERSION 1
+#define CD_WQ_TRACE_BUF_N 256		/* records buffered by each worker before they are written */
+#define CD_WQ_TRACE_NO_WORKER 0xFFFF	/* job was run by a thread other than workqueue's worker (group thread) */
+
+/* @brief   Trace file starts with this header, followed by records. Host byte order. */
+struct cd_wq_trace_header {
+	char            magic[8];
+	uint32_t        version;
+	uint32_t        workers_n;
+	uint64_t        start_ns;       /* CLOCK_MONOTONIC ns at which trace started, times in records are relative to it */
+};
+
+/* @brief   Trace record of one processed job. */
+struct cd_wq_trace_record {
+	uint64_t        submit_ns;
+	uint64_t        start_ns;
+	uint64_t        end_ns;
+	int32_t         user_data_type;
+	uint16_t        worker;         /* index of worker which ran the job, CD_WQ_TRACE_NO_WORKER */
+	uint16_t        pad;
+};
+
+struct cd_wq_trace_buf {
+	struct cd_wq_trace_record rec[CD_WQ_TRACE_BUF_N];
+	uint32_t        n;
+} __attribute__((aligned(64)));
+
+/* @brief   Workload tracer, each worker fills its own buffer, full buffers are appended to the file. */
+struct cd_wq_trace {
+	int             fd;
+	uint64_t        start_ns;
+	uint32_t        bufs_n;         /* workers_n + shared buffer */
+	struct cd_wq_trace_buf *bufs;
+	pthread_mutex_t lock;           /* guards the file and the shared buffer (the last one) */
+	uint64_t        records_n;      /* written to the file */
+	uint64_t        lost_n;         /* records which failed to be written */
+};
+
+/* @brief   Thread pool shared by many workqueues.
+ * @details Workqueues attached to the group have no threads of their own. Group's threads serve
+ *          attached queues which have pending work in weighted deficit round robin: in each round
+ *          a queue may run up to its weight of jobs before the next queue is served. */
+struct cd_wq_group {
+	const struct cd_allocator *allocator;   /* default allocator when group was created */
+	const char          *name;
+	pthread_t           *threads;
+	uint32_t            threads_n;          /* number of successfully started threads */
+	uint32_t            threads_idle_n;     /* number of threads waiting for work */
+	uint8_t             active;             /* accepting and processing work */
+	pthread_mutex_t     mutex;              /* guards the group and queued work of all attached workqueues */
+	pthread_cond_t      signal;             /* signaled when work is queued */
+	pthread_cond_t      drained;            /* signaled when stopping workqueue has no more work queued or running */
+	struct cd_list_head ready;              /* attached workqueues which have work queued, in round robin order */
+	uint32_t            wqs_n;              /* number of attached workqueues */
 };
 
 struct cd_workqueue {
 	struct cd_wq_queue_options	options;
+	const struct cd_allocator *allocator;   /* resolved options.allocator */
 	uint8_t             running;            /* 0 - no, 1 - yes */
 	struct cd_worker    *workers;
 	uint8_t             workers_n;          /* number of worker threads */
-	uint32_t            workers_active_n;   /* number of active worker threads: successfully created and accepting work */
+	uint32_t            workers_active_n;   /* number of active worker threads: successfully created and accepting work from any thread */
 	const char          *name;
 	uint8_t             first_active_worker_idx;
-	uint8_t             next_worker_idx_to_use; /* index of next worker to use for enquing the work in round-robin fashion */
+	uint8_t             next_worker_idx_to_use; /* deprecated, unused: producers go round-robin from their own (thread-local) cursors */
+	uint32_t            workers_idle_n;     /* number of workers parked waiting for work */
+	struct cd_hlist_head coalesce_index[1 << CD_WQ_COALESCE_BITS];	/* pending coalescing works by key */
+	pthread_mutex_t     coalesce_lock[CD_WQ_COALESCE_LOCKS];			/* bucket i is guarded by lock i % CD_WQ_COALESCE_LOCKS */
+	uint64_t            coalesced_n;        /* number of works merged into pending work with the same key */
+	pthread_mutex_t     rate_lock;          /* guards rate limits and throttled queue */
+	uint8_t             rate_limited;       /* any rate limit set */
+	uint8_t             rate_policy;        /* enum cd_wq_rate_policy */
+	struct cd_wq_rate_bucket rate;          /* limit of the whole queue */
+	struct cd_hlist_head rate_types[1 << CD_WQ_RATE_TYPES_BITS];	/* limits of user_data_types */
+	cd_fifo_queue       throttled;          /* held work, ordered by the time it conforms to the limits */
+	uint32_t            throttled_n;
+	uint64_t            rejected_n;         /* number of works rejected by rate limits */
+	uint64_t            expired_n;          /* number of works dropped because their deadline passed */
+	struct cd_wq_group  *group;             /* shared thread pool processing this queue, NULL if it has own workers */
+	uint32_t            weight;             /* jobs per round robin round in the group */
+	uint32_t            deficit;            /* jobs left in current round */
+	cd_fifo_queue       group_queue;        /* queued work, guarded by group's mutex */
+	struct cd_list_head group_link;         /* link in group's ready list while work is queued */
+	uint32_t            group_running_n;    /* number of works being processed by group's threads */
+	uint8_t             group_draining;     /* stopped, but its running jobs may still queue work, guarded by group's mutex */
+	struct cd_wq_completion_ring *completions;	/* results of processed work, NULL if not enabled */
+	struct cd_wq_trace  *trace;             /* NULL if not tracing */
+	struct cd_work      *reclaim_head;      /* stack of processed works waiting for their SYNC destructors (CD_WQ_QUEUE_OPTION_DTOR_DEFERRED) */
+	pthread_t           reclaim_tid;
+	pthread_mutex_t     reclaim_lock;
+	pthread_cond_t      reclaim_signal;     /* signaled when stack becomes not empty */
+	uint8_t             reclaim_running;    /* reclaim thread accepts works */
+	uint64_t            deferred_n;         /* number of works whose destructors have been deferred */
+	pthread_mutex_t     stop_lock;          /* worker threads are started under it, they signal their exit under it */
+	pthread_cond_t      stop_signal;        /* signaled by each worker thread on exit */
+	uint32_t            workers_exited_n;   /* guarded by stop_lock */
+	struct cd_wq_worker_attr worker_attr;   /* effective attributes of worker threads */
 };
 typedef struct cd_workqueue cd_workqueue_t;
 
+struct cd_wq_stats {
+	uint32_t            workers_n;
+	uint32_t            workers_active_n;
+	uint32_t            workers_idle_n;
+	uint64_t            coalesced_n;
+	uint32_t            throttled_n;
+	uint64_t            rejected_n;
+	uint64_t            expired_n;
+	uint64_t            completions_overflow_n;
+	struct cd_wq_worker_attr worker_attr;   /* effective attributes of worker threads, zeroed for grouped workqueues */
+	uint64_t            deferred_n;
+	uint8_t             lock_stats_enabled;     /* library is built with CD_WQ_LOCK_STATS */
+	struct cd_wq_lock_stats lock_stats;         /* sum over workers, see cd_wq_worker_lock_stats() for each of them */
+};
+
 /* @brief   Start the worker threads.
  * @details After this returns the @workers_n variable in workqueue is set to the numbers of successfully created
  *          and now running threads. It isn't neccessary the same number that has been passed to this function. */
 enum cd_error cd_wq_workqueue_init(struct cd_workqueue *q, uint32_t workers_n, const char *name, uint8_t option_stop);
+enum cd_error cd_wq_workqueue_init_options(struct cd_workqueue *wq, uint32_t workers_n, const char *name, const struct cd_wq_queue_options *options);
 enum cd_error cd_wq_workqueue_default_init(struct cd_workqueue *wq, uint32_t workers_n, const char *name);
 enum cd_error cd_wq_workqueue_deinit(struct cd_workqueue *wq);
 
 enum cd_error cd_wq_workqueue_free(struct cd_workqueue **wq);
 struct cd_workqueue* cd_wq_workqueue_create(uint32_t workers_n, const char *name, uint8_t option_stop);
+struct cd_workqueue* cd_wq_workqueue_create_options(uint32_t workers_n, const char *name, const struct cd_wq_queue_options *options);
 struct cd_workqueue* cd_wq_workqueue_default_create(uint32_t workers_n, const char *name);
+/* @brief   Stop the workqueue and join its workers.
+ * @details Work from other threads is rejected (CD_ERR_WORKQUEUE_ACTIVE) as soon as stop starts. With CD_WQ_QUEUE_OPTION_STOP_SOFT
+ *          jobs still running or draining may go on submitting to the workqueue (spawn children, requeue strand runner, etc.),
+ *          their work stays with the worker running them, which processes it before it exits. */
 enum cd_error cd_wq_workqueue_stop(struct cd_workqueue *wq);
 
+/* @brief   Start the thread pool shared by workqueues created with cd_wq_workqueue_create_grouped().
+ * @details If @threads_n is 0, one thread per online CPU is started. */
+struct cd_wq_group* cd_wq_group_create(uint32_t threads_n, const char *name);
+
+/* @brief   Stop the group's threads, after all work queued to attached workqueues has been processed. */
+enum cd_error cd_wq_group_stop(struct cd_wq_group *g);
+
+/* @brief   Free the group. All workqueues attached to it must have been freed before, CD_ERR_BUSY otherwise. */
+enum cd_error cd_wq_group_free(struct cd_wq_group **g);
+
+/* @brief   Create a workqueue with no threads of its own, processed by the threads of group @g.
+ * @details In each round robin round the queue runs up to @weight jobs (0 is treated as 1), so its share
+ *          of group's threads is proportional to its weight whenever other queues have work too.
+ *          @options may be NULL for CD_WQ_QUEUE_OPTION_STOP_SOFT. Stopping the workqueue stops only it:
+ *          SOFT waits for its queued work to be processed (including work queued meanwhile by its own jobs),
+ *          HARD cancels queued work and waits for running work.
+ *          Grouped queues process their work in FIFO order (CD_WQ_QUEUE_OPTION_ORDER is ignored)
+ *          and support CD_WQ_RATE_REJECT rate limits only. */
+struct cd_workqueue* cd_wq_workqueue_create_grouped(struct cd_wq_group *g, uint32_t weight, const char *name, const struct cd_wq_queue_options *options);
+enum cd_error cd_wq_workqueue_init_grouped(struct cd_workqueue *wq, struct cd_wq_group *g, uint32_t weight, const char *name, const struct cd_wq_queue_options *options);
+
+/* @brief   Context of the worker running the calling job, as returned by its f_worker_init.
+ * @details Only the worker's thread uses it, so jobs can keep per-worker buffers, connections and counters
+ *          in it with no locking. Worker hooks aren't supported for grouped workqueues.
+ * @return  NULL if not called from a job of workqueue with f_worker_init. */
+void* cd_wq_worker_context(void);
+
+/* @brief   Index of the worker running the calling job, -1 if not called from a job of workqueue with its own workers. */
+int cd_wq_worker_idx(void);
+
+#define CD_WQ_CACHE_LINE 64
+
+enum cd_wq_reduce_op {
+	CD_WQ_REDUCE_SUM,
+	CD_WQ_REDUCE_MIN,
+	CD_WQ_REDUCE_MAX,
+	CD_WQ_REDUCE_CUSTOM         /* user's f_reduce, must be associative and commutative */
+};
+
+/* @brief   Accumulator's slot, one per worker, alone on its cache line. */
+struct cd_wq_shard {
+	int64_t         v;
+	char            pad[CD_WQ_CACHE_LINE - sizeof(int64_t)];
+} __attribute__((aligned(CD_WQ_CACHE_LINE)));
+
+/* @brief   Sharded accumulator tied to workqueue's workers.
+ * @details Each worker updates its own slot with plain loads and stores, so updates from jobs neither lock
+ *          nor bounce cache lines. Updates from other threads (including group threads) go to a shared slot under lock. */
+struct cd_wq_accumulator {
+	struct cd_workqueue *wq;
+	enum cd_wq_reduce_op op;
+	int64_t         (*f_reduce)(int64_t a, int64_t b);
+	int64_t         identity;
+	const struct cd_allocator *allocator;	/* workqueue's, accumulator may outlive the workqueue */
+	uint32_t        shards_n;   /* workers_n + shared slot */
+	struct cd_wq_shard *shards;
+	pthread_mutex_t lock;       /* guards the shared slot (the last one) */
+};
+
+/* @brief   Create accumulator for the jobs of @wq.
+ * @details @f_reduce and @identity are used only for CD_WQ_REDUCE_CUSTOM (@identity must be such
+ *          that f_reduce(identity, v) == v), other operations have their own. */
+struct cd_wq_accumulator* cd_wq_accumulator_create(struct cd_workqueue *wq, enum cd_wq_reduce_op op, int64_t (*f_reduce)(int64_t a, int64_t b), int64_t identity);
+void cd_wq_accumulator_free(struct cd_wq_accumulator **acc);
+
+/* @brief   Combine @v into the calling worker's slot. */
+void cd_wq_accumulator_update(struct cd_wq_accumulator *acc, int64_t v);
+
+/* @brief   Combine all slots. Updates made concurrently with the read may or may not be included. */
+int64_t cd_wq_accumulator_read(struct cd_wq_accumulator *acc);
+
+/* @brief   Set all slots to the identity. Must not run concurrently with updates. */
+void cd_wq_accumulator_reset(struct cd_wq_accumulator *acc);
+
+/* @brief   Allocate scratch memory which lives until the job calling this returns.
+ * @details Memory comes from the calling worker's bump-pointer arena (aligned to CD_WQ_ARENA_ALIGN), which is
+ *          reset after each job in O(1), so it mustn't be freed, nor outlive the job (not even by being passed
+ *          to the work it submits). Allocations which don't fit fall back to malloc and the arena grows on reset
+ *          to fit them next time. Strand's jobs share one arena reset per batch. Jobs run by a worker helping in
+ *          cd_wq_sync() allocate from the arena of the job which waits, they don't reset it.
+ * @return  NULL if not called from a job, or if out of memory. */
+void* cd_wq_arena_alloc(size_t size);
+
+/* @brief   Start up to @workers_n workers (0 for all) of the CD_WQ_QUEUE_OPTION_START_LAZY workqueue before traffic arrives.
+ * @details No-op for workers which are running already. Not supported for grouped workqueues.
+ * @return  CD_ERR_OK if requested number of workers is running. */
+enum cd_error cd_wq_workqueue_prewarm(struct cd_workqueue *wq, uint32_t workers_n);
+
+/* @brief   Outcome of cd_wq_workqueue_stop_timeout(). */
+struct cd_wq_stop_report {
+	uint64_t            drained_n;          /* works processed while draining */
+	uint64_t            dropped_n;          /* works cancelled after the timeout (SYNC destructors have been called) */
+	uint8_t             timed_out;          /* drain didn't finish in time */
+	uint64_t            duration_ns;
+};
+
+/* @brief   Stop the workqueue in two phases: drain for at most @timeout_ns, then cancel the rest.
+ * @details Intake stops at once and all workers are told to drain in parallel (regardless of CD_WQ_QUEUE_OPTION_STOP,
+ *          work held by rate limits is waited for too). If they haven't finished by the timeout, they are switched
+ *          to HARD stop and exit after their current job, which is the only thing stop waits for then. Work left
+ *          in queues is cancelled before this returns. @report may be NULL. */
+enum cd_error cd_wq_workqueue_stop_timeout(struct cd_workqueue *wq, uint64_t timeout_ns, struct cd_wq_stop_report *report);
+
+/* @brief   Limit the rate at which work is admitted to @rate works per second, with bursts of up to @burst works.
+ * @details Rate of 0 removes the limit. With CD_WQ_RATE_HOLD excess work is accepted and held in the workqueue
+ *          until it conforms, then picked up by the first free worker (workers never sleep in place of it).
+ *          With CD_WQ_RATE_REJECT excess work is rejected at submit time with CD_ERR_BUSY and stays owned by the caller.
+ *          The policy applies to per user_data_type limits too. */
+enum cd_error cd_wq_workqueue_set_rate_limit(struct cd_workqueue *wq, uint32_t rate, uint32_t burst, enum cd_wq_rate_policy policy);
+
+/* @brief   Limit the rate of works of given @user_data_type, on top of the limit of the whole queue. */
+enum cd_error cd_wq_workqueue_set_type_rate_limit(struct cd_workqueue *wq, int user_data_type, uint32_t rate, uint32_t burst);
+
+/* @brief   Post result of each work processed by the workqueue to a completion ring of @size entries (rounded up to a power of 2).
+ * @details Call before any work is queued. Results are taken in batches with cd_wq_reap_completions() instead of being
+ *          passed back by each job. If @use_eventfd is set, an eventfd is signaled on each completion,
+ *          see cd_wq_completion_fd(). Results which don't fit into the ring are kept in an overflow list, never dropped. */
+enum cd_error cd_wq_workqueue_enable_completions(struct cd_workqueue *wq, uint32_t size, int use_eventfd);
+
+/* @brief   Take up to @max results of processed work into @out, without blocking.
+ * @return  Number of results taken. Safe to call from many threads. */
+uint32_t cd_wq_reap_completions(struct cd_workqueue *wq, struct cd_wq_completion *out, uint32_t max);
+
+/* @brief   Descriptor which becomes readable when there are completions to reap (poll/epoll it), -1 if not enabled.
+ * @details cd_wq_reap_completions() resets it, reap until it returns less than asked for before waiting again. */
+int cd_wq_completion_fd(struct cd_workqueue *wq);
+
+/* @brief   Record submit time, user_data_type, worker and start/end times of each processed job into file at @path.
+ * @details Call before any work is queued. Jobs dropped (expired, cancelled) aren't recorded. Replay the trace
+ *          with bench/cdbenchreplay. */
+enum cd_error cd_wq_workqueue_trace_start(struct cd_workqueue *wq, const char *path);
+
+/* @brief   Write out buffered records and close the trace file. Call after the workqueue has been stopped
+ *          (CD_ERR_BUSY otherwise), workqueue's deinit does it too.
+ * @return  CD_ERR_FAIL if some records couldn't be written. */
+enum cd_error cd_wq_workqueue_trace_stop(struct cd_workqueue *wq);
+
+/* @brief   Take a snapshot of workqueue's counters. */
+enum cd_error cd_wq_workqueue_stats(struct cd_workqueue *wq, struct cd_wq_stats *stats);
+
+/* @brief   Snapshot of lock statistics of worker @worker_idx (see struct cd_wq_lock_stats).
+ * @return  CD_ERR_BAD_CALL for grouped workqueue, which has no workers of its own, or index out of range. */
+enum cd_error cd_wq_worker_lock_stats(struct cd_workqueue *wq, uint32_t worker_idx, struct cd_wq_lock_stats *stats);
+
 struct cd_work {
 	struct cd_list_head  link;
 	enum cd_work_sync_async_type   type;
@@ -79,29 +488,216 @@ struct cd_work {
 	int user_data_type;						/* demultiplex work */
 	void* (*f)(void*);                      /* processing */
 	void (*f_dtor)(void*);                  /* destructor */
+
+	struct cd_hlist_node coalesce_node;		/* link in workqueue's coalescing index, hashed while work is pending */
+	uint64_t			coalesce_key;
+	uint64_t			not_before;			/* held by rate limits until this time (CLOCK_MONOTONIC ns) */
+	uint64_t			deadline;			/* dropped if not started by this time (CLOCK_MONOTONIC ns), 0 - no deadline */
+	uint64_t			seq;				/* order of enqueuing to the worker, breaks ties in EDF heap */
+	void				*ret;				/* value returned by f, timing of processing, set if completions are enabled */
+	uint64_t			submit_ns;
+	uint64_t			start_ns;
+	uint64_t			end_ns;
+	uint8_t				flags;				/* CD_WORK_FLAG_ */
+	struct cd_wq_ordered *ordered;			/* reorder buffer which emits result of this work, NULL if not ordered */
+	uint64_t			ordered_seq;		/* position in the order of submission to it */
+	struct cd_wq_wait_group *wait_group;	/* told when this work is done, NULL if none */
+	const struct cd_allocator *allocator;	/* work is released to it, cd_alloc_system for works set up with cd_wq_work_init() */
 };
 typedef struct cd_work cd_work_t;
 
-#define CD_WORK_INITIALIZER(n, t, ud, udt, f, f_dtor) {      \
+#define CD_WORK_FLAG_STRAND_RUNNER 0x01		/* work embedded in cd_wq_strand, runs strand's jobs, never freed by workqueue */
+#define CD_WORK_FLAG_INLINE 0x02			/* user_data points to payload stored in the work's own allocation, released with it */
+#define CD_WORK_FLAG_SHARED 0x04			/* queued to round-robin worker's queue even when submitted from a worker, not to its local deque */
+
+/* @brief   Work with its payload stored right behind it, in the same allocation.
+ * @details Created with cd_wq_work_create_inline(), which copies the payload in and points user_data to it,
+ *          so a job with a few dozen bytes of parameters needs one malloc instead of two, and its parameters
+ *          sit next to the work header. Payload is released together with the work - SYNC destructor,
+ *          if any, should release only what the payload refers to, not the payload itself. */
+struct cd_work_inline {
+	struct cd_work		work;
+	uint8_t				payload[] __attribute__((aligned(16)));
+};
+
+#define CD_WQ_STRAND_BATCH 16				/* strand's jobs run in a row before strand is requeued, letting other work in */
+
+/* @brief   Serial executor on top of a workqueue.
+ * @details Jobs queued to a strand run one at a time, in the order they were queued, but not on a fixed
+ *          worker - strand's runner is queued to the workqueue like any other work and picked up by any free worker.
+ *          Submitters hand jobs over lock-free: push onto inbox stack, and the one which makes pending_n
+ *          non-zero queues the runner. Runner takes the whole inbox at once and reverses it into submit order. */
+struct cd_wq_strand {
+	struct cd_workqueue *wq;
+	struct cd_work      *inbox;				/* stack of queued jobs, newest first, linked through link.next */
+	cd_fifo_queue       run;				/* jobs taken from inbox in submit order, touched only by the runner */
+	uint32_t            pending_n;			/* jobs queued and not yet finished, non-zero while runner is queued or running */
+	struct cd_work      runner;				/* queued to wq while strand has pending jobs */
+	const struct cd_allocator *allocator;	/* workqueue's, strand may outlive the workqueue */
+};
+
+/* @brief   Static initializer of work in caller's memory, like cd_wq_work_init() it releases work with free(), never with the default allocator. */
+#define CD_WORK_INITIALIZER(n, t, ud, udt, fn, fn_dtor) {      \
 	.link  = { &(n).link, &(n).link },      \
 	.type = (t),							\
 	.user_data = (ud),						\
 	.user_data_type = (udt),				\
-	.f = (f),								\
-	.f_dtor = (f_dtor)						\
+	.f = (fn),								\
+	.f_dtor = (fn_dtor),					\
+	.allocator = &cd_alloc_system			\
 }
 
-#define DECLARE_WORK(n, t, ud, udt, f, f_dtor) \
-	struct work_struct n = CD_WORK_INITIALIZER(n, t, ud, udt, f, f_dtor)
+#define DECLARE_WORK(n, t, ud, udt, fn, fn_dtor) \
+	struct cd_work n = CD_WORK_INITIALIZER(n, t, ud, udt, fn, fn_dtor)
 
 struct cd_work* cd_wq_work_init(struct cd_work* work, enum cd_work_sync_async_type type, void *user_data, int user_data_type, void*(*f)(void*), void(*f_dtor)(void*));
 struct cd_work* cd_wq_work_create(enum cd_work_sync_async_type type, void *user_data, int user_data_type, void*(*f)(void*), void(*f_dtor)(void*));
+
+/* @brief   Create work with @size bytes of @payload copied into it. @f and @f_dtor are called with pointer to the copy. */
+struct cd_work* cd_wq_work_create_inline(enum cd_work_sync_async_type type, const void *payload, size_t size, int user_data_type, void*(*f)(void*), void(*f_dtor)(void*));
 void cd_wq_work_free(struct cd_work **work);
+
+/* @brief   Counter of unfinished works, waited for with a single futex wait.
+ * @details Works joined to the group with cd_wq_work_set_wait_group() decrement the counter once they are done
+ *          (processed and destructed, cancelled, dropped or merged). Waiter sleeps only if the counter is not zero
+ *          and is woken once, by the work which brings it to zero. */
+struct cd_wq_wait_group {
+	uint32_t        n;              /* futex word, unfinished works and CD_WQ_WAIT_GROUP_WAITERS */
+};
+
+#define CD_WQ_WAIT_GROUP_WAITERS 0x80000000u	/* set in the counter by threads sleeping in cd_wq_wait_group_wait() */
+#define CD_WQ_WAIT_GROUP_INITIALIZER { .n = 0 }
+
+void cd_wq_wait_group_init(struct cd_wq_wait_group *wg);
+
+/* @brief   Add @n to the counter, for jobs tracked by other means than cd_wq_work_set_wait_group(). */
+void cd_wq_wait_group_add(struct cd_wq_wait_group *wg, uint32_t n);
+
+/* @brief   Subtract one from the counter, waking waiters if it drops to zero. */
+void cd_wq_wait_group_done(struct cd_wq_wait_group *wg);
+
+/* @brief   Wait until the counter is zero, or until @timeout_ns passes (0 - wait forever).
+ * @return  CD_ERR_OK if counter is zero, CD_ERR_BUSY on timeout. */
+enum cd_error cd_wq_wait_group_wait(struct cd_wq_wait_group *wg, uint64_t timeout_ns);
+
+/* @brief   Join the work to the wait group (counter is incremented now). Call before the work is queued.
+ * @details If work is not queued after all (or queuing fails), call cd_wq_wait_group_done() for it. */
+void cd_wq_work_set_wait_group(struct cd_work *work, struct cd_wq_wait_group *wg);
+
+#define CD_WQ_SYNC_WAIT_NS 50000		/* how long worker in cd_wq_sync() sleeps when it finds no work to run meanwhile */
+
+/* @brief   Fork: queue the work as a child tracked by @wg. Spawned from a job, it goes to the worker's local deque.
+ * @details Queue failure is accounted for in @wg, work stays owned by the caller then. */
+enum cd_error cd_wq_spawn(struct cd_workqueue *wq, struct cd_wq_wait_group *wg, struct cd_work *work);
+enum cd_error cd_wq_spawn_user(struct cd_workqueue *wq, struct cd_wq_wait_group *wg, enum cd_work_sync_async_type type, void *user_data, int user_data_type, void*(*f)(void*), void(*f_dtor)(void*));
+
+/* @brief   Join: wait until all children spawned with @wg are done.
+ * @details Called from a job of @wq, the worker doesn't block - it runs its own children (most recent first),
+ *          then other work queued to it, then work stolen from other workers, and sleeps shortly only if there is none.
+ *          On a grouped workqueue, group's thread helps the same way by running group's queued work (of any of its
+ *          workqueues) in the order group's threads take it. Called from other threads, it's cd_wq_wait_group_wait(). */
+enum cd_error cd_wq_sync(struct cd_workqueue *wq, struct cd_wq_wait_group *wg);
+
+/* @brief   Set the time (CLOCK_MONOTONIC ns, see cd_util_now_ns()) by which the work must start.
+ * @details Work which has not started by then is dropped instead of executed: f_expired callback
+ *          of the workqueue is called with it, then it's released as if cancelled (destructor is
+ *          called for SYNC work). In CD_WQ_QUEUE_OPTION_ORDER_EDF mode deadline also orders the work. */
+void cd_wq_work_set_deadline(struct cd_work *work, uint64_t deadline);
+
+/* @brief   Enqueue the work (and move ownership of it to the workqueue).
+ * @details Work submitted from inside of a job running on one of @wq's workers goes to that worker's
+ *          local deque and is processed by it in LIFO order, idle workers steal it from there.
+ *          If the deque is full, work is enqueued to the next worker in round-robin fashion. */
 enum cd_error cd_wq_queue_work(struct cd_workqueue *wq, struct cd_work* work);
+
+/* @brief   Enqueue the work unless a work with the same @key is already pending (enqueued, but not yet started).
+ * @details If such work is pending, @work is not enqueued. Instead @f_merge (if not NULL) is called
+ *          with user data of the pending work and user data of @work, so the new request can be folded
+ *          into the pending one, then @work is released (destructor is called for SYNC work) and freed.
+ *          Once pending work starts, new work with the same key is enqueued again.
+ *          Returns CD_ERR_OK in both cases, see coalesced_n in cd_wq_stats. */
+enum cd_error cd_wq_queue_work_coalesce(struct cd_workqueue *wq, struct cd_work* work, uint64_t key, void(*f_merge)(void *pending_user_data, void *user_data));
+
+#define CD_WQ_ORDERED_FREE 0		/* slot waits for the work with its seq (which may not have been submitted yet) */
+#define CD_WQ_ORDERED_READY 1		/* work with slot's seq has finished and waits to be emitted */
+#define CD_WQ_ORDERED_SKIPPED 2		/* emitter has given up on the work with slot's seq (hole timeout) */
+
+struct cd_wq_ordered_slot {
+	uint64_t        state;			/* seq << 2 | CD_WQ_ORDERED_ */
+	struct cd_work  *work;			/* finished work, NULL if it has been cancelled */
+};
+
+/* @brief   Reorder buffer: works queued through it are processed in parallel, their results are emitted in submit order.
+ * @details Each work gets the next seq at submit, when it finishes it's parked in slot seq % size and whichever thread
+ *          holds the emitter role (taken with an atomic flag, never waited for) emits ready results from emit_seq on.
+ *          At most size works are outstanding (submitted and not yet emitted), so memory is bounded.
+ *          If the work at emit_seq hasn't finished within hole_timeout_ns since its predecessor was emitted
+ *          (or since it was submitted, if that was later), it's skipped and its result is dropped when it finally
+ *          comes (see skipped_n and late_n). Timeouts are watched by a thread of the reorder buffer, so results
+ *          behind the hole are emitted even if nothing else is submitted or finishes. */
+struct cd_wq_ordered {
+	struct cd_workqueue         *wq;
+	void                        (*f_emit)(void *user_data, void *ret);	/* called in submit order with user data and result of work's f */
+	uint64_t                    hole_timeout_ns;	/* 0 - wait for missing work forever */
+	uint64_t                    size;
+	uint64_t                    mask;
+	const struct cd_allocator   *allocator;		/* workqueue's, reorder buffer may outlive the workqueue */
+	struct cd_wq_ordered_slot   *slots;
+	uint64_t                    next_seq;			/* next seq to assign */
+	char                        pad[64 - sizeof(uint64_t)];
+	uint64_t                    emit_seq;			/* next seq to emit, written by emitter only */
+	uint64_t                    hole_since;			/* when work at emit_seq became the one to wait for, 0 - not submitted yet */
+	uint8_t                     emitting;			/* emitter role is taken */
+	uint64_t                    skipped_n;			/* number of holes skipped because of timeout */
+	uint64_t                    late_n;				/* number of results dropped because they came after their hole was skipped */
+	pthread_t                   watch_tid;			/* skips timed out holes, runs only with hole_timeout_ns */
+	pthread_mutex_t             watch_lock;
+	pthread_cond_t              watch_signal;
+	uint8_t                     watch_running;
+	uint8_t                     watch_idle;			/* watcher sleeps without timeout, wake it when a hole starts */
+};
+
+/* @brief   Create reorder buffer on top of @wq with @window outstanding works at most (rounded up to a power of 2). */
+struct cd_wq_ordered* cd_wq_ordered_create(struct cd_workqueue *wq, uint32_t window, uint64_t hole_timeout_ns, void (*f_emit)(void *user_data, void *ret));
+
+/* @brief   Free the reorder buffer. Returns CD_ERR_BUSY if some of its works have not been emitted (or skipped) yet. */
+enum cd_error cd_wq_ordered_free(struct cd_wq_ordered **o);
+
+/* @brief   Enqueue the work to @o's workqueue, its result will be emitted in the order of this call.
+ * @details Returns CD_ERR_FULL if window is full, retry after results have been emitted. Other errors are those
+ *          of cd_wq_queue_work(), e.g. CD_ERR_BUSY if rate limits reject the work. On error work stays owned by the caller.
+ *          SYNC work's destructor is called after its result has been emitted. Results of ordered works are not posted
+ *          to completion ring. */
+enum cd_error cd_wq_ordered_queue_work(struct cd_wq_ordered *o, struct cd_work *work);
+enum cd_error cd_wq_ordered_queue_user(struct cd_wq_ordered *o, enum cd_work_sync_async_type type, void *user_data, int user_data_type, void*(*f)(void*), void(*f_dtor)(void*));
+
+enum cd_error cd_wq_strand_init(struct cd_wq_strand *s, struct cd_workqueue *wq);
+struct cd_wq_strand* cd_wq_strand_create(struct cd_workqueue *wq);
+
+/* @brief   Free the strand. Returns CD_ERR_BUSY if it still has pending jobs. */
+enum cd_error cd_wq_strand_free(struct cd_wq_strand **s);
+
+/* @brief   Enqueue the work to the strand (and move ownership of it to the strand's workqueue).
+ * @details Work runs after all work queued to the strand before it has finished, and never concurrently with it.
+ *          Rate limits and coalescing don't apply to strand's jobs. If workqueue has been stopped, work is
+ *          released (destructor is called for SYNC work) and CD_ERR_WORKQUEUE_ACTIVE is returned. */
+enum cd_error cd_wq_strand_queue_work(struct cd_wq_strand *s, struct cd_work *work);
+enum cd_error cd_wq_strand_queue_user(struct cd_wq_strand *s, enum cd_work_sync_async_type type, void *user_data, int user_data_type, void*(*f)(void*), void(*f_dtor)(void*));
+
 void cd_wq_queue_delayed_work(struct cd_workqueue *wq, struct cd_work* work, unsigned int delay);
 enum cd_error cd_wq_queue_user(struct cd_workqueue *wq, enum cd_work_sync_async_type type, void *user_data, int user_data_type, void*(*f)(void*), void(*f_dtor)(void*));
+
+/* @brief   Like cd_wq_queue_user(), but @size bytes of @payload are copied into the work (see struct cd_work_inline),
+ *          so caller's buffer can be reused as soon as this returns. Work is released if it can't be queued. */
+enum cd_error cd_wq_queue_user_inline(struct cd_workqueue *wq, enum cd_work_sync_async_type type, const void *payload, size_t size, int user_data_type, void*(*f)(void*), void(*f_dtor)(void*));
 enum cd_error cd_launch_thread(pthread_t *t, void*(*f)(void*), void *arg, int detachstate);
 
+/* @brief   Launch thread with stack, guard and scheduling set from @a (may be NULL).
+ * @details Real-time policies are set through thread's attributes, so creation fails if they are not permitted.
+ *          SCHED_BATCH and SCHED_IDLE are applied to the thread right after it has been created. @a's name
+ *          isn't applied here, thread names itself. */
+enum cd_error cd_launch_thread_attr(pthread_t *t, void*(*f)(void*), void *arg, int detachstate, const struct cd_wq_worker_attr *a);
+
 
 #endif  /* CD_WORKQUEUE_H */
 
@@ -0,0 +1,350 @@
+/**
+ * cd_alloc.c - Pluggable memory allocation
+ *
+ * Part of the libcd - Libcd implements queue and queue processing with multiple worker threads, from Data And Signal's Piotr Gregor.
+ *
+ * Data And Signal - IT Solutions
+ * http://www.dataandsignal.com
+ * 2020
+ *
+ */
+
+#include "../include/cd_alloc.h"
+
+#include <sys/mman.h>
+
+
+static void* cd_alloc_system_alloc(void *ctx, size_t size, size_t align, enum cd_alloc_tag tag)
+{
+	(void) ctx;
+	(void) tag;
+
+	if (align <= _Alignof(max_align_t))
+		return malloc(size);
+	return aligned_alloc(align, (size + align - 1) & ~(align - 1));				/* size must be multiple of alignment */
+}
+
+static void cd_alloc_system_free(void *ctx, void *p, enum cd_alloc_tag tag)
+{
+	(void) ctx;
+	(void) tag;
+
+	free(p);
+}
+
+const struct cd_allocator cd_alloc_system = {
+	.f_alloc = cd_alloc_system_alloc,
+	.f_free = cd_alloc_system_free,
+	.ctx = NULL
+};
+
+static const struct cd_allocator *cd_alloc_default = &cd_alloc_system;
+
+void cd_alloc_set_default(const struct cd_allocator *a)
+{
+	__atomic_store_n(&cd_alloc_default, a ? a : &cd_alloc_system, __ATOMIC_RELEASE);
+}
+
+const struct cd_allocator* cd_alloc_get_default(void)
+{
+	return __atomic_load_n(&cd_alloc_default, __ATOMIC_ACQUIRE);
+}
+
+void* cd_alloc_aligned(const struct cd_allocator *a, size_t size, size_t align, enum cd_alloc_tag tag)
+{
+	if (a == NULL)
+		a = cd_alloc_get_default();
+	if (align < sizeof(void*))
+		align = sizeof(void*);
+	return a->f_alloc(a->ctx, size, align, tag);
+}
+
+void* cd_alloc(const struct cd_allocator *a, size_t size, enum cd_alloc_tag tag)
+{
+	return cd_alloc_aligned(a, size, _Alignof(max_align_t), tag);
+}
+
+char* cd_alloc_strdup(const struct cd_allocator *a, const char *s, enum cd_alloc_tag tag)
+{
+	size_t	len;
+	char	*d;
+
+	if (s == NULL)
+		return NULL;
+
+	len = strlen(s) + 1;
+	d = cd_alloc_aligned(a, len, 1, tag);
+	if (d)
+		memcpy(d, s, len);
+	return d;
+}
+
+void cd_free(const struct cd_allocator *a, void *p, enum cd_alloc_tag tag)
+{
+	if (p == NULL)
+		return;
+	if (a == NULL)
+		a = cd_alloc_get_default();
+	a->f_free(a->ctx, p, tag);
+}
+
+const char* cd_alloc_tag_name(enum cd_alloc_tag tag)
+{
+	switch (tag) {
+		case CD_ALLOC_TAG_WORKQUEUE:
+			return "workqueue";
+		case CD_ALLOC_TAG_WORK:
+			return "work";
+		case CD_ALLOC_TAG_QUEUE:
+			return "queue";
+		case CD_ALLOC_TAG_SCRATCH:
+			return "scratch";
+		case CD_ALLOC_TAG_LOG:
+			return "log";
+		default:
+			return "unknown";
+	}
+}
+
+/* Right in front of each debug allocation, offset bytes after the start of the backing allocation. */
+struct cd_alloc_debug_header {
+	uint64_t        size;
+	uint32_t        offset;
+	uint32_t        tag;
+};
+
+static void* cd_alloc_debug_alloc(void *ctx, size_t size, size_t align, enum cd_alloc_tag tag)
+{
+	struct cd_alloc_debug			*d = ctx;
+	struct cd_alloc_counters		*c = &d->tags[tag < CD_ALLOC_TAG_N ? tag : CD_ALLOC_TAG_N - 1];
+	struct cd_alloc_debug_header	*h;
+	size_t							offset = sizeof(struct cd_alloc_debug_header);
+	uint64_t						bytes, peak;
+	char							*p;
+
+	if (offset < align)
+		offset = align;																/* keeps user's pointer aligned, align is a power of 2 */
+	p = cd_alloc_aligned(d->backing, offset + size, align, tag);
+	if (p == NULL)
+		return NULL;
+
+	h = (struct cd_alloc_debug_header*) (p + offset) - 1;
+	h->size = size;
+	h->offset = offset;
+	h->tag = tag;
+
+	__atomic_add_fetch(&c->allocs_n, 1, __ATOMIC_RELAXED);
+	bytes = __atomic_add_fetch(&c->bytes, size, __ATOMIC_RELAXED);
+	peak = __atomic_load_n(&c->bytes_peak, __ATOMIC_RELAXED);
+	while (bytes > peak && !__atomic_compare_exchange_n(&c->bytes_peak, &peak, bytes, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	return p + offset;
+}
+
+static void cd_alloc_debug_free(void *ctx, void *p, enum cd_alloc_tag tag)
+{
+	struct cd_alloc_debug			*d = ctx;
+	struct cd_alloc_debug_header	*h = (struct cd_alloc_debug_header*) p - 1;
+	struct cd_alloc_counters		*c = &d->tags[h->tag];
+
+	if (h->tag != (uint32_t) tag)
+		CD_LOG_ERR("Memory allocated for [%s] freed as [%s]", cd_alloc_tag_name(h->tag), cd_alloc_tag_name(tag));
+
+	__atomic_add_fetch(&c->frees_n, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&c->bytes, h->size, __ATOMIC_RELAXED);
+	cd_free(d->backing, (char*) p - h->offset, h->tag);
+}
+
+void cd_alloc_debug_init(struct cd_alloc_debug *d, const struct cd_allocator *backing)
+{
+	memset(d, 0, sizeof(struct cd_alloc_debug));
+	d->backing = backing ? backing : &cd_alloc_system;
+	d->allocator.f_alloc = cd_alloc_debug_alloc;
+	d->allocator.f_free = cd_alloc_debug_free;
+	d->allocator.ctx = d;
+}
+
+uint64_t cd_alloc_debug_outstanding(const struct cd_alloc_debug *d)
+{
+	uint64_t	n = 0;
+	int			i;
+
+	for (i = 0; i < CD_ALLOC_TAG_N; i++)
+		n += __atomic_load_n(&d->tags[i].allocs_n, __ATOMIC_RELAXED) - __atomic_load_n(&d->tags[i].frees_n, __ATOMIC_RELAXED);
+	return n;
+}
+
+void cd_alloc_debug_print(const struct cd_alloc_debug *d, FILE *stream)
+{
+	int i;
+
+	for (i = 0; i < CD_ALLOC_TAG_N; i++) {
+		fprintf(stream, "%-10s bytes %lu (peak %lu), allocs %lu, frees %lu\n", cd_alloc_tag_name(i),
+				__atomic_load_n(&d->tags[i].bytes, __ATOMIC_RELAXED), __atomic_load_n(&d->tags[i].bytes_peak, __ATOMIC_RELAXED),
+				__atomic_load_n(&d->tags[i].allocs_n, __ATOMIC_RELAXED), __atomic_load_n(&d->tags[i].frees_n, __ATOMIC_RELAXED));
+	}
+}
+
+/* At the start of each 2 MB aligned chunk of huge page allocator, found from any block in it by masking. */
+struct cd_alloc_huge_chunk {
+	struct cd_alloc_huge_chunk	*next;
+	struct cd_alloc_huge_chunk	*prev;
+	size_t						map_size;
+	size_t						used;			/* carved so far */
+	int							cls;			/* size class, -1 - single large allocation */
+	uint8_t						hugetlb;
+};
+
+/* @brief   Map @size bytes (multiple of CD_ALLOC_HUGE_PAGE) aligned to CD_ALLOC_HUGE_PAGE. */
+static struct cd_alloc_huge_chunk* cd_alloc_huge_map(struct cd_alloc_huge *h, size_t size)
+{
+	struct cd_alloc_huge_chunk	*c;
+	char						*p, *aligned;
+
+	if (h->hugetlb) {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED) {
+			c = (struct cd_alloc_huge_chunk*) p;
+			c->hugetlb = 1;
+			h->hugetlb_pages_n += size / CD_ALLOC_HUGE_PAGE;
+			return c;
+		}
+		h->hugetlb = 0;															/* no huge pages reserved, don't try again */
+	}
+
+	p = mmap(NULL, size + CD_ALLOC_HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	aligned = (char*) (((uintptr_t) p + CD_ALLOC_HUGE_PAGE - 1) & ~((uintptr_t) CD_ALLOC_HUGE_PAGE - 1));
+	if (aligned > p)
+		munmap(p, aligned - p);
+	if (aligned + size < p + size + CD_ALLOC_HUGE_PAGE)
+		munmap(aligned + size, p + size + CD_ALLOC_HUGE_PAGE - (aligned + size));
+	madvise(aligned, size, MADV_HUGEPAGE);
+
+	c = (struct cd_alloc_huge_chunk*) aligned;
+	c->hugetlb = 0;
+	h->thp_pages_n += size / CD_ALLOC_HUGE_PAGE;
+	return c;
+}
+
+static void cd_alloc_huge_unmap(struct cd_alloc_huge *h, struct cd_alloc_huge_chunk *c)
+{
+	if (c->hugetlb)
+		h->hugetlb_pages_n -= c->map_size / CD_ALLOC_HUGE_PAGE;
+	else
+		h->thp_pages_n -= c->map_size / CD_ALLOC_HUGE_PAGE;
+	munmap(c, c->map_size);
+}
+
+static struct cd_alloc_huge_chunk* cd_alloc_huge_chunk_new(struct cd_alloc_huge *h, size_t size, int cls, size_t used)
+{
+	struct cd_alloc_huge_chunk *c = cd_alloc_huge_map(h, size);
+
+	if (c == NULL)
+		return NULL;
+	c->map_size = size;
+	c->used = used;
+	c->cls = cls;
+	c->prev = NULL;
+	c->next = h->chunks;
+	if (h->chunks)
+		h->chunks->prev = c;
+	h->chunks = c;
+	return c;
+}
+
+static void* cd_alloc_huge_alloc(void *ctx, size_t size, size_t align, enum cd_alloc_tag tag)
+{
+	struct cd_alloc_huge		*h = ctx;
+	struct cd_alloc_huge_chunk	*c;
+	size_t						need = size > align ? size : align, block, offset;
+	int							cls = 0;
+	void						*p = NULL;
+
+	(void) tag;
+
+	while (((size_t) 1 << (cls + CD_ALLOC_HUGE_MIN_SHIFT)) < need)
+		cls++;
+
+	pthread_mutex_lock(&h->lock);
+	if (cls >= CD_ALLOC_HUGE_CLASSES) {											/* own mapping, block right behind the header */
+		if (align >= CD_ALLOC_HUGE_PAGE)											/* free finds the header in the block's 2 MB page */
+			goto out;
+		offset = align > sizeof(struct cd_alloc_huge_chunk) ? align : 64;
+		c = cd_alloc_huge_chunk_new(h, (offset + size + CD_ALLOC_HUGE_PAGE - 1) & ~((size_t) CD_ALLOC_HUGE_PAGE - 1), -1, offset + size);
+		if (c)
+			p = (char*) c + offset;
+		goto out;
+	}
+
+	if (h->free[cls]) {
+		p = h->free[cls];
+		h->free[cls] = *(void**) p;
+		goto out;
+	}
+
+	block = (size_t) 1 << (cls + CD_ALLOC_HUGE_MIN_SHIFT);
+	c = h->current[cls];
+	if (c == NULL || c->used + block > CD_ALLOC_HUGE_PAGE) {
+		offset = (sizeof(struct cd_alloc_huge_chunk) + block - 1) & ~(block - 1);	/* blocks stay aligned to their size */
+		c = cd_alloc_huge_chunk_new(h, CD_ALLOC_HUGE_PAGE, cls, offset);
+		if (c == NULL)
+			goto out;
+		h->current[cls] = c;
+	}
+	p = (char*) c + c->used;
+	c->used += block;
+
+out:
+	pthread_mutex_unlock(&h->lock);
+	return p;
+}
+
+static void cd_alloc_huge_free(void *ctx, void *p, enum cd_alloc_tag tag)
+{
+	struct cd_alloc_huge		*h = ctx;
+	struct cd_alloc_huge_chunk	*c = (struct cd_alloc_huge_chunk*) ((uintptr_t) p & ~((uintptr_t) CD_ALLOC_HUGE_PAGE - 1));
+
+	(void) tag;
+
+	pthread_mutex_lock(&h->lock);
+	if (c->cls < 0) {
+		if (c->prev)
+			c->prev->next = c->next;
+		else
+			h->chunks = c->next;
+		if (c->next)
+			c->next->prev = c->prev;
+		cd_alloc_huge_unmap(h, c);
+	} else {
+		*(void**) p = h->free[c->cls];
+		h->free[c->cls] = p;
+	}
+	pthread_mutex_unlock(&h->lock);
+}
+
+enum cd_error cd_alloc_huge_init(struct cd_alloc_huge *h)
+{
+	memset(h, 0, sizeof(struct cd_alloc_huge));
+	if (pthread_mutex_init(&h->lock, NULL) != 0)
+		return CD_ERR_FAIL;
+	h->hugetlb = 1;
+	h->allocator.f_alloc = cd_alloc_huge_alloc;
+	h->allocator.f_free = cd_alloc_huge_free;
+	h->allocator.ctx = h;
+	return CD_ERR_OK;
+}
+
+void cd_alloc_huge_deinit(struct cd_alloc_huge *h)
+{
+	struct cd_alloc_huge_chunk *c;
+
+	while ((c = h->chunks) != NULL) {
+		h->chunks = c->next;
+		cd_alloc_huge_unmap(h, c);
+	}
+	memset(h->free, 0, sizeof(h->free));
+	memset(h->current, 0, sizeof(h->current));
+	pthread_mutex_destroy(&h->lock);
+}
@@ -23,6 +23,20 @@ void cd_util_calc_timespec_diff(struct timespec *t1, struct timespec *t2, struct
 	}
 }
 
+uint64_t cd_util_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * CD_NANOSEC_PER_SEC + (uint64_t) ts.tv_nsec;
+}
+
+void cd_util_ns_to_timespec(uint64_t ns, struct timespec *ts)
+{
+	ts->tv_sec = ns / CD_NANOSEC_PER_SEC;
+	ts->tv_nsec = ns % CD_NANOSEC_PER_SEC;
+}
+
 int cd_util_dt(char *buf)
 {
 	struct tm	t;
@@ -53,36 +67,40 @@ int cd_util_dt_detail(char *buf)
 
 int cd_util_openlog(const char *dir, const char *name)
 {
+	const struct cd_allocator *a = cd_alloc_get_default();
 	FILE	*stream;
 	char	*full_path;
+	int		err = -1;
 
 	if (dir == NULL)
 		return -1;
 
-	full_path = malloc(strlen(dir) + strlen(name) + 1 + 27 + 1 + 3 + 1);
+	full_path = cd_alloc(a, strlen(dir) + strlen(name) + 1 + 27 + 1 + 3 + 1, CD_ALLOC_TAG_LOG);
 	if (full_path == NULL)
 		return -1;
 
 	sprintf(full_path, "%s%s_", dir, name);
 	if (cd_util_dt_detail(full_path + strlen(dir) + strlen(name) + 1) == -1) {
-		return -1;
+		goto out;
 	}
 
 	strcpy(full_path + strlen(dir) + strlen(name) + 27, ".log");
 	if ((stream = fopen(full_path, "w+")) == NULL) {
-		return -1;
+		goto out;
 	}
 
 	fclose(stream);
 	if (freopen(full_path, "w", stdout) == NULL) {
-		return -1;
+		goto out;
 	}
 	if (freopen(full_path, "w", stderr) == NULL) {
-		return -1;
+		goto out;
 	}
+	err = 0;
 
-	free(full_path);
-	return 0;
+out:
+	cd_free(a, full_path, CD_ALLOC_TAG_LOG);
+	return err;
 }
 
 int cd_util_log(FILE *stream, const char *fmt, ...)
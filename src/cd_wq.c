@@ -9,14 +9,40 @@
  *
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE				/* pthread_setname_np */
+#endif
+
 #include "../include/cd_wq.h"
 #include "../include/cd_log.h"
 
-
-static void cd_wq_call_dctor(struct cd_work *work, enum cd_work_sync_async_type work_type)
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <limits.h>
+
+// USDT probes of provider libcd, built in with CD_WQ_USDT (make usdt), for bpftrace/perf to attach to
+// a running process, see tools/bpftrace. Without CD_WQ_USDT they compile to nothing.
+#ifdef CD_WQ_USDT
+#include <sys/sdt.h>
+#define CD_WQ_PROBE2(probe, a1, a2)				DTRACE_PROBE2(libcd, probe, a1, a2)
+#define CD_WQ_PROBE3(probe, a1, a2, a3)			DTRACE_PROBE3(libcd, probe, a1, a2, a3)
+#define CD_WQ_PROBE4(probe, a1, a2, a3, a4)		DTRACE_PROBE4(libcd, probe, a1, a2, a3, a4)
+#else
+#define CD_WQ_PROBE2(probe, a1, a2)				do { (void) sizeof(a1); (void) sizeof(a2); } while (0)		/* not evaluated */
+#define CD_WQ_PROBE3(probe, a1, a2, a3)			do { CD_WQ_PROBE2(probe, a1, a2); (void) sizeof(a3); } while (0)
+#define CD_WQ_PROBE4(probe, a1, a2, a3, a4)		do { CD_WQ_PROBE3(probe, a1, a2, a3); (void) sizeof(a4); } while (0)
+#endif
+
+/* @brief   Fire work probe: workqueue name, index of worker on this thread (-1 if none), user_data_type, work. */
+#define CD_WQ_PROBE_WORK(probe, wq, work)		CD_WQ_PROBE4(probe, (wq)->name, cd_wq_worker_idx(), (work)->user_data_type, (work))
+
+
+static void cd_wq_call_dctor(struct cd_workqueue *wq, struct cd_work *work, enum cd_work_sync_async_type work_type)
 {
 	if (work->type == work_type) {
 		if (work->f_dtor) {
+			CD_WQ_PROBE_WORK(work_dtor, wq, work);
 			work->f_dtor(work->user_data);
 			work->f_dtor = NULL;
 			work->user_data = NULL;
@@ -24,325 +50,3001 @@ static void cd_wq_call_dctor(struct cd_work *work, enum cd_work_sync_async_type
 	}
 }
 
-static void* cd_wq_worker_f(void *arg)
+static long cd_wq_futex(uint32_t *uaddr, int op, uint32_t val, const struct timespec *timeout)
 {
-	cd_fifo_queue            *q;
-	struct cd_work          *work;
-	struct cd_list_head      *lh;
+	return syscall(SYS_futex, uaddr, op, val, timeout, NULL, 0);
+}
 
-	struct cd_worker *w = (struct cd_worker*) arg;
+void cd_wq_wait_group_init(struct cd_wq_wait_group *wg)
+{
+	wg->n = 0;
+}
+
+void cd_wq_wait_group_add(struct cd_wq_wait_group *wg, uint32_t n)
+{
+	__atomic_add_fetch(&wg->n, n, __ATOMIC_SEQ_CST);
+}
+
+void cd_wq_wait_group_done(struct cd_wq_wait_group *wg)
+{
+	// Waiter may return (and release the group) as soon as the counter drops to zero,
+	// so whether to wake is decided from the value of the decrement alone, wg is not read after it.
+	// Waking a futex whose memory has been reused meanwhile is harmless.
+	if (__atomic_sub_fetch(&wg->n, 1, __ATOMIC_SEQ_CST) == CD_WQ_WAIT_GROUP_WAITERS)
+		cd_wq_futex(&wg->n, FUTEX_WAKE_PRIVATE, INT_MAX, NULL);
+}
+
+enum cd_error cd_wq_wait_group_wait(struct cd_wq_wait_group *wg, uint64_t timeout_ns)
+{
+	struct timespec	ts;
+	uint64_t		deadline = timeout_ns ? cd_util_now_ns() + timeout_ns : 0, now;
+	uint32_t		n, waiters = CD_WQ_WAIT_GROUP_WAITERS;
+	enum cd_error	err = CD_ERR_OK;
+
+	if ((__atomic_load_n(&wg->n, __ATOMIC_SEQ_CST) & ~CD_WQ_WAIT_GROUP_WAITERS) == 0)
+		return CD_ERR_OK;
+
+	// Flag is set in the futex word itself, so the work which brings the counter to zero
+	// either sees it (and wakes), or futex wait returns at once as the word has changed.
+	__atomic_or_fetch(&wg->n, CD_WQ_WAIT_GROUP_WAITERS, __ATOMIC_SEQ_CST);
+	while ((n = __atomic_load_n(&wg->n, __ATOMIC_SEQ_CST)) & ~CD_WQ_WAIT_GROUP_WAITERS) {
+		if (deadline) {
+			now = cd_util_now_ns();
+			if (now >= deadline) {
+				err = CD_ERR_BUSY;												/* flag stays, other waiters may sleep */
+				break;
+			}
+			cd_util_ns_to_timespec(deadline - now, &ts);								/* futex takes relative timeout */
+		}
+		cd_wq_futex(&wg->n, FUTEX_WAIT_PRIVATE, n, deadline ? &ts : NULL);
+	}
+	if (err == CD_ERR_OK)															/* all waiters have been woken, clear the flag unless group is in use again */
+		__atomic_compare_exchange_n(&wg->n, &waiters, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+	return err;
+}
+
+/* @brief   Free the work which is done and tell its wait group. */
+static void cd_wq_work_done(struct cd_work **work)
+{
+	struct cd_wq_wait_group *wg = (*work)->wait_group;
+
+	cd_wq_work_free(work);
+	if (wg)
+		cd_wq_wait_group_done(wg);
+}
+
+static __thread struct cd_worker *cd_wq_current_worker;		/* worker running on this thread, NULL if this thread is not a worker */
+static __thread struct cd_wq_arena *cd_wq_current_arena;	/* scratch arena of worker or group thread running on this thread */
+static __thread struct cd_wq_group *cd_wq_current_group;	/* group whose thread this is, NULL if this thread is not a group thread */
+struct cd_wq_producer_cursor {
+	const struct cd_workqueue	*wq;							/* NULL - not assigned yet */
+	uint32_t					pos;
+};
+static __thread struct cd_wq_producer_cursor cd_wq_producer_cursors[1 << CD_WQ_PRODUCER_CURSORS_BITS];	/* round-robin positions of this producer thread, by workqueue */
+static uint32_t cd_wq_producers_n;							/* producers seen so far, spreads their starting positions */
+
+#ifdef CD_WQ_LOCK_STATS
+static void cd_wq_worker_lock(struct cd_worker *w)
+{
+	uint64_t t0;
+
+	if (pthread_mutex_trylock(&w->mutex) != 0) {
+		t0 = cd_util_now_ns();
+		pthread_mutex_lock(&w->mutex);
+		w->lock_stats.contended_n++;
+		w->lock_stats.wait_ns += cd_util_now_ns() - t0;
+	}
+	w->lock_stats.acquired_n++;
+}
+
+static void cd_wq_worker_signal(struct cd_worker *w)
+{
+	w->lock_stats.signaled_n++;
+	pthread_cond_signal(&w->signal);
+}
 
+/* @brief   Wait on worker's signal until @ts (CLOCK_MONOTONIC), NULL - without timeout. */
+static void cd_wq_worker_wait(struct cd_worker *w, const struct timespec *ts)
+{
+	uint64_t t0 = cd_util_now_ns();
+
+	if (ts)
+		pthread_cond_timedwait(&w->signal, &w->mutex, ts);
+	else
+		pthread_cond_wait(&w->signal, &w->mutex);
+	w->lock_stats.parked_n++;
+	w->lock_stats.parked_ns += cd_util_now_ns() - t0;
+}
+#else
+static inline void cd_wq_worker_lock(struct cd_worker *w)
+{
 	pthread_mutex_lock(&w->mutex);
-	q = &w->queue;
+}
 
-	while (w->active || ((w->options.CD_WQ_QUEUE_OPTION_STOP == CD_WQ_QUEUE_OPTION_STOP_SOFT) && !cd_fifo_empty(q))) {
+static inline void cd_wq_worker_signal(struct cd_worker *w)
+{
+	pthread_cond_signal(&w->signal);
+}
 
-		cd_fifo_dequeue(q, lh);
+static inline void cd_wq_worker_wait(struct cd_worker *w, const struct timespec *ts)
+{
+	if (ts)
+		pthread_cond_timedwait(&w->signal, &w->mutex, ts);
+	else
+		pthread_cond_wait(&w->signal, &w->mutex);
+}
+#endif
 
-		if (lh) {
-			work = cd_container_of(lh, struct cd_work, link);
+static inline void cd_wq_worker_unlock(struct cd_worker *w)
+{
+	pthread_mutex_unlock(&w->mutex);
+}
 
-			// Allow for further enquing while work is being processed.
-			pthread_mutex_unlock(&w->mutex);
+/* @brief   Next worker index of @wq to try in round-robin, private to calling thread, so concurrent producers neither race nor share a cache line.
+ * @details Each workqueue gets its own cursor, so a producer feeding queues of different sizes spreads its work evenly over each of them.
+ *          Workqueues whose cursors collide take the slot over from each other, starting at a new position. */
+static uint32_t cd_wq_producer_next(const struct cd_workqueue *wq)
+{
+	struct cd_wq_producer_cursor *c = &cd_wq_producer_cursors[cd_hash_ptr(wq, CD_WQ_PRODUCER_CURSORS_BITS)];
 
-			work->f(work->user_data);
+	if (c->wq != wq) {
+		c->wq = wq;
+		c->pos = __atomic_add_fetch(&cd_wq_producers_n, 1, __ATOMIC_RELAXED) * 0x9E3779B1U;	/* Fibonacci hashing */
+	}
+	return c->pos++ % wq->workers_n;
+}
 
-			// Execute sync destructors.
-			cd_wq_call_dctor(work, CD_WORK_SYNC);
+struct cd_wq_arena_chunk {
+	struct cd_wq_arena_chunk	*next;
+	max_align_t					data[];
+};
 
-			cd_wq_work_free(&work);
+static void cd_wq_arena_init(struct cd_wq_arena *a, size_t size, const struct cd_allocator *allocator)
+{
+	memset(a, 0, sizeof(struct cd_wq_arena));
+	a->allocator = allocator;
+	size = size ? size : CD_WQ_ARENA_SIZE;
+	a->size = (size + CD_WQ_ARENA_ALIGN - 1) & ~((size_t) CD_WQ_ARENA_ALIGN - 1);
+}
+
+static void cd_wq_arena_free_chunks(struct cd_wq_arena *a)
+{
+	struct cd_wq_arena_chunk *c;
+
+	while ((c = a->chunks) != NULL) {
+		a->chunks = c->next;
+		cd_free(a->allocator, c, CD_ALLOC_TAG_SCRATCH);
+	}
+}
+
+/* @brief   Release everything allocated from the arena. O(1) unless last job didn't fit into it. */
+static void cd_wq_arena_reset(struct cd_wq_arena *a)
+{
+	size_t size;
+
+	a->used = 0;
+	if (a->chunks == NULL)
+		return;
+
+	cd_wq_arena_free_chunks(a);														/* grow, so the same job fits next time */
+	size = a->size;
+	while (size < a->size + a->spilled && size < CD_WQ_ARENA_MAX_SIZE)
+		size *= 2;
+	if (size > a->size) {
+		cd_free(a->allocator, a->base, CD_ALLOC_TAG_SCRATCH);
+		a->base = NULL;
+		a->size = size;
+	}
+	a->spilled = 0;
+}
+
+static void cd_wq_arena_deinit(struct cd_wq_arena *a)
+{
+	cd_wq_arena_free_chunks(a);
+	cd_free(a->allocator, a->base, CD_ALLOC_TAG_SCRATCH);
+	a->base = NULL;
+	a->used = 0;
+	a->spilled = 0;
+}
+
+void* cd_wq_worker_context(void)
+{
+	return cd_wq_current_worker ? cd_wq_current_worker->ctx : NULL;
+}
+
+int cd_wq_worker_idx(void)
+{
+	return cd_wq_current_worker ? cd_wq_current_worker->idx : -1;
+}
+
+static int64_t cd_wq_reduce(struct cd_wq_accumulator *acc, int64_t a, int64_t b)
+{
+	switch (acc->op) {
+		case CD_WQ_REDUCE_SUM:
+			return a + b;
+		case CD_WQ_REDUCE_MIN:
+			return b < a ? b : a;
+		case CD_WQ_REDUCE_MAX:
+			return b > a ? b : a;
+		default:
+			return acc->f_reduce(a, b);
+	}
+}
+
+struct cd_wq_accumulator* cd_wq_accumulator_create(struct cd_workqueue *wq, enum cd_wq_reduce_op op, int64_t (*f_reduce)(int64_t a, int64_t b), int64_t identity)
+{
+	struct cd_wq_accumulator *acc;
+
+	if (!wq || (op == CD_WQ_REDUCE_CUSTOM && !f_reduce))
+		return NULL;
+
+	acc = cd_alloc(wq->allocator, sizeof(struct cd_wq_accumulator), CD_ALLOC_TAG_SCRATCH);
+	if (acc == NULL)
+		return NULL;
+	memset(acc, 0, sizeof(struct cd_wq_accumulator));
+
+	acc->wq = wq;
+	acc->allocator = wq->allocator;
+	acc->op = op;
+	acc->f_reduce = f_reduce;
+	switch (op) {
+		case CD_WQ_REDUCE_SUM:
+			acc->identity = 0;
+			break;
+		case CD_WQ_REDUCE_MIN:
+			acc->identity = INT64_MAX;
+			break;
+		case CD_WQ_REDUCE_MAX:
+			acc->identity = INT64_MIN;
+			break;
+		default:
+			acc->identity = identity;
+			break;
+	}
+
+	acc->shards_n = (wq->group ? 0 : wq->workers_n) + 1;							/* group threads aren't this workqueue's workers */
+	acc->shards = cd_alloc_aligned(acc->allocator, acc->shards_n * sizeof(struct cd_wq_shard), CD_WQ_CACHE_LINE, CD_ALLOC_TAG_SCRATCH);
+	if (acc->shards == NULL) {
+		cd_free(acc->allocator, acc, CD_ALLOC_TAG_SCRATCH);
+		return NULL;
+	}
+	pthread_mutex_init(&acc->lock, NULL);
+	cd_wq_accumulator_reset(acc);
+
+	return acc;
+}
+
+void cd_wq_accumulator_free(struct cd_wq_accumulator **acc)
+{
+	if (!acc || !(*acc))
+		return;
+
+	pthread_mutex_destroy(&(*acc)->lock);
+	cd_free((*acc)->allocator, (*acc)->shards, CD_ALLOC_TAG_SCRATCH);
+	cd_free((*acc)->allocator, *acc, CD_ALLOC_TAG_SCRATCH);
+	*acc = NULL;
+}
+
+void cd_wq_accumulator_update(struct cd_wq_accumulator *acc, int64_t v)
+{
+	struct cd_worker	*w = cd_wq_current_worker;
+	struct cd_wq_shard	*shard;
+
+	if (w && w->wq == acc->wq) {														/* only this worker writes its slot */
+		shard = &acc->shards[w->idx];
+		__atomic_store_n(&shard->v, cd_wq_reduce(acc, __atomic_load_n(&shard->v, __ATOMIC_RELAXED), v), __ATOMIC_RELAXED);
+		return;
+	}
+
+	shard = &acc->shards[acc->shards_n - 1];
+	pthread_mutex_lock(&acc->lock);
+	__atomic_store_n(&shard->v, cd_wq_reduce(acc, shard->v, v), __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&acc->lock);
+}
+
+int64_t cd_wq_accumulator_read(struct cd_wq_accumulator *acc)
+{
+	int64_t		r = acc->identity;
+	uint32_t	i;
+
+	for (i = 0; i < acc->shards_n; i++)
+		r = cd_wq_reduce(acc, r, __atomic_load_n(&acc->shards[i].v, __ATOMIC_RELAXED));
+	return r;
+}
+
+void cd_wq_accumulator_reset(struct cd_wq_accumulator *acc)
+{
+	uint32_t i;
+
+	for (i = 0; i < acc->shards_n; i++)
+		__atomic_store_n(&acc->shards[i].v, acc->identity, __ATOMIC_RELAXED);
+}
+
+void* cd_wq_arena_alloc(size_t size)
+{
+	struct cd_wq_arena			*a = cd_wq_current_arena;
+	struct cd_wq_arena_chunk	*c;
+	void						*p;
+
+	if (a == NULL)
+		return NULL;
+
+	size = (size + CD_WQ_ARENA_ALIGN - 1) & ~((size_t) CD_WQ_ARENA_ALIGN - 1);
+	if (a->base == NULL && a->size >= size) {
+		a->base = cd_alloc_aligned(a->allocator, a->size, CD_WQ_ARENA_ALIGN, CD_ALLOC_TAG_SCRATCH);
+		if (a->base == NULL)
+			return NULL;
+	}
+
+	if (a->base && size <= a->size - a->used) {
+		p = a->base + a->used;
+		a->used += size;
+		return p;
+	}
+
+	c = cd_alloc(a->allocator, sizeof(struct cd_wq_arena_chunk) + size, CD_ALLOC_TAG_SCRATCH);							/* doesn't fit, spill until reset */
+	if (c == NULL)
+		return NULL;
+	c->next = a->chunks;
+	a->chunks = c;
+	a->spilled += size;
+	return c->data;
+}
+
+static int cd_wq_deque_push(struct cd_wq_deque *d, struct cd_work *work)
+{
+	int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+	int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+
+	if (b - t >= CD_WQ_DEQUE_SIZE)
+		return -1;
+
+	__atomic_store_n(&d->buf[b & (CD_WQ_DEQUE_SIZE - 1)], work, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static struct cd_work* cd_wq_deque_pop(struct cd_wq_deque *d)
+{
+	struct cd_work	*work = NULL;
+	int64_t			b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+	int64_t			t;
+
+	__atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+	if (t <= b) {
+		work = __atomic_load_n(&d->buf[b & (CD_WQ_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+		if (t == b) {																	/* last item, race against thieves */
+			if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+				work = NULL;
+			__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+		}
+	} else {																			/* empty */
+		__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return work;
+}
+
+static struct cd_work* cd_wq_deque_steal(struct cd_wq_deque *d)
+{
+	struct cd_work	*work;
+	int64_t			t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	int64_t			b;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+
+	if (t >= b)
+		return NULL;
+
+	work = __atomic_load_n(&d->buf[t & (CD_WQ_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return NULL;																	/* lost the race to the owner or other thief */
+	return work;
+}
+
+static int cd_wq_deque_empty(struct cd_wq_deque *d)
+{
+	return __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE) <= __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+}
+
+static int cd_wq_heap_before(struct cd_work *a, struct cd_work *b)
+{
+	uint64_t da = a->deadline ? a->deadline : UINT64_MAX;
+	uint64_t db = b->deadline ? b->deadline : UINT64_MAX;
+
+	return da < db || (da == db && a->seq < b->seq);
+}
+
+static enum cd_error cd_wq_heap_push(struct cd_wq_heap *h, struct cd_work *work)
+{
+	struct cd_work	**v;
+	uint32_t		i, parent;
+
+	if (h->n == h->size) {
+		v = cd_alloc(h->allocator, (h->size ? 2 * h->size : CD_WQ_HEAP_INIT_SIZE) * sizeof(struct cd_work *), CD_ALLOC_TAG_QUEUE);
+		if (v == NULL)
+			return CD_ERR_MEM;
+		if (h->n)
+			memcpy(v, h->v, h->n * sizeof(struct cd_work *));
+		cd_free(h->allocator, h->v, CD_ALLOC_TAG_QUEUE);
+		h->v = v;
+		h->size = h->size ? 2 * h->size : CD_WQ_HEAP_INIT_SIZE;
+	}
+
+	for (i = h->n++; i > 0; i = parent) {												/* sift up */
+		parent = (i - 1) / 2;
+		if (!cd_wq_heap_before(work, h->v[parent]))
+			break;
+		h->v[i] = h->v[parent];
+	}
+	h->v[i] = work;
+	return CD_ERR_OK;
+}
+
+static struct cd_work* cd_wq_heap_pop(struct cd_wq_heap *h)
+{
+	struct cd_work	*top, *last;
+	uint32_t		i, child;
+
+	if (h->n == 0)
+		return NULL;
+
+	top = h->v[0];
+	last = h->v[--h->n];
+	for (i = 0; (child = 2 * i + 1) < h->n; i = child) {								/* sift down */
+		if (child + 1 < h->n && cd_wq_heap_before(h->v[child + 1], h->v[child]))
+			child++;
+		if (!cd_wq_heap_before(h->v[child], last))
+			break;
+		h->v[i] = h->v[child];
+	}
+	if (h->n)
+		h->v[i] = last;
+	return top;
+}
+
+/* @brief   Enqueue work to the worker's queue. Called with worker's mutex held. */
+static enum cd_error cd_wq_worker_enqueue(struct cd_worker *w, struct cd_work *work)
+{
+	work->worker_idx = w->idx;
+	work->seq = w->seq++;
+
+	if (w->options.CD_WQ_QUEUE_OPTION_ORDER == CD_WQ_QUEUE_OPTION_ORDER_EDF)
+		return cd_wq_heap_push(&w->heap, work);
+
+	cd_fifo_enqueue(&work->link, &w->queue);
+	return CD_ERR_OK;
+}
+
+/* @brief   Dequeue work from the worker's queue. Called with worker's mutex held. */
+static struct cd_work* cd_wq_worker_dequeue(struct cd_worker *w)
+{
+	struct cd_list_head *lh;
+
+	if (w->options.CD_WQ_QUEUE_OPTION_ORDER == CD_WQ_QUEUE_OPTION_ORDER_EDF)
+		return cd_wq_heap_pop(&w->heap);
+
+	cd_fifo_dequeue(&w->queue, lh);
+	if (lh)
+		return cd_container_of(lh, struct cd_work, link);
+	return NULL;
+}
+
+static int cd_wq_worker_queue_empty(struct cd_worker *w)
+{
+	return cd_fifo_empty(&w->queue) && w->heap.n == 0 && cd_wq_deque_empty(&w->local);
+}
+
+/* @brief   Nothing left for this worker to do before it can exit SOFT stop. */
+static int cd_wq_worker_drained(struct cd_worker *w)
+{
+	return cd_wq_worker_queue_empty(w) && __atomic_load_n(&w->wq->throttled_n, __ATOMIC_RELAXED) == 0;
+}
+
+static struct cd_work* cd_wq_worker_steal(struct cd_worker *w)
+{
+	struct cd_workqueue	*wq = w->wq;
+	struct cd_work		*work;
+	uint32_t			i;
+
+	for (i = 1; i < wq->workers_n; i++) {
+		work = cd_wq_deque_steal(&wq->workers[(w->idx + i) % wq->workers_n].local);
+		if (work)
+			return work;
+	}
+	return NULL;
+}
+
+static int cd_wq_worker_can_steal(struct cd_worker *w)
+{
+	struct cd_workqueue	*wq = w->wq;
+	uint32_t			i;
+
+	for (i = 1; i < wq->workers_n; i++) {
+		if (!cd_wq_deque_empty(&wq->workers[(w->idx + i) % wq->workers_n].local))
+			return 1;
+	}
+	return 0;
+}
+
+static uint64_t cd_wq_rate_conforms_at(struct cd_wq_rate_bucket *b, uint64_t t)
+{
+	if (b->interval_ns == 0 || b->tat <= t + b->burst_ns)
+		return t;
+	return b->tat - b->burst_ns;
+}
+
+static void cd_wq_rate_consume(struct cd_wq_rate_bucket *b, uint64_t t)
+{
+	if (b->interval_ns == 0)
+		return;
+	b->tat = (b->tat > t ? b->tat : t) + b->interval_ns;
+}
+
+static void cd_wq_rate_bucket_set(struct cd_wq_rate_bucket *b, uint32_t rate, uint32_t burst)
+{
+	b->interval_ns = rate ? CD_NANOSEC_PER_SEC / rate : 0;
+	b->burst_ns = (uint64_t) (burst > 1 ? burst - 1 : 0) * b->interval_ns;
+	b->tat = 0;
+}
+
+static struct cd_wq_rate_type* cd_wq_rate_type_find(struct cd_workqueue *wq, int user_data_type)
+{
+	struct cd_wq_rate_type *rt;
+
+	cd_hash_for_each_possible(wq->rate_types, rt, node, user_data_type) {
+		if (rt->user_data_type == user_data_type)
+			return rt;
+	}
+	return NULL;
+}
+
+static void cd_wq_rate_update_limited(struct cd_workqueue *wq)
+{
+	uint8_t limited = (wq->rate.interval_ns != 0) || (cd_hash_empty(wq->rate_types) != 0);	/* cd_hash_empty() is non zero if table is not empty */
+
+	__atomic_store_n(&wq->rate_limited, limited, __ATOMIC_RELEASE);
+}
+
+/* @brief   Insert work into throttled queue, keeping it ordered by not_before. Called with rate_lock held. */
+static void cd_wq_throttled_insert(struct cd_workqueue *wq, struct cd_work *work)
+{
+	struct cd_list_head *pos = wq->throttled.prev;
+
+	while (pos != &wq->throttled && cd_container_of(pos, struct cd_work, link)->not_before > work->not_before)
+		pos = pos->prev;
+
+	cd_list_add(&work->link, pos);
+	__atomic_add_fetch(&wq->throttled_n, 1, __ATOMIC_RELAXED);
+}
+
+/* @brief   Take held work which conforms to rate limits by now, if there is any. */
+static struct cd_work* cd_wq_throttled_pop(struct cd_workqueue *wq)
+{
+	struct cd_work *work = NULL;
+
+	if (__atomic_load_n(&wq->throttled_n, __ATOMIC_RELAXED) == 0)
+		return NULL;
+
+	pthread_mutex_lock(&wq->rate_lock);
+	if (!cd_list_empty(&wq->throttled)) {
+		work = cd_list_first_entry(&wq->throttled, struct cd_work, link);
+		if (work->not_before <= cd_util_now_ns()) {
+			cd_list_del_init(&work->link);
+			__atomic_sub_fetch(&wq->throttled_n, 1, __ATOMIC_RELAXED);
+		} else {
+			work = NULL;
+		}
+	}
+	pthread_mutex_unlock(&wq->rate_lock);
+	return work;
+}
+
+/* @brief   Time at which the first held work conforms, 0 if no work is held. */
+static uint64_t cd_wq_throttled_next(struct cd_workqueue *wq)
+{
+	uint64_t t = 0;
+
+	pthread_mutex_lock(&wq->rate_lock);
+	if (!cd_list_empty(&wq->throttled))
+		t = cd_list_first_entry(&wq->throttled, struct cd_work, link)->not_before;
+	pthread_mutex_unlock(&wq->rate_lock);
+	return t;
+}
+
+/* @brief   Check the work against rate limits and reserve its slot.
+ * @return  0 if work conforms now, 1 if it has been held, 2 if it has been held and is the first
+ *          held work to conform (parked workers need to recalculate their timeouts), -1 if rejected. */
+static int cd_wq_rate_admit(struct cd_workqueue *wq, struct cd_work *work)
+{
+	struct cd_wq_rate_type	*rt;
+	uint64_t				now = cd_util_now_ns(), t;
+	int						held = 0;
+
+	pthread_mutex_lock(&wq->rate_lock);
+
+	rt = cd_wq_rate_type_find(wq, work->user_data_type);
+	t = rt ? cd_wq_rate_conforms_at(&rt->bucket, now) : now;
+	t = cd_wq_rate_conforms_at(&wq->rate, t);											/* conforming later never breaks the type limit */
+
+	if (t > now && wq->rate_policy == CD_WQ_RATE_REJECT) {
+		pthread_mutex_unlock(&wq->rate_lock);
+		__atomic_add_fetch(&wq->rejected_n, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	if (rt)
+		cd_wq_rate_consume(&rt->bucket, t);
+	cd_wq_rate_consume(&wq->rate, t);
+
+	if (t > now) {
+		work->not_before = t;
+		cd_wq_throttled_insert(wq, work);
+		held = (wq->throttled.next == &work->link) ? 2 : 1;
+	}
+
+	pthread_mutex_unlock(&wq->rate_lock);
+	return held;
+}
+
+/* @brief   Park the worker on its signal until new work arrives or held work conforms to rate limits.
+ * @details Called with worker's mutex held. Worker is marked idle before the final check
+ *          of the other workers' deques and of held work, so submitter pushing to its local deque
+ *          (or holding work) either sees this worker idle (and signals it), or this worker sees the work. */
+static void cd_wq_worker_park(struct cd_worker *w)
+{
+	struct timespec	ts, *until = NULL;
+	uint64_t		held_next;
+	int				wait = 0;
+
+	__atomic_store_n(&w->idle, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&w->wq->workers_idle_n, 1, __ATOMIC_SEQ_CST);
+
+	if (!cd_wq_worker_can_steal(w)) {
+		held_next = cd_wq_throttled_next(w->wq);
+		if (held_next == 0) {
+			wait = w->active;															/* when draining, there's nothing more to wait for */
+		} else if (held_next > cd_util_now_ns()) {										/* sleep until first held work conforms */
+			cd_util_ns_to_timespec(held_next, &ts);
+			until = &ts;
+			wait = 1;
+		}
+		if (wait) {
+			CD_WQ_PROBE3(worker_park, w->wq->name, w->idx, held_next);
+			cd_wq_worker_wait(w, until);
+			CD_WQ_PROBE2(worker_unpark, w->wq->name, w->idx);
+		}
+	}
+
+	__atomic_sub_fetch(&w->wq->workers_idle_n, 1, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&w->idle, 0, __ATOMIC_SEQ_CST);
+}
+
+/* @brief   Signal one parked worker (other than @self, which may be NULL), so it can steal from @self's deque
+ *          or recalculate the time it waits for held work. */
+static void cd_wq_worker_wake_idle(struct cd_workqueue *wq, struct cd_worker *self)
+{
+	struct cd_worker	*w;
+	uint32_t			i, start = self ? self->idx + 1u : 0;
+
+	for (i = 0; i < wq->workers_n; i++) {
+		w = &wq->workers[(start + i) % wq->workers_n];
+		if (w != self && __atomic_load_n(&w->idle, __ATOMIC_SEQ_CST)) {
+			cd_wq_worker_lock(w);
+			cd_wq_worker_signal(w);
+			cd_wq_worker_unlock(w);
+			return;
+		}
+	}
+}
+
+static pthread_mutex_t* cd_wq_coalesce_lock(struct cd_workqueue *wq, uint64_t key, struct cd_hlist_head **bucket)
+{
+	uint32_t bkt = cd_hash_min(key, CD_WQ_COALESCE_BITS);
+
+	*bucket = &wq->coalesce_index[bkt];
+	return &wq->coalesce_lock[bkt & (CD_WQ_COALESCE_LOCKS - 1)];
+}
+
+/* @brief   Remove the work from coalescing index, so work with the same key can be enqueued again. */
+static void cd_wq_coalesce_del(struct cd_workqueue *wq, struct cd_work *work)
+{
+	struct cd_hlist_head	*bucket;
+	pthread_mutex_t			*lock;
+
+	if (!cd_hash_hashed(&work->coalesce_node))										/* only the owner of the work unhashes it, so this can't change under us */
+		return;
+
+	lock = cd_wq_coalesce_lock(wq, work->coalesce_key, &bucket);
+	pthread_mutex_lock(lock);
+	cd_hash_del(&work->coalesce_node);
+	pthread_mutex_unlock(lock);
+}
+
+/* @brief   Start timing the hole at emit_seq, called once it's both current and submitted.
+ * @details Emitter (which has just advanced emit_seq) and submitter (which has just taken seq) both check
+ *          for the other, with SEQ_CST at least one of them sees the work is current and submitted. */
+static void cd_wq_ordered_hole_start(struct cd_wq_ordered *o)
+{
+	uint64_t zero = 0;
+
+	if (o->hole_timeout_ns == 0)
+		return;
+	if (!__atomic_compare_exchange_n(&o->hole_since, &zero, cd_util_now_ns(), 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return;
+	if (__atomic_load_n(&o->watch_idle, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&o->watch_lock);
+		pthread_cond_signal(&o->watch_signal);
+		pthread_mutex_unlock(&o->watch_lock);
+	}
+}
+
+/* @brief   Move emit_seq to @s, the next work's hole starts now if it has been submitted already. */
+static void cd_wq_ordered_advance(struct cd_wq_ordered *o, uint64_t s)
+{
+	__atomic_store_n(&o->hole_since, 0, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&o->emit_seq, s, __ATOMIC_SEQ_CST);
+	if (s < __atomic_load_n(&o->next_seq, __ATOMIC_SEQ_CST))
+		cd_wq_ordered_hole_start(o);
+}
+
+/* @brief   Emit ready results from emit_seq on, if no other thread is doing it.
+ * @details Thread which finds the role taken just leaves, the holder rechecks after giving the role up. */
+static void cd_wq_ordered_emit(struct cd_wq_ordered *o)
+{
+	struct cd_wq_ordered_slot	*slot;
+	struct cd_work				*work;
+	uint64_t					s, st, since;
+
+	while (1) {
+		if (__atomic_exchange_n(&o->emitting, 1, __ATOMIC_SEQ_CST))
+			return;
+
+		while (1) {
+			s = o->emit_seq;
+			slot = &o->slots[s & o->mask];
+			st = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+
+			if (st == ((s << 2) | CD_WQ_ORDERED_READY)) {
+				work = slot->work;
+				if (work) {
+					o->f_emit(work->user_data, work->ret);
+					cd_wq_call_dctor(o->wq, work, CD_WORK_SYNC);
+					cd_wq_work_done(&work);
+				}
+				cd_wq_ordered_advance(o, s + 1);
+				__atomic_store_n(&slot->state, (s + o->size) << 2 | CD_WQ_ORDERED_FREE, __ATOMIC_RELEASE);	/* reusable by submit */
+				continue;
+			}
+
+			since = __atomic_load_n(&o->hole_since, __ATOMIC_SEQ_CST);
+			if (o->hole_timeout_ns == 0 || since == 0 || s >= __atomic_load_n(&o->next_seq, __ATOMIC_ACQUIRE)
+					|| cd_util_now_ns() - since < o->hole_timeout_ns)
+				break;																	/* waiting forever, nothing outstanding, or not timed out yet */
+
+			if (__atomic_compare_exchange_n(&slot->state, &st, (s << 2) | CD_WQ_ORDERED_SKIPPED, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				__atomic_add_fetch(&o->skipped_n, 1, __ATOMIC_RELAXED);						/* slot is released by the late work */
+				cd_wq_ordered_advance(o, s + 1);
+			}
+		}
+
+		__atomic_store_n(&o->emitting, 0, __ATOMIC_SEQ_CST);
+
+		// Work finishing meanwhile saw the role taken, so if next result is ready now it's ours to emit.
+		s = __atomic_load_n(&o->emit_seq, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&o->slots[s & o->mask].state, __ATOMIC_SEQ_CST) != ((s << 2) | CD_WQ_ORDERED_READY))
+			return;
+	}
+}
+
+/* @brief   Park finished (or with NULL @work - cancelled) work with @seq in its slot and emit what's ready. */
+static void cd_wq_ordered_complete(struct cd_wq_ordered *o, uint64_t seq, struct cd_work *work)
+{
+	struct cd_wq_ordered_slot	*slot = &o->slots[seq & o->mask];
+	uint64_t					expected = (seq << 2) | CD_WQ_ORDERED_FREE;
+
+	slot->work = work;
+	if (!__atomic_compare_exchange_n(&slot->state, &expected, (seq << 2) | CD_WQ_ORDERED_READY, 0, __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE)) {
+		if (work) {																		/* skipped meanwhile, too late */
+			__atomic_add_fetch(&o->late_n, 1, __ATOMIC_RELAXED);
+			cd_wq_call_dctor(o->wq, work, CD_WORK_SYNC);
+			cd_wq_work_done(&work);
+		}
+		__atomic_store_n(&slot->state, (seq + o->size) << 2 | CD_WQ_ORDERED_FREE, __ATOMIC_RELEASE);
+		return;
+	}
+
+	cd_wq_ordered_emit(o);
+}
+
+static void cd_wq_strand_cancel(struct cd_wq_strand *s);
+
+/* @brief   Release work which will not be processed. */
+static void cd_wq_work_cancel(struct cd_workqueue *wq, struct cd_work *work)
+{
+	struct cd_wq_ordered *o = work->ordered;
+	uint64_t seq = work->ordered_seq;
+
+	if (work->flags & CD_WORK_FLAG_STRAND_RUNNER) {										/* embedded in strand, release strand's jobs instead */
+		cd_wq_strand_cancel((struct cd_wq_strand*) work->user_data);
+		return;
+	}
+
+	cd_wq_coalesce_del(wq, work);
+
+	// Execute sync destructors.
+	// This will call user's destructor for the task which has not been processed.
+	cd_wq_call_dctor(wq, work, CD_WORK_SYNC);
+
+	cd_wq_work_done(&work);
+
+	if (o)
+		cd_wq_ordered_complete(o, seq, NULL);											/* don't hold the results behind it */
+}
+
+/* @brief   Post the result of finished work to the completion ring.
+ * @return  1 if ring was full and the work has been kept on overflow list to carry its completion, 0 otherwise. */
+static int cd_wq_completion_post(struct cd_wq_completion_ring *r, struct cd_work *work, void *user_data)
+{
+	struct cd_wq_completion_cell	*cell;
+	uint64_t						pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED), seq;
+	uint64_t						one = 1;
+	int								kept = 0;
+
+	while (1) {
+		cell = &r->cells[pos & r->mask];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		if ((int64_t) (seq - pos) == 0) {
+			if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;																	/* cell is ours */
+		} else if ((int64_t) (seq - pos) < 0) {
+			cell = NULL;																/* full */
+			break;
+		} else {
+			pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	if (cell) {
+		cell->c.user_data = user_data;
+		cell->c.user_data_type = work->user_data_type;
+		cell->c.ret = work->ret;
+		cell->c.submit_ns = work->submit_ns;
+		cell->c.start_ns = work->start_ns;
+		cell->c.end_ns = work->end_ns;
+		__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	} else {
+		work->user_data = user_data;													/* cleared again before the work is freed */
+		pthread_mutex_lock(&r->overflow_lock);
+		cd_fifo_enqueue(&work->link, &r->overflow);
+		r->overflow_pending_n++;
+		r->overflow_n++;
+		pthread_mutex_unlock(&r->overflow_lock);
+		kept = 1;
+	}
+
+	if (r->fd >= 0 && write(r->fd, &one, sizeof(one)) < 0)
+		CD_LOG_ERR("Failed to signal completion eventfd");
+	return kept;
+}
+
+static int cd_wq_completion_take(struct cd_wq_completion_ring *r, struct cd_wq_completion *out)
+{
+	struct cd_wq_completion_cell	*cell;
+	uint64_t						pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED), seq;
+
+	while (1) {
+		cell = &r->cells[pos & r->mask];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		if ((int64_t) (seq - (pos + 1)) == 0) {
+			if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if ((int64_t) (seq - (pos + 1)) < 0) {
+			return 0;																	/* empty */
+		} else {
+			pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	*out = cell->c;
+	__atomic_store_n(&cell->seq, pos + r->mask + 1, __ATOMIC_RELEASE);					/* free for the next lap */
+	return 1;
+}
+
+/* @brief   Append @n records to trace file. Called with trace's lock held. */
+static void cd_wq_trace_write(struct cd_wq_trace *t, const struct cd_wq_trace_record *rec, uint32_t n)
+{
+	const char	*p = (const char*) rec;
+	size_t		left = n * sizeof(struct cd_wq_trace_record);
+	ssize_t		written;
+
+	while (left > 0) {
+		written = write(t->fd, p, left);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			t->lost_n += left / sizeof(struct cd_wq_trace_record);
+			return;
+		}
+		p += written;
+		left -= written;
+	}
+	t->records_n += n;
+}
+
+static void cd_wq_trace_job(struct cd_workqueue *wq, struct cd_work *work, uint64_t start_ns)
+{
+	struct cd_wq_trace			*t = wq->trace;
+	struct cd_worker			*w = cd_wq_current_worker;
+	struct cd_wq_trace_buf		*b;
+	struct cd_wq_trace_record	*rec;
+	int							shared = !(w && w->wq == wq);
+
+	b = &t->bufs[shared ? t->bufs_n - 1 : w->idx];									/* own buffer needs no lock */
+	if (shared)
+		pthread_mutex_lock(&t->lock);
+
+	rec = &b->rec[b->n++];
+	rec->submit_ns = work->submit_ns > t->start_ns ? work->submit_ns - t->start_ns : 0;
+	rec->start_ns = start_ns - t->start_ns;
+	rec->end_ns = cd_util_now_ns() - t->start_ns;
+	rec->user_data_type = work->user_data_type;
+	rec->worker = shared ? CD_WQ_TRACE_NO_WORKER : w->idx;
+	rec->pad = 0;
+
+	if (b->n == CD_WQ_TRACE_BUF_N) {
+		if (!shared)
+			pthread_mutex_lock(&t->lock);
+		cd_wq_trace_write(t, b->rec, b->n);
+		b->n = 0;
+		if (!shared)
+			pthread_mutex_unlock(&t->lock);
+	}
+
+	if (shared)
+		pthread_mutex_unlock(&t->lock);
+}
+
+enum cd_error cd_wq_workqueue_trace_start(struct cd_workqueue *wq, const char *path)
+{
+	struct cd_wq_trace			*t;
+	struct cd_wq_trace_header	h;
+
+	if (!wq || !path || wq->trace)
+		return CD_ERR_BAD_CALL;
+
+	t = cd_alloc(wq->allocator, sizeof(struct cd_wq_trace), CD_ALLOC_TAG_SCRATCH);
+	if (t == NULL)
+		return CD_ERR_MEM;
+	memset(t, 0, sizeof(struct cd_wq_trace));
+
+	t->bufs_n = (wq->group ? 0 : wq->workers_n) + 1;
+	t->bufs = cd_alloc_aligned(wq->allocator, t->bufs_n * sizeof(struct cd_wq_trace_buf), 64, CD_ALLOC_TAG_SCRATCH);
+	if (t->bufs == NULL) {
+		cd_free(wq->allocator, t, CD_ALLOC_TAG_SCRATCH);
+		return CD_ERR_MEM;
+	}
+	memset(t->bufs, 0, t->bufs_n * sizeof(struct cd_wq_trace_buf));
+
+	t->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (t->fd < 0) {
+		CD_LOG_CRIT("Can't open trace file [%s]: %s", path, strerror(errno));
+		cd_free(wq->allocator, t->bufs, CD_ALLOC_TAG_SCRATCH);
+		cd_free(wq->allocator, t, CD_ALLOC_TAG_SCRATCH);
+		return CD_ERR_FAIL;
+	}
+	pthread_mutex_init(&t->lock, NULL);
+	t->start_ns = cd_util_now_ns();
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, CD_WQ_TRACE_MAGIC, sizeof(h.magic));
+	h.version = CD_WQ_TRACE_VERSION;
+	h.workers_n = wq->group ? wq->group->threads_n : wq->workers_n;
+	h.start_ns = t->start_ns;
+	if (write(t->fd, &h, sizeof(h)) != (ssize_t) sizeof(h)) {
+		close(t->fd);
+		pthread_mutex_destroy(&t->lock);
+		cd_free(wq->allocator, t->bufs, CD_ALLOC_TAG_SCRATCH);
+		cd_free(wq->allocator, t, CD_ALLOC_TAG_SCRATCH);
+		return CD_ERR_FAIL;
+	}
+
+	__atomic_store_n(&wq->trace, t, __ATOMIC_RELEASE);
+	return CD_ERR_OK;
+}
+
+/* @brief   Flush and close the trace, no job may be running. */
+static enum cd_error cd_wq_trace_close(struct cd_workqueue *wq)
+{
+	struct cd_wq_trace	*t = wq->trace;
+	uint32_t			i;
+	enum cd_error		err = CD_ERR_OK;
+
+	if (t == NULL)
+		return CD_ERR_OK;
+
+	wq->trace = NULL;
+	pthread_mutex_lock(&t->lock);
+	for (i = 0; i < t->bufs_n; i++) {
+		cd_wq_trace_write(t, t->bufs[i].rec, t->bufs[i].n);
+		t->bufs[i].n = 0;
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	if (t->lost_n > 0) {
+		CD_LOG_CRIT("Lost [%lu] trace records of workqueue [%s]", t->lost_n, wq->name);
+		err = CD_ERR_FAIL;
+	}
+	close(t->fd);
+	pthread_mutex_destroy(&t->lock);
+	cd_free(wq->allocator, t->bufs, CD_ALLOC_TAG_SCRATCH);
+	cd_free(wq->allocator, t, CD_ALLOC_TAG_SCRATCH);
+	return err;
+}
+
+enum cd_error cd_wq_workqueue_trace_stop(struct cd_workqueue *wq)
+{
+	if (!wq)
+		return CD_ERR_BAD_CALL;
+	if (wq->trace && (wq->group ? wq->running : (wq->workers_active_n > 0)))		/* workers may still be filling their buffers */
+		return CD_ERR_BUSY;
+	return cd_wq_trace_close(wq);
+}
+
+/* @brief   Last stage of processed work: SYNC destructor, completion, release. */
+static void cd_wq_work_finish(struct cd_workqueue *wq, struct cd_work *work)
+{
+	struct cd_wq_completion_ring *r = wq->completions;
+	void *user_data = work->user_data;													/* identifies completion, destructor clears it */
+	struct cd_wq_wait_group *wg;
+
+	// Execute sync destructors.
+	cd_wq_call_dctor(wq, work, CD_WORK_SYNC);
+
+	if (r) {
+		wg = work->wait_group;															/* work may be reaped and freed once posted */
+		if (work->end_ns == 0)
+			work->end_ns = cd_util_now_ns();
+		if (cd_wq_completion_post(r, work, user_data)) {
+			if (wg)																		/* freed once its completion is reaped, but done now */
+				cd_wq_wait_group_done(wg);
+			return;
+		}
+	}
+
+	cd_wq_work_done(&work);
+}
+
+/* @brief   Finish all works on reclaim stack, in the order they were pushed. @return Number of works finished. */
+static uint32_t cd_wq_reclaim_drain(struct cd_workqueue *wq)
+{
+	struct cd_work	*head, *prev = NULL, *next;
+	uint32_t		n = 0;
+
+	head = __atomic_exchange_n(&wq->reclaim_head, NULL, __ATOMIC_ACQUIRE);
+	while (head) {																		/* newest first, reverse */
+		next = (struct cd_work*) head->link.next;
+		head->link.next = (struct cd_list_head*) prev;
+		prev = head;
+		head = next;
+	}
+	while (prev) {
+		next = (struct cd_work*) prev->link.next;
+		CD_INIT_LIST_HEAD(&prev->link);
+		cd_wq_work_finish(wq, prev);
+		prev = next;
+		n++;
+	}
+	return n;
+}
+
+static void* cd_wq_reclaim_f(void *arg)
+{
+	struct cd_workqueue *wq = (struct cd_workqueue*) arg;
+
+	while (1) {
+		cd_wq_reclaim_drain(wq);
+
+		pthread_mutex_lock(&wq->reclaim_lock);
+		while (__atomic_load_n(&wq->reclaim_head, __ATOMIC_ACQUIRE) == NULL && wq->reclaim_running)
+			pthread_cond_wait(&wq->reclaim_signal, &wq->reclaim_lock);
+		if (!wq->reclaim_running && __atomic_load_n(&wq->reclaim_head, __ATOMIC_ACQUIRE) == NULL) {
+			pthread_mutex_unlock(&wq->reclaim_lock);
+			break;
+		}
+		pthread_mutex_unlock(&wq->reclaim_lock);
+	}
+	return NULL;
+}
+
+/* @brief   Hand processed work over to reclaim thread. @return 0 if reclaim thread has been stopped, caller finishes the work. */
+static int cd_wq_reclaim_push(struct cd_workqueue *wq, struct cd_work *work)
+{
+	struct cd_work *head;
+
+	if (!__atomic_load_n(&wq->reclaim_running, __ATOMIC_ACQUIRE))
+		return 0;
+
+	__atomic_add_fetch(&wq->deferred_n, 1, __ATOMIC_RELAXED);
+	head = __atomic_load_n(&wq->reclaim_head, __ATOMIC_RELAXED);
+	do {
+		work->link.next = (struct cd_list_head*) head;
+	} while (!__atomic_compare_exchange_n(&wq->reclaim_head, &head, work, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	if (head == NULL) {																	/* reclaim thread may be sleeping, wake it once per batch */
+		pthread_mutex_lock(&wq->reclaim_lock);
+		pthread_cond_signal(&wq->reclaim_signal);
+		pthread_mutex_unlock(&wq->reclaim_lock);
+	}
+	return 1;
+}
+
+/* @brief   Let reclaim thread finish all deferred works and exit. */
+static void cd_wq_reclaim_stop(struct cd_workqueue *wq)
+{
+	pthread_mutex_lock(&wq->reclaim_lock);
+	if (!wq->reclaim_running) {
+		pthread_mutex_unlock(&wq->reclaim_lock);
+		return;
+	}
+	__atomic_store_n(&wq->reclaim_running, 0, __ATOMIC_RELEASE);
+	pthread_cond_signal(&wq->reclaim_signal);
+	pthread_mutex_unlock(&wq->reclaim_lock);
+
+	pthread_join(wq->reclaim_tid, NULL);
+	cd_wq_reclaim_drain(wq);															/* pushed while it was exiting */
+}
+
+static void cd_wq_work_execute(struct cd_workqueue *wq, struct cd_work *work)
+{
+	struct cd_wq_completion_ring *r = wq->completions;
+
+	if (work->flags & CD_WORK_FLAG_STRAND_RUNNER) {
+		work->f(work->user_data);														/* runner may be running on other worker once this returns, don't touch it */
+		return;
+	}
+
+	if (work->deadline && work->deadline < cd_util_now_ns()) {							/* too late to be useful, drop it */
+		__atomic_add_fetch(&wq->expired_n, 1, __ATOMIC_RELAXED);
+		if (wq->options.f_expired)
+			wq->options.f_expired(work);
+		cd_wq_work_cancel(wq, work);
+		return;
+	}
+
+	cd_wq_coalesce_del(wq, work);														/* started, no longer pending */
+
+	if (r || wq->trace)
+		work->start_ns = cd_util_now_ns();
+
+	CD_WQ_PROBE_WORK(work_start, wq, work);
+	work->ret = work->f(work->user_data);
+	CD_WQ_PROBE_WORK(work_end, wq, work);
+
+	if (wq->trace)
+		cd_wq_trace_job(wq, work, work->start_ns);
+
+	if (work->ordered) {																/* destructed once emitted */
+		cd_wq_ordered_complete(work->ordered, work->ordered_seq, work);
+		return;
+	}
+
+	if (wq->reclaim_running) {
+		if (r)
+			work->end_ns = cd_util_now_ns();											/* destructor's delay isn't job's latency */
+		if (cd_wq_reclaim_push(wq, work))
+			return;
+	}
+
+	cd_wq_work_finish(wq, work);
+}
+
+/* @brief   Next job of the strand, in submit order. Called only by the owner of runner role (pending_n > 0). */
+static struct cd_work* cd_wq_strand_next(struct cd_wq_strand *s)
+{
+	struct cd_work		*head, *next;
+	struct cd_list_head	*lh;
+
+	if (cd_fifo_empty(&s->run)) {
+		head = __atomic_exchange_n(&s->inbox, NULL, __ATOMIC_SEQ_CST);
+		while (head) {																	/* newest first, adding each at front gives submit order */
+			next = (struct cd_work*) head->link.next;
+			cd_list_add(&head->link, &s->run);
+			head = next;
+		}
+	}
+
+	cd_fifo_dequeue(&s->run, lh);
+	return cd_container_of(lh, struct cd_work, link);
+}
+
+/* @brief   Calling thread is a worker of @wq in SOFT stop, it processes whatever its jobs queue before it exits. */
+static int cd_wq_worker_draining_self(struct cd_workqueue *wq)
+{
+	struct cd_worker *w = cd_wq_current_worker;
+
+	return w && w->wq == wq && __atomic_load_n(&w->options.CD_WQ_QUEUE_OPTION_STOP, __ATOMIC_RELAXED) == CD_WQ_QUEUE_OPTION_STOP_SOFT;
+}
+
+/* @brief   Calling thread is running a job of stopped, but still draining, grouped @wq. Called with group's mutex held. */
+static int cd_wq_group_draining_self(struct cd_workqueue *wq)
+{
+	return wq->group_draining && wq->group_running_n > 0 && cd_wq_current_group == wq->group;
+}
+
+/* @brief   Hint whether workqueue accepts work, to avoid requeuing (and logging about it) while it's being stopped. */
+static int cd_wq_workqueue_accepting(struct cd_workqueue *wq)
+{
+	if (wq->group)
+		return __atomic_load_n(&wq->group->active, __ATOMIC_RELAXED) && (__atomic_load_n(&wq->running, __ATOMIC_RELAXED)
+				|| (__atomic_load_n(&wq->group_draining, __ATOMIC_RELAXED) && cd_wq_current_group == wq->group));
+	return __atomic_load_n(&wq->workers_active_n, __ATOMIC_RELAXED) > 0 || cd_wq_worker_draining_self(wq);
+}
+
+static void* cd_wq_strand_run_f(void *arg)
+{
+	struct cd_wq_strand	*s = (struct cd_wq_strand*) arg;
+	struct cd_work		*work;
+	uint32_t			i = 0;
+
+	while (1) {
+		work = cd_wq_strand_next(s);
+		cd_wq_work_execute(s->wq, work);
+		if (__atomic_sub_fetch(&s->pending_n, 1, __ATOMIC_SEQ_CST) == 0)
+			return NULL;																/* next submitter queues the runner again */
+		if (++i == CD_WQ_STRAND_BATCH) {
+			i = 0;
+			s->runner.flags |= CD_WORK_FLAG_SHARED;										/* not to own local deque, this worker would pop it right back */
+			if (cd_wq_workqueue_accepting(s->wq) && cd_wq_queue_work(s->wq, &s->runner) == CD_ERR_OK)	/* continue on any worker, after other work */
+				return NULL;
+			// Runner can't be queued again (workqueue is stopping and won't drain it on this thread),
+			// so it gives up fairness on purpose and runs the rest of strand's jobs right here:
+			// they must not be lost, and there is no other way to get them processed.
+		}
+	}
+}
+
+/* @brief   Release all pending jobs of the strand. Called by the owner of runner role. */
+static void cd_wq_strand_cancel(struct cd_wq_strand *s)
+{
+	struct cd_work *work;
+
+	do {
+		work = cd_wq_strand_next(s);
+		cd_wq_work_cancel(s->wq, work);
+	} while (__atomic_sub_fetch(&s->pending_n, 1, __ATOMIC_SEQ_CST) != 0);
+}
+
+static void cd_wq_worker_set_name(struct cd_worker *w)
+{
+	char	name[CD_WQ_WORKER_NAME_LEN], suffix[8];
+	int		suffix_len;
+
+	if (w->wq->worker_attr.name[0] == '\0')
+		return;
+
+	suffix_len = snprintf(suffix, sizeof(suffix), "/%u", w->idx);
+	snprintf(name, sizeof(name), "%.*s%s", (int) (CD_WQ_WORKER_NAME_LEN - 1 - suffix_len), w->wq->worker_attr.name, suffix);
+	pthread_setname_np(pthread_self(), name);
+}
+
+static void* cd_wq_worker_f(void *arg)
+{
+	struct cd_work          *work;
+
+	struct cd_worker *w = (struct cd_worker*) arg;
+
+	cd_wq_current_worker = w;
+	cd_wq_current_arena = &w->arena;
+	cd_wq_worker_set_name(w);
+	if (w->options.f_worker_init)
+		w->ctx = w->options.f_worker_init(w->idx, w->options.worker_arg);
+
+	cd_wq_worker_lock(w);
+
+	while (w->active || ((w->options.CD_WQ_QUEUE_OPTION_STOP == CD_WQ_QUEUE_OPTION_STOP_SOFT) && !cd_wq_worker_drained(w))) {
+
+		// Work submitted by own jobs first (most recent first, while it's still in cache),
+		// then work enqueued to this worker, then held work which now conforms to rate limits,
+		// then try to steal from other workers.
+		work = cd_wq_deque_pop(&w->local);
+		if (work == NULL)
+			work = cd_wq_worker_dequeue(w);
+		if (work == NULL)
+			work = cd_wq_throttled_pop(w->wq);
+		if (work == NULL && (w->active || w->options.CD_WQ_QUEUE_OPTION_STOP == CD_WQ_QUEUE_OPTION_STOP_SOFT))
+			work = cd_wq_worker_steal(w);
+
+		if (work) {
+			CD_WQ_PROBE_WORK(work_dequeue, w->wq, work);
+
+			// Allow for further enquing while work is being processed.
+			cd_wq_worker_unlock(w);
+
+			cd_wq_work_execute(w->wq, work);
+			__atomic_store_n(&w->done_n, w->done_n + 1, __ATOMIC_RELAXED);
+			cd_wq_arena_reset(&w->arena);
+
+			cd_wq_worker_lock(w);
+		}
+
+		// do not exit:
+		//	if is still active (regardless of CD_WQ_QUEUE_STOP_ type)
+		//		- if it's empty then sleep, if it's not empty then continue processing work
+		//	if not active but it's CD_WQ_QUEUE_STOP_SOFT and queue is not empty (continue to do work)
+		//
+		// Therefore to exit queue processing:
+		// if it's CD_WQ_QUEUE_STOP_HARD - set active to 0 (terminate processing, ignoring waiting work if any)
+		// if it's CD_WQ_QUEUE_STOP_SOFT - set active to 0 and wait till all work has been processed
+		//	(including work held by rate limits, which is waited for, not executed early)
+
+		if (!w->active) {
+
+			if ((w->options.CD_WQ_QUEUE_OPTION_STOP == CD_WQ_QUEUE_OPTION_STOP_HARD) || 
+					((w->options.CD_WQ_QUEUE_OPTION_STOP == CD_WQ_QUEUE_OPTION_STOP_SOFT) && cd_wq_worker_drained(w))) {
+				goto exit;
+			}
+		}
+
+		if (cd_wq_worker_queue_empty(w))
+			cd_wq_worker_park(w);
+	}
+
+exit:
+	cd_wq_worker_unlock(w);
+	if (w->options.f_worker_deinit)
+		w->options.f_worker_deinit(w->ctx, w->idx, w->options.worker_arg);
+	w->ctx = NULL;
+	cd_wq_current_worker = NULL;
+	cd_wq_current_arena = NULL;
+	cd_wq_arena_deinit(&w->arena);
+
+	pthread_mutex_lock(&w->wq->stop_lock);
+	w->wq->workers_exited_n++;
+	pthread_cond_broadcast(&w->wq->stop_signal);
+	pthread_mutex_unlock(&w->wq->stop_lock);
+	return NULL;
+}
+
+static void cd_wq_worker_init(struct cd_worker *w, struct cd_workqueue *wq)
+{
+	pthread_condattr_t attr;
+
+	memset(w, 0, sizeof(struct cd_worker));
+	pthread_mutex_init(&w->mutex, NULL);
+	w->active = 0;
+	w->wq = wq;
+	w->options = wq->options;
+	cd_wq_arena_init(&w->arena, wq->options.arena_size, wq->allocator);
+	w->heap.allocator = wq->allocator;
+	CD_INIT_LIST_HEAD(&w->queue);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);								/* timed waits for held work use cd_util_now_ns() */
+	pthread_cond_init(&w->signal, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+/* @brief   Cancel all work left in the worker's queues, worker's thread must not be running.
+ * @return  Number of cancelled works. */
+static uint64_t cd_wq_worker_cancel_all(struct cd_worker *w)
+{
+	struct cd_list_head *it = NULL, *n = NULL;
+	struct cd_work *work = NULL;
+	uint64_t cancelled_n = 0;
+
+	while ((work = cd_wq_deque_pop(&w->local)) != NULL) {
+		cd_wq_work_cancel(w->wq, work);
+		cancelled_n++;
+	}
+
+	cd_list_for_each_safe(it, n, &w->queue)
+	{
+		work = cd_container_of(it, struct cd_work, link);
+		cd_list_del_init(it);
+		cd_wq_work_cancel(w->wq, work);
+		cancelled_n++;
+	}
+
+	assert(cd_list_empty(&w->queue));
+
+	while ((work = cd_wq_heap_pop(&w->heap)) != NULL) {
+		cd_wq_work_cancel(w->wq, work);
+		cancelled_n++;
+	}
+	return cancelled_n;
+}
+
+/* @brief   Cancel all work held by rate limits. @return Number of cancelled works. */
+static uint64_t cd_wq_throttled_cancel_all(struct cd_workqueue *wq)
+{
+	struct cd_list_head *it = NULL, *n = NULL;
+	struct cd_work *work = NULL;
+	uint64_t cancelled_n = 0;
+
+	cd_list_for_each_safe(it, n, &wq->throttled)
+	{
+		work = cd_container_of(it, struct cd_work, link);
+		cd_list_del_init(it);
+		cd_wq_work_cancel(wq, work);
+		cancelled_n++;
+	}
+	wq->throttled_n = 0;
+	return cancelled_n;
+}
+
+static enum cd_error cd_wq_worker_deinit(struct cd_worker *w)
+{
+	if (w->options.CD_WQ_QUEUE_OPTION_STOP == CD_WQ_QUEUE_OPTION_STOP_SOFT) {
+		assert(cd_wq_worker_queue_empty(w) != 0 && "Queue NOT EMPTY! Worker terminating processing of not empty queue...\n");
+	}
+
+	if (!cd_wq_worker_queue_empty(w)) {
+		CD_LOG_CRIT("Warning, worker [%u] terminating processing of not empty queue...", w->idx);
+	}
+
+	cd_wq_worker_cancel_all(w);
+	cd_free(w->heap.allocator, w->heap.v, CD_ALLOC_TAG_QUEUE);
+	w->heap.v = NULL;
+
+	pthread_mutex_destroy(&w->mutex);
+	pthread_cond_destroy(&w->signal);
+
+	return CD_ERR_OK;
+}
+
+/* @brief   Initialize the part of workqueue which doesn't depend on where its work is processed. */
+static void cd_wq_workqueue_init_common(struct cd_workqueue *wq, const struct cd_wq_queue_options *options)
+{
+	pthread_condattr_t attr;
+	uint32_t i;
+
+	wq->options = *options;
+
+	cd_hash_init(wq->coalesce_index);
+	for (i = 0; i < CD_WQ_COALESCE_LOCKS; i++)
+		pthread_mutex_init(&wq->coalesce_lock[i], NULL);
+
+	pthread_mutex_init(&wq->rate_lock, NULL);
+	cd_hash_init(wq->rate_types);
+	CD_INIT_LIST_HEAD(&wq->throttled);
+
+	CD_INIT_LIST_HEAD(&wq->group_queue);
+	CD_INIT_LIST_HEAD(&wq->group_link);
+
+	pthread_mutex_init(&wq->stop_lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wq->stop_signal, &attr);
+	pthread_condattr_destroy(&attr);
+
+	pthread_mutex_init(&wq->reclaim_lock, NULL);
+	pthread_cond_init(&wq->reclaim_signal, NULL);
+	if (options->CD_WQ_QUEUE_OPTION_DTOR == CD_WQ_QUEUE_OPTION_DTOR_DEFERRED) {
+		wq->reclaim_running = 1;
+		if (cd_launch_thread(&wq->reclaim_tid, cd_wq_reclaim_f, wq, PTHREAD_CREATE_JOINABLE) != CD_ERR_OK) {
+			wq->reclaim_running = 0;
+			CD_LOG_CRIT("Can't start reclaim thread, destructors will be called inline");
+		}
+	}
+}
+
+/* @brief   Take the next work of the group's ready workqueues, NULL if there is none. Called with group's mutex held.
+ * @details Deficit round robin with unit cost: queue at the head of ready list gets weight credits when
+ *          its turn starts, it's served until they're used up or it has no more work, then it goes to
+ *          the back of the list (or out of it). */
+static struct cd_work* cd_wq_group_next(struct cd_wq_group *g, struct cd_workqueue **wq_out)
+{
+	struct cd_workqueue	*wq;
+	struct cd_list_head	*lh;
+
+	if (cd_list_empty(&g->ready))
+		return NULL;
+
+	wq = cd_list_first_entry(&g->ready, struct cd_workqueue, group_link);
+	if (wq->deficit == 0)
+		wq->deficit = wq->weight;
+
+	cd_fifo_dequeue(&wq->group_queue, lh);
+	wq->deficit--;
+	wq->group_running_n++;
+
+	if (cd_fifo_empty(&wq->group_queue)) {
+		cd_list_del_init(&wq->group_link);
+		wq->deficit = 0;																/* credits are not carried over idle periods */
+	} else if (wq->deficit == 0) {
+		cd_list_move_tail(&wq->group_link, &g->ready);
+	}
+
+	*wq_out = wq;
+	return cd_container_of(lh, struct cd_work, link);
+}
+
+/* @brief   Work taken with cd_wq_group_next() has been processed. Called with group's mutex held. */
+static void cd_wq_group_work_done(struct cd_wq_group *g, struct cd_workqueue *wq)
+{
+	wq->group_running_n--;
+	if (!wq->running && wq->group_running_n == 0)									/* workqueue's stop may be waiting for it, don't touch wq after unlock */
+		pthread_cond_broadcast(&g->drained);
+}
+
+static void* cd_wq_group_thread_f(void *arg)
+{
+	struct cd_wq_group	*g = (struct cd_wq_group*) arg;
+	struct cd_workqueue	*wq;
+	struct cd_work		*work;
+	struct cd_wq_arena	arena;
+
+	cd_wq_arena_init(&arena, 0, g->allocator);
+	cd_wq_current_arena = &arena;
+	cd_wq_current_group = g;
+
+	pthread_mutex_lock(&g->mutex);
+
+	while (1) {
+
+		work = cd_wq_group_next(g, &wq);
+		if (work == NULL) {
+			if (!g->active)																/* all queued work has been processed */
+				break;
+			g->threads_idle_n++;
+			pthread_cond_wait(&g->signal, &g->mutex);
+			g->threads_idle_n--;
+			continue;
+		}
+
+		pthread_mutex_unlock(&g->mutex);
+
+		CD_WQ_PROBE_WORK(work_dequeue, wq, work);
+		cd_wq_work_execute(wq, work);
+		cd_wq_arena_reset(&arena);
+
+		pthread_mutex_lock(&g->mutex);
+		cd_wq_group_work_done(g, wq);
+	}
+
+	pthread_mutex_unlock(&g->mutex);
+	cd_wq_current_group = NULL;
+	cd_wq_current_arena = NULL;
+	cd_wq_arena_deinit(&arena);
+	return NULL;
+}
+
+struct cd_wq_group* cd_wq_group_create(uint32_t threads_n, const char *name)
+{
+	const struct cd_allocator *a;
+	struct cd_wq_group	*g;
+	pthread_condattr_t	attr;
+	uint32_t			i;
+	long				cpus;
+
+	if (threads_n == 0) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads_n = cpus > 0 ? (uint32_t) cpus : 1;
+	}
+
+	a = cd_alloc_get_default();
+	g = cd_alloc(a, sizeof(struct cd_wq_group), CD_ALLOC_TAG_WORKQUEUE);
+	if (g == NULL)
+		return NULL;
+	memset(g, 0, sizeof(struct cd_wq_group));
+	g->allocator = a;
+
+	g->threads = cd_alloc(a, threads_n * sizeof(pthread_t), CD_ALLOC_TAG_WORKQUEUE);
+	if (g->threads == NULL) {
+		cd_free(a, g, CD_ALLOC_TAG_WORKQUEUE);
+		return NULL;
+	}
+
+	pthread_mutex_init(&g->mutex, NULL);
+	pthread_cond_init(&g->signal, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);								/* stop with timeout waits on it */
+	pthread_cond_init(&g->drained, &attr);
+	pthread_condattr_destroy(&attr);
+	CD_INIT_LIST_HEAD(&g->ready);
+	g->active = 1;
+
+	for (i = 0; i < threads_n; i++) {
+		if (cd_launch_thread(&g->threads[g->threads_n], cd_wq_group_thread_f, g, PTHREAD_CREATE_JOINABLE) == CD_ERR_OK)
+			g->threads_n++;
+	}
+
+	if (g->threads_n == 0) {
+		g->active = 0;
+		cd_wq_group_free(&g);
+		return NULL;
+	}
+
+	g->name = cd_alloc_strdup(g->allocator, name, CD_ALLOC_TAG_WORKQUEUE);
+	return g;
+}
+
+enum cd_error cd_wq_group_stop(struct cd_wq_group *g)
+{
+	enum cd_error	err = CD_ERR_OK;
+	uint32_t		i;
+
+	if (!g)
+		return CD_ERR_BAD_CALL;
+
+	pthread_mutex_lock(&g->mutex);
+	if (!g->active) {
+		pthread_mutex_unlock(&g->mutex);
+		return CD_ERR_OK;
+	}
+	g->active = 0;
+	pthread_cond_broadcast(&g->signal);
+	pthread_mutex_unlock(&g->mutex);
+
+	for (i = 0; i < g->threads_n; i++) {
+		if (pthread_join(g->threads[i], NULL) != 0)
+			err = CD_ERR_FAIL;
+	}
+	return err;
+}
+
+enum cd_error cd_wq_group_free(struct cd_wq_group **g)
+{
+	enum cd_error err = CD_ERR_OK;
+
+	if (!g || !(*g))
+		return CD_ERR_OK;
+
+	if ((*g)->wqs_n > 0)
+		return CD_ERR_BUSY;
+
+	err = cd_wq_group_stop(*g);
+	if (err != CD_ERR_OK)
+		return err;
+
+	pthread_mutex_destroy(&(*g)->mutex);
+	pthread_cond_destroy(&(*g)->signal);
+	pthread_cond_destroy(&(*g)->drained);
+	cd_free((*g)->allocator, (*g)->threads, CD_ALLOC_TAG_WORKQUEUE);
+	cd_free((*g)->allocator, (void*)(*g)->name, CD_ALLOC_TAG_WORKQUEUE);
+	cd_free((*g)->allocator, *g, CD_ALLOC_TAG_WORKQUEUE);
+	*g = NULL;
+
+	return CD_ERR_OK;
+}
+
+static enum cd_error cd_wq_group_queue_work(struct cd_workqueue *wq, struct cd_work *work)
+{
+	struct cd_wq_group *g = wq->group;
+
+	if (__atomic_load_n(&wq->rate_limited, __ATOMIC_ACQUIRE) && !(work->flags & CD_WORK_FLAG_STRAND_RUNNER)
+			&& cd_wq_rate_admit(wq, work) < 0)											/* only CD_WQ_RATE_REJECT can be set */
+		return CD_ERR_BUSY;
+
+	pthread_mutex_lock(&g->mutex);
+	if (!g->active || (!wq->running && !cd_wq_group_draining_self(wq))) {
+		pthread_mutex_unlock(&g->mutex);
+		CD_LOG_CRIT("Workqueue [%s] or its group is stopped", wq->name);
+		return CD_ERR_WORKQUEUE_ACTIVE;
+	}
+
+	work->worker_idx = 0;
+	cd_fifo_enqueue(&work->link, &wq->group_queue);
+	if (cd_list_empty(&wq->group_link))
+		cd_list_add_tail(&wq->group_link, &g->ready);
+	pthread_cond_signal(&g->signal);
+	pthread_mutex_unlock(&g->mutex);
+
+	return CD_ERR_OK;
+}
+
+static enum cd_error cd_wq_group_workqueue_stop(struct cd_workqueue *wq)
+{
+	struct cd_wq_group	*g = wq->group;
+	struct cd_list_head	*it = NULL, *n = NULL;
+	struct cd_work		*work = NULL;
+	CD_LIST_HEAD(cancelled);
+
+	pthread_mutex_lock(&g->mutex);
+	wq->running = 0;																	/* no more work is accepted, but from its own running jobs */
+
+	if (wq->options.CD_WQ_QUEUE_OPTION_STOP == CD_WQ_QUEUE_OPTION_STOP_HARD || !g->active) {
+		cd_list_splice_init(&wq->group_queue, &cancelled);
+		cd_list_del_init(&wq->group_link);
+		wq->deficit = 0;
+	} else {
+		wq->group_draining = 1;
+	}
+
+	while (wq->group_running_n > 0 || !cd_fifo_empty(&wq->group_queue))
+		pthread_cond_wait(&g->drained, &g->mutex);
+	wq->group_draining = 0;
+	pthread_mutex_unlock(&g->mutex);
+
+	cd_list_for_each_safe(it, n, &cancelled)
+	{
+		work = cd_container_of(it, struct cd_work, link);
+		cd_list_del_init(it);
+		cd_wq_work_cancel(wq, work);
+	}
+	return CD_ERR_OK;
+}
+
+/* @brief   Stop grouped workqueue, cancelling work which hasn't been started by @deadline. */
+static void cd_wq_group_workqueue_stop_timeout(struct cd_workqueue *wq, uint64_t deadline, struct cd_wq_stop_report *r)
+{
+	struct cd_wq_group	*g = wq->group;
+	struct cd_list_head	*it = NULL, *n = NULL;
+	struct cd_work		*work = NULL;
+	struct timespec		ts;
+	uint64_t			pending_n = 0;
+	CD_LIST_HEAD(cancelled);
+
+	pthread_mutex_lock(&g->mutex);
+	wq->running = 0;
+	wq->group_draining = 1;
+
+	cd_list_for_each(it, &wq->group_queue)
+		pending_n++;
+	pending_n += wq->group_running_n;
+
+	while (g->active && (wq->group_running_n > 0 || !cd_fifo_empty(&wq->group_queue))) {
+		if (cd_util_now_ns() >= deadline) {
+			r->timed_out = 1;
+			break;
+		}
+		cd_util_ns_to_timespec(deadline, &ts);
+		pthread_cond_timedwait(&g->drained, &g->mutex, &ts);
+	}
+
+	wq->group_draining = 0;																/* phase 2: no new jobs get queued or started */
+	cd_list_splice_init(&wq->group_queue, &cancelled);
+	cd_list_del_init(&wq->group_link);
+	wq->deficit = 0;
+	while (wq->group_running_n > 0)
+		pthread_cond_wait(&g->drained, &g->mutex);
+	pthread_mutex_unlock(&g->mutex);
+
+	cd_list_for_each_safe(it, n, &cancelled)
+	{
+		work = cd_container_of(it, struct cd_work, link);
+		cd_list_del_init(it);
+		cd_wq_work_cancel(wq, work);
+		r->dropped_n++;
+	}
+	r->drained_n = pending_n - r->dropped_n;
+}
+
+enum cd_error cd_wq_workqueue_init_grouped(struct cd_workqueue *wq, struct cd_wq_group *g, uint32_t weight, const char *name, const struct cd_wq_queue_options *options)
+{
+	struct cd_wq_queue_options soft = { 0 };
+
+	if (!wq || !g)
+		return CD_ERR_BAD_CALL;
+
+	if (options == NULL) {
+		soft.CD_WQ_QUEUE_OPTION_STOP = CD_WQ_QUEUE_OPTION_STOP_SOFT;
+		options = &soft;
+	}
+
+	memset(wq, 0, sizeof(struct cd_workqueue));
+	wq->allocator = options->allocator ? options->allocator : cd_alloc_get_default();
+	cd_wq_workqueue_init_common(wq, options);
+	wq->options.CD_WQ_QUEUE_OPTION_ORDER = CD_WQ_QUEUE_OPTION_ORDER_FIFO;
+	wq->weight = weight ? weight : 1;
+	wq->name = cd_alloc_strdup(wq->allocator, name, CD_ALLOC_TAG_WORKQUEUE);
+
+	pthread_mutex_lock(&g->mutex);
+	if (!g->active) {
+		pthread_mutex_unlock(&g->mutex);
+		return CD_ERR_WORKQUEUE_CREATE;
+	}
+	wq->group = g;
+	wq->running = 1;
+	g->wqs_n++;
+	pthread_mutex_unlock(&g->mutex);
+
+	return CD_ERR_OK;
+}
+
+struct cd_workqueue* cd_wq_workqueue_create_grouped(struct cd_wq_group *g, uint32_t weight, const char *name, const struct cd_wq_queue_options *options)
+{
+	struct cd_workqueue *wq;
+
+	if (!g)
+		return NULL;
+
+	wq = cd_alloc(options ? options->allocator : NULL, sizeof(struct cd_workqueue), CD_ALLOC_TAG_WORKQUEUE);
+	if (wq == NULL) {
+		return NULL;
+	}
+
+	if (cd_wq_workqueue_init_grouped(wq, g, weight, name, options) != CD_ERR_OK) {
+		cd_wq_workqueue_free(&wq);
+		return NULL;
+	}
+	return wq;
+}
+
+/* @brief   Resolve attributes requested for workers into the ones they will run with. */
+static void cd_wq_worker_attr_resolve(struct cd_wq_worker_attr *a, const struct cd_wq_worker_attr *requested, const char *wq_name)
+{
+	pthread_attr_t  attr;
+	long            page = sysconf(_SC_PAGESIZE);
+
+	memset(a, 0, sizeof(struct cd_wq_worker_attr));
+	if (requested)
+		*a = *requested;
+
+	if (pthread_attr_init(&attr) == 0) {
+		if (a->stack_size == 0)
+			pthread_attr_getstacksize(&attr, &a->stack_size);
+		if (a->guard_size == 0)
+			pthread_attr_getguardsize(&attr, &a->guard_size);
+		pthread_attr_destroy(&attr);
+	}
+	if (a->stack_size < (size_t) PTHREAD_STACK_MIN)
+		a->stack_size = (size_t) PTHREAD_STACK_MIN;
+	if (page > 0)
+		a->stack_size = (a->stack_size + page - 1) & ~((size_t) page - 1);
+
+	if (a->name[0] == '\0' && wq_name)
+		snprintf(a->name, sizeof(a->name), "%s", wq_name);
+	a->name[CD_WQ_WORKER_NAME_LEN - 1] = '\0';
+}
+
+/* @brief   Report scheduling the worker @t really runs with, setting the requested one may have failed (and been logged). */
+static void cd_wq_worker_attr_effective(struct cd_wq_worker_attr *a, pthread_t t)
+{
+	struct sched_param	param;
+	int					policy;
+
+	if (pthread_getschedparam(t, &policy, &param) != 0)
+		return;
+	a->sched_policy = policy;
+	a->sched_priority = param.sched_priority;
+}
+
+/* @brief   Launch threads of up to @n workers which haven't been started yet.
+ * @return  Number of workers started. */
+static uint32_t cd_wq_workers_start(struct cd_workqueue *wq, uint32_t n)
+{
+	struct cd_worker    *w = NULL;
+	uint32_t            workers_n = wq->workers_n, started_n = 0;
+
+	pthread_mutex_lock(&wq->stop_lock);
+	if (!wq->running) {																	/* stopped, don't bring workers back */
+		pthread_mutex_unlock(&wq->stop_lock);
+		return 0;
+	}
+
+	while (workers_n && started_n < n) {
+		--workers_n;
+		w = &wq->workers[workers_n];
+		if (w->active || w->stopping)
+			continue;
+		w->active = 1;
+		if (cd_launch_thread_attr(&w->tid, cd_wq_worker_f, w, PTHREAD_CREATE_JOINABLE, &wq->worker_attr) == CD_ERR_OK) {
+			cd_wq_worker_attr_effective(&wq->worker_attr, w->tid);
+			if (wq->workers_active_n == 0)
+				wq->first_active_worker_idx = w->idx;
+			__atomic_add_fetch(&wq->workers_active_n, 1, __ATOMIC_RELEASE);		/* increase the number of running workers */
+			started_n++;
+		} else {
+			w->active = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&wq->stop_lock);
+	return started_n;
+}
+
+/* @brief   Lazy workqueue needs one more worker if none has been started yet, or none of the started ones is idle. */
+static int cd_wq_workers_want_more(struct cd_workqueue *wq)
+{
+	uint32_t active_n = __atomic_load_n(&wq->workers_active_n, __ATOMIC_ACQUIRE);
+
+	if (!__atomic_load_n(&wq->running, __ATOMIC_RELAXED) || active_n >= wq->workers_n)
+		return 0;
+	return active_n == 0 || __atomic_load_n(&wq->workers_idle_n, __ATOMIC_SEQ_CST) == 0;
+}
+
+enum cd_error cd_wq_workqueue_prewarm(struct cd_workqueue *wq, uint32_t workers_n)
+{
+	if (!wq || wq->group)
+		return CD_ERR_BAD_CALL;
+
+	if (workers_n == 0 || workers_n > wq->workers_n)
+		workers_n = wq->workers_n;
+
+	if (!__atomic_load_n(&wq->running, __ATOMIC_RELAXED))
+		return CD_ERR_WORKQUEUE_ACTIVE;
+
+	if (wq->workers_active_n < workers_n)
+		cd_wq_workers_start(wq, workers_n - wq->workers_active_n);
+
+	return wq->workers_active_n >= workers_n ? CD_ERR_OK : CD_ERR_WORKQUEUE_CREATE;
+}
+
+enum cd_error cd_wq_workqueue_init(struct cd_workqueue *wq, uint32_t workers_n, const char *name, uint8_t option_stop)
+{
+	struct cd_wq_queue_options options = { 0 };
+
+	options.CD_WQ_QUEUE_OPTION_STOP = option_stop;
+	options.CD_WQ_QUEUE_OPTION_ORDER = CD_WQ_QUEUE_OPTION_ORDER_FIFO;
+	return cd_wq_workqueue_init_options(wq, workers_n, name, &options);
+}
+
+enum cd_error cd_wq_workqueue_init_options(struct cd_workqueue *wq, uint32_t workers_n, const char *name, const struct cd_wq_queue_options *options)
+{
+	struct cd_worker    *w = NULL;
+	uint32_t            i = 0;
+
+	memset(wq, 0, sizeof(struct cd_workqueue));
+	wq->allocator = options->allocator ? options->allocator : cd_alloc_get_default();
+	wq->workers = cd_alloc(wq->allocator, workers_n * sizeof(struct cd_worker), CD_ALLOC_TAG_WORKQUEUE);
+	if (wq->workers == NULL) {
+		return CD_ERR_MEM;
+	}
+	wq->workers_n = workers_n;
+
+	cd_wq_workqueue_init_common(wq, options);
+
+	for (i = 0; i < workers_n; i++) {													/* workers look into each other's deques, initialize all of them before any starts */
+		w = &wq->workers[i];
+		cd_wq_worker_init(w, wq);
+		w->idx = i;
+	}
+
+	wq->name = cd_alloc_strdup(wq->allocator, name, CD_ALLOC_TAG_WORKQUEUE);
+	wq->running = 1;
+
+	cd_wq_worker_attr_resolve(&wq->worker_attr, options->worker_attr, name);
+	wq->options.worker_attr = NULL;													/* copied, caller's struct needn't outlive init */
+
+	if (options->CD_WQ_QUEUE_OPTION_START == CD_WQ_QUEUE_OPTION_START_LAZY)
+		return workers_n > 0 ? CD_ERR_OK : CD_ERR_WORKQUEUE_CREATE;					/* first work starts the first worker */
+
+	cd_wq_workers_start(wq, workers_n);
+
+	if (wq->workers_active_n > 0) {																		/* if we have at least one worker thread then queue creation was successful */
+		return CD_ERR_OK;
+	} else {
+		return CD_ERR_WORKQUEUE_CREATE;
+	}
+}
+
+enum cd_error cd_wq_workqueue_default_init(struct cd_workqueue *wq, uint32_t workers_n, const char *name)
+{
+	return cd_wq_workqueue_init(wq, workers_n, name, CD_WQ_QUEUE_OPTION_STOP_SOFT);
+}
+
+enum cd_error cd_wq_workqueue_deinit(struct cd_workqueue *wq)
+{
+	struct cd_worker    *w = NULL;
+	uint32_t            workers_n = wq->workers_n;
+	struct cd_list_head *it = NULL, *n = NULL;
+	struct cd_work      *work = NULL;
+	struct cd_wq_rate_type *rt = NULL;
+	struct cd_hlist_node *tmp = NULL;
+	uint32_t            bkt = 0;
+
+	if (wq->group) {
+		if (wq->running)
+			cd_wq_workqueue_stop(wq);
+		pthread_mutex_lock(&wq->group->mutex);
+		wq->group->wqs_n--;
+		pthread_mutex_unlock(&wq->group->mutex);
+		wq->group = NULL;
+	}
+
+	cd_wq_reclaim_stop(wq);
+	cd_wq_trace_close(wq);
+	cd_free(wq->allocator, (void*)wq->name, CD_ALLOC_TAG_WORKQUEUE);
+	while (workers_n) {
+		--workers_n;
+		w = &wq->workers[workers_n];
+		if (cd_wq_worker_deinit(w) != CD_ERR_OK) {
+			return CD_ERR_FAIL;
+		}
+	}
+	cd_free(wq->allocator, wq->workers, CD_ALLOC_TAG_WORKQUEUE);
+
+	cd_wq_throttled_cancel_all(wq);
+
+	cd_hash_for_each_safe(wq->rate_types, bkt, tmp, rt, node) {
+		cd_hash_del(&rt->node);
+		cd_free(wq->allocator, rt, CD_ALLOC_TAG_QUEUE);
+	}
+	pthread_mutex_destroy(&wq->rate_lock);
+
+	for (workers_n = 0; workers_n < CD_WQ_COALESCE_LOCKS; workers_n++)
+		pthread_mutex_destroy(&wq->coalesce_lock[workers_n]);
+	pthread_mutex_destroy(&wq->stop_lock);
+	pthread_cond_destroy(&wq->stop_signal);
+	pthread_mutex_destroy(&wq->reclaim_lock);
+	pthread_cond_destroy(&wq->reclaim_signal);
+
+	if (wq->completions) {																/* drop unreaped completions */
+		cd_list_for_each_safe(it, n, &wq->completions->overflow)
+		{
+			work = cd_container_of(it, struct cd_work, link);
+			cd_list_del_init(it);
+			work->user_data = NULL;
+			cd_wq_work_free(&work);
+		}
+		pthread_mutex_destroy(&wq->completions->overflow_lock);
+		if (wq->completions->fd >= 0)
+			close(wq->completions->fd);
+		cd_free(wq->allocator, wq->completions->cells, CD_ALLOC_TAG_QUEUE);
+		cd_free(wq->allocator, wq->completions, CD_ALLOC_TAG_QUEUE);
+		wq->completions = NULL;
+	}
+	return CD_ERR_OK;
+}
+
+enum cd_error cd_wq_workqueue_free(struct cd_workqueue **wq)
+{
+	enum cd_error err = CD_ERR_OK;
+
+	if (!wq || !(*wq))
+		return CD_ERR_OK;
+
+	err = cd_wq_workqueue_deinit(*wq);
+	if (err != CD_ERR_OK)
+		return err;
+
+	cd_free((*wq)->allocator, *wq, CD_ALLOC_TAG_WORKQUEUE);
+	*wq = NULL;
+
+	return CD_ERR_OK;
+}
+
+struct cd_workqueue* cd_wq_workqueue_create(uint32_t workers_n, const char *name, uint8_t option_stop)
+{
+	struct cd_wq_queue_options options = { 0 };
+
+	options.CD_WQ_QUEUE_OPTION_STOP = option_stop;
+	options.CD_WQ_QUEUE_OPTION_ORDER = CD_WQ_QUEUE_OPTION_ORDER_FIFO;
+	return cd_wq_workqueue_create_options(workers_n, name, &options);
+}
+
+struct cd_workqueue* cd_wq_workqueue_create_options(uint32_t workers_n, const char *name, const struct cd_wq_queue_options *options)
+{
+	enum cd_error   err = CD_ERR_OK;
+	struct cd_workqueue *wq;
+	wq = cd_alloc(options->allocator, sizeof(struct cd_workqueue), CD_ALLOC_TAG_WORKQUEUE);
+	if (wq == NULL) {
+		return NULL;
+	}
+	memset(wq, 0, sizeof(struct cd_workqueue));
+
+	err = cd_wq_workqueue_init_options(wq, workers_n, name, options);
+	if (err  != CD_ERR_OK) {
+		switch (err) {
+
+			case CD_ERR_MEM:
+				cd_free(wq->allocator, wq, CD_ALLOC_TAG_WORKQUEUE);
+				return NULL;
+
+			case CD_ERR_WORKQUEUE_CREATE:
+				cd_wq_workqueue_free(&wq);
+				return NULL;
+
+			default:
+				break;
+		}
+	}
+	return wq;
+}
+
+struct cd_workqueue* cd_wq_workqueue_default_create(uint32_t workers_n, const char *name)
+{
+	return cd_wq_workqueue_create(workers_n, name, CD_WQ_QUEUE_OPTION_STOP_SOFT);
+}
+
+/* @brief   Tell all running workers to stop, without waiting for them. Takes intake down at once.
+ * @details If @stop_option is not NULL, workers use it instead of their CD_WQ_QUEUE_OPTION_STOP.
+ * @return  Number of workers signaled. */
+static uint32_t cd_wq_workers_signal_stop(struct cd_workqueue *wq, const uint8_t *stop_option)
+{
+	struct cd_worker    *w = NULL;
+	uint32_t            i, signaled_n = 0;
+
+	pthread_mutex_lock(&wq->stop_lock);													/* no more workers are started */
+	wq->running = 0;
+	pthread_mutex_unlock(&wq->stop_lock);
+
+	__atomic_store_n(&wq->workers_active_n, 0, __ATOMIC_RELAXED);					/* no more work is accepted, but from draining workers themselves */
+	for (i = 0; i < wq->workers_n; i++) {
+		w = &wq->workers[i];
+		cd_wq_worker_lock(w);
+		if (stop_option && (w->active || w->stopping))
+			w->options.CD_WQ_QUEUE_OPTION_STOP = *stop_option;
+		if (w->active == 1) {
+			w->active = 0;                                                  /* tell the worker to stop */
+			w->stopping = 1;
+			signaled_n++;
+		}
+		cd_wq_worker_signal(w);                                    /* signal the worker */
+		cd_wq_worker_unlock(w);
+	}
+	return signaled_n;
+}
+
+/* @brief   Join all workers which have been told to stop. */
+static enum cd_error cd_wq_workers_join(struct cd_workqueue *wq)
+{
+	struct cd_worker    *w = NULL;
+	uint32_t            i;
+	enum cd_error       err = CD_ERR_OK;
+
+	for (i = 0; i < wq->workers_n; i++) {
+		w = &wq->workers[i];
+		if (w->stopping) {
+			if (pthread_join(w->tid, NULL) != CD_ERR_OK) {                  /* join worker thread */
+				err = CD_ERR_FAIL;
+			}
+			w->stopping = 0;
+		}
+	}
+	return err;
+}
+
+enum cd_error cd_wq_workqueue_stop(struct cd_workqueue *wq)
+{
+	enum cd_error       err = CD_ERR_OK;
+
+	CD_WQ_PROBE2(wq_stop, wq->name, UINT64_MAX);
+	if (wq->group) {
+		err = cd_wq_group_workqueue_stop(wq);
+	} else {
+		if (wq->workers_n > 0)
+			cd_wq_workers_signal_stop(wq, NULL);                            /* all workers drain in parallel */
+		err = cd_wq_workers_join(wq);
+	}
+	cd_wq_reclaim_stop(wq);                                                 /* no more work gets processed, finish deferred */
+	CD_WQ_PROBE2(wq_stopped, wq->name, err);
+	return err;
+}
+
+enum cd_error cd_wq_workqueue_stop_timeout(struct cd_workqueue *wq, uint64_t timeout_ns, struct cd_wq_stop_report *report)
+{
+	struct cd_wq_stop_report	r = { 0 };
+	struct timespec				ts;
+	uint64_t					start, deadline, done_n = 0;
+	uint32_t					i, exited_n;
+	uint8_t						soft = CD_WQ_QUEUE_OPTION_STOP_SOFT, hard = CD_WQ_QUEUE_OPTION_STOP_HARD;
+	enum cd_error				err = CD_ERR_OK;
+
+	if (!wq)
+		return CD_ERR_BAD_CALL;
+
+	start = cd_util_now_ns();
+	deadline = start + timeout_ns;
+
+	CD_WQ_PROBE2(wq_stop, wq->name, timeout_ns);
+	if (wq->group) {
+		cd_wq_group_workqueue_stop_timeout(wq, deadline, &r);
+		goto out;
+	}
+
+	pthread_mutex_lock(&wq->stop_lock);
+	exited_n = wq->workers_exited_n;
+	pthread_mutex_unlock(&wq->stop_lock);
+
+	for (i = 0; i < wq->workers_n; i++)
+		done_n += __atomic_load_n(&wq->workers[i].done_n, __ATOMIC_RELAXED);
+
+	// Phase 1: intake is off, all workers drain in parallel until the deadline.
+	exited_n += cd_wq_workers_signal_stop(wq, &soft);
+
+	pthread_mutex_lock(&wq->stop_lock);
+	while (wq->workers_exited_n < exited_n) {
+		if (cd_util_now_ns() >= deadline) {
+			r.timed_out = 1;
+			break;
+		}
+		cd_util_ns_to_timespec(deadline, &ts);
+		pthread_cond_timedwait(&wq->stop_signal, &wq->stop_lock, &ts);
+	}
+	pthread_mutex_unlock(&wq->stop_lock);
+
+	// Phase 2: workers still draining finish their current job and exit, the rest is cancelled.
+	if (r.timed_out)
+		cd_wq_workers_signal_stop(wq, &hard);
+	err = cd_wq_workers_join(wq);
+
+	for (i = 0; i < wq->workers_n; i++) {
+		r.drained_n += __atomic_load_n(&wq->workers[i].done_n, __ATOMIC_RELAXED);
+		r.dropped_n += cd_wq_worker_cancel_all(&wq->workers[i]);
+	}
+	r.drained_n -= done_n;
+	r.dropped_n += cd_wq_throttled_cancel_all(wq);
+
+out:
+	cd_wq_reclaim_stop(wq);
+	r.duration_ns = cd_util_now_ns() - start;
+	if (report)
+		*report = r;
+	CD_WQ_PROBE2(wq_stopped, wq->name, err);
+	return err;
+}
+
+enum cd_error cd_wq_workqueue_set_rate_limit(struct cd_workqueue *wq, uint32_t rate, uint32_t burst, enum cd_wq_rate_policy policy)
+{
+	if (!wq)
+		return CD_ERR_BAD_CALL;
+
+	if (wq->group && rate && policy == CD_WQ_RATE_HOLD)								/* group's threads don't process held work */
+		return CD_ERR_BAD_CALL;
+
+	pthread_mutex_lock(&wq->rate_lock);
+	cd_wq_rate_bucket_set(&wq->rate, rate, burst);
+	wq->rate_policy = policy;
+	cd_wq_rate_update_limited(wq);
+	pthread_mutex_unlock(&wq->rate_lock);
+	return CD_ERR_OK;
+}
+
+enum cd_error cd_wq_workqueue_set_type_rate_limit(struct cd_workqueue *wq, int user_data_type, uint32_t rate, uint32_t burst)
+{
+	struct cd_wq_rate_type *rt;
+
+	if (!wq)
+		return CD_ERR_BAD_CALL;
+
+	if (wq->group && rate && wq->rate_policy == CD_WQ_RATE_HOLD)
+		return CD_ERR_BAD_CALL;
+
+	pthread_mutex_lock(&wq->rate_lock);
+	rt = cd_wq_rate_type_find(wq, user_data_type);
+	if (rate == 0) {
+		if (rt) {
+			cd_hash_del(&rt->node);
+			cd_free(wq->allocator, rt, CD_ALLOC_TAG_QUEUE);
+		}
+	} else {
+		if (rt == NULL) {
+			rt = cd_alloc(wq->allocator, sizeof(struct cd_wq_rate_type), CD_ALLOC_TAG_QUEUE);
+			if (rt == NULL) {
+				pthread_mutex_unlock(&wq->rate_lock);
+				return CD_ERR_MEM;
+			}
+			rt->user_data_type = user_data_type;
+			cd_hash_add(wq->rate_types, &rt->node, user_data_type);
+		}
+		cd_wq_rate_bucket_set(&rt->bucket, rate, burst);
+	}
+	cd_wq_rate_update_limited(wq);
+	pthread_mutex_unlock(&wq->rate_lock);
+	return CD_ERR_OK;
+}
+
+enum cd_error cd_wq_workqueue_enable_completions(struct cd_workqueue *wq, uint32_t size, int use_eventfd)
+{
+	struct cd_wq_completion_ring	*r;
+	uint64_t						n = 1, i;
+
+	if (!wq || size == 0 || wq->completions)
+		return CD_ERR_BAD_CALL;
+
+	while (n < size)
+		n <<= 1;
+
+	r = cd_alloc(wq->allocator, sizeof(struct cd_wq_completion_ring), CD_ALLOC_TAG_QUEUE);
+	if (r == NULL)
+		return CD_ERR_MEM;
+	memset(r, 0, sizeof(struct cd_wq_completion_ring));
+
+	r->cells = cd_alloc(wq->allocator, n * sizeof(struct cd_wq_completion_cell), CD_ALLOC_TAG_QUEUE);
+	if (r->cells == NULL) {
+		cd_free(wq->allocator, r, CD_ALLOC_TAG_QUEUE);
+		return CD_ERR_MEM;
+	}
+	for (i = 0; i < n; i++)
+		r->cells[i].seq = i;
+	r->mask = n - 1;
+
+	r->fd = -1;
+	if (use_eventfd) {
+		r->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (r->fd < 0) {
+			cd_free(wq->allocator, r->cells, CD_ALLOC_TAG_QUEUE);
+			cd_free(wq->allocator, r, CD_ALLOC_TAG_QUEUE);
+			return CD_ERR_FAIL;
+		}
+	}
+
+	pthread_mutex_init(&r->overflow_lock, NULL);
+	CD_INIT_LIST_HEAD(&r->overflow);
+
+	__atomic_store_n(&wq->completions, r, __ATOMIC_RELEASE);
+	return CD_ERR_OK;
+}
+
+uint32_t cd_wq_reap_completions(struct cd_workqueue *wq, struct cd_wq_completion *out, uint32_t max)
+{
+	struct cd_wq_completion_ring	*r;
+	struct cd_list_head				*lh;
+	struct cd_work					*work;
+	uint64_t						v;
+	uint32_t						n = 0;
+
+	if (!wq || !out || (r = __atomic_load_n(&wq->completions, __ATOMIC_ACQUIRE)) == NULL)
+		return 0;
+
+	if (r->fd >= 0 && read(r->fd, &v, sizeof(v)) < 0 && errno != EAGAIN)				/* reset before taking, so later posts signal it again */
+		CD_LOG_ERR("Failed to read completion eventfd");
+
+	while (n < max && cd_wq_completion_take(r, &out[n]))
+		n++;
+
+	if (n < max && __atomic_load_n(&r->overflow_pending_n, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&r->overflow_lock);
+		while (n < max) {
+			cd_fifo_dequeue(&r->overflow, lh);
+			if (lh == NULL)
+				break;
+			r->overflow_pending_n--;
+			work = cd_container_of(lh, struct cd_work, link);
+			out[n].user_data = work->user_data;
+			out[n].user_data_type = work->user_data_type;
+			out[n].ret = work->ret;
+			out[n].submit_ns = work->submit_ns;
+			out[n].start_ns = work->start_ns;
+			out[n].end_ns = work->end_ns;
+			n++;
+			work->user_data = NULL;
+			cd_wq_work_free(&work);
+		}
+		pthread_mutex_unlock(&r->overflow_lock);
+	}
+
+	return n;
+}
+
+int cd_wq_completion_fd(struct cd_workqueue *wq)
+{
+	if (!wq || !wq->completions)
+		return -1;
+	return wq->completions->fd;
+}
+
+enum cd_error cd_wq_worker_lock_stats(struct cd_workqueue *wq, uint32_t worker_idx, struct cd_wq_lock_stats *stats)
+{
+	struct cd_wq_lock_stats *ls;
+
+	if (!wq || !stats || wq->group || worker_idx >= wq->workers_n)
+		return CD_ERR_BAD_CALL;
+
+	ls = &wq->workers[worker_idx].lock_stats;											/* not under the lock, it would count itself */
+	stats->acquired_n = __atomic_load_n(&ls->acquired_n, __ATOMIC_RELAXED);
+	stats->contended_n = __atomic_load_n(&ls->contended_n, __ATOMIC_RELAXED);
+	stats->wait_ns = __atomic_load_n(&ls->wait_ns, __ATOMIC_RELAXED);
+	stats->signaled_n = __atomic_load_n(&ls->signaled_n, __ATOMIC_RELAXED);
+	stats->parked_n = __atomic_load_n(&ls->parked_n, __ATOMIC_RELAXED);
+	stats->parked_ns = __atomic_load_n(&ls->parked_ns, __ATOMIC_RELAXED);
+	return CD_ERR_OK;
+}
+
+enum cd_error cd_wq_workqueue_stats(struct cd_workqueue *wq, struct cd_wq_stats *stats)
+{
+	struct cd_wq_lock_stats	ls;
+	uint32_t				i;
+
+	if (!wq || !stats)
+		return CD_ERR_BAD_CALL;
+
+	memset(stats, 0, sizeof(struct cd_wq_stats));
+	if (wq->group) {																	/* threads are shared, report group's */
+		pthread_mutex_lock(&wq->group->mutex);
+		stats->workers_n = wq->group->threads_n;
+		stats->workers_active_n = wq->group->active ? wq->group->threads_n : 0;
+		stats->workers_idle_n = wq->group->threads_idle_n;
+		pthread_mutex_unlock(&wq->group->mutex);
+	} else {
+		stats->workers_n = wq->workers_n;
+		stats->workers_active_n = wq->workers_active_n;
+		stats->workers_idle_n = __atomic_load_n(&wq->workers_idle_n, __ATOMIC_RELAXED);
+		stats->worker_attr = wq->worker_attr;
+	}
+	stats->coalesced_n = __atomic_load_n(&wq->coalesced_n, __ATOMIC_RELAXED);
+	stats->throttled_n = __atomic_load_n(&wq->throttled_n, __ATOMIC_RELAXED);
+	stats->rejected_n = __atomic_load_n(&wq->rejected_n, __ATOMIC_RELAXED);
+	stats->expired_n = __atomic_load_n(&wq->expired_n, __ATOMIC_RELAXED);
+	stats->deferred_n = __atomic_load_n(&wq->deferred_n, __ATOMIC_RELAXED);
+#ifdef CD_WQ_LOCK_STATS
+	stats->lock_stats_enabled = 1;
+#endif
+	for (i = 0; !wq->group && i < wq->workers_n; i++) {
+		cd_wq_worker_lock_stats(wq, i, &ls);
+		stats->lock_stats.acquired_n += ls.acquired_n;
+		stats->lock_stats.contended_n += ls.contended_n;
+		stats->lock_stats.wait_ns += ls.wait_ns;
+		stats->lock_stats.signaled_n += ls.signaled_n;
+		stats->lock_stats.parked_n += ls.parked_n;
+		stats->lock_stats.parked_ns += ls.parked_ns;
+	}
+	if (wq->completions) {
+		pthread_mutex_lock(&wq->completions->overflow_lock);
+		stats->completions_overflow_n = wq->completions->overflow_n;
+		pthread_mutex_unlock(&wq->completions->overflow_lock);
+	}
+	return CD_ERR_OK;
+}
+
+struct cd_work* cd_wq_work_init(struct cd_work* work, enum cd_work_sync_async_type type, void *user_data, int user_data_type, void*(*f)(void*), void(*f_dtor)(void*))
+{
+	CD_INIT_LIST_HEAD(&work->link);
+	CD_INIT_HLIST_NODE(&work->coalesce_node);
+	work->coalesce_key = 0;
+	work->not_before = 0;
+	work->deadline = 0;
+	work->seq = 0;
+	work->ret = NULL;
+	work->submit_ns = 0;
+	work->start_ns = 0;
+	work->end_ns = 0;
+	work->flags = 0;
+	work->ordered = NULL;
+	work->ordered_seq = 0;
+	work->wait_group = NULL;
+	work->allocator = &cd_alloc_system;
+	work->type = type;
+	work->user_data = user_data;
+	work->user_data_type = user_data_type;
+	work->f = f;
+	work->f_dtor = f_dtor;
+	return work;
+}
+
+/* @brief   Create work in memory of allocator @a, NULL - default allocator. */
+static struct cd_work* cd_wq_work_alloc(const struct cd_allocator *a, enum cd_work_sync_async_type type, void *user_data, int user_data_type, void*(*f)(void*), void(*f_dtor)(void*))
+{
+	struct cd_work *work;
+
+	a = a ? a : cd_alloc_get_default();
+	work = cd_alloc(a, sizeof(struct cd_work), CD_ALLOC_TAG_WORK);
+	if (work == NULL)
+		return NULL;
+
+	cd_wq_work_init(work, type, user_data, user_data_type, f, f_dtor);
+	work->allocator = a;
+	return work;
+}
+
+static struct cd_work* cd_wq_work_alloc_inline(const struct cd_allocator *a, enum cd_work_sync_async_type type, const void *payload, size_t size, int user_data_type, void*(*f)(void*), void(*f_dtor)(void*))
+{
+	struct cd_work_inline *wi;
+
+	a = a ? a : cd_alloc_get_default();
+	wi = cd_alloc(a, sizeof(struct cd_work_inline) + size, CD_ALLOC_TAG_WORK);
+	if (wi == NULL)
+		return NULL;
+
+	if (size)
+		memcpy(wi->payload, payload, size);
+	cd_wq_work_init(&wi->work, type, wi->payload, user_data_type, f, f_dtor);
+	wi->work.flags = CD_WORK_FLAG_INLINE;
+	wi->work.allocator = a;
+	return &wi->work;
+}
+
+struct cd_work* cd_wq_work_create(enum cd_work_sync_async_type type, void *user_data, int user_data_type, void*(*f)(void*), void(*f_dtor)(void*))
+{
+	return cd_wq_work_alloc(NULL, type, user_data, user_data_type, f, f_dtor);
+}
+
+struct cd_work* cd_wq_work_create_inline(enum cd_work_sync_async_type type, const void *payload, size_t size, int user_data_type, void*(*f)(void*), void(*f_dtor)(void*))
+{
+	return cd_wq_work_alloc_inline(NULL, type, payload, size, user_data_type, f, f_dtor);
+}
+
+void cd_wq_work_set_wait_group(struct cd_work *work, struct cd_wq_wait_group *wg)
+{
+	cd_wq_wait_group_add(wg, 1);
+	work->wait_group = wg;
+}
+
+void cd_wq_work_set_deadline(struct cd_work *work, uint64_t deadline)
+{
+	work->deadline = deadline;
+}
+
+void cd_wq_work_free(struct cd_work **work)
+{
+	if (!work || !*work) {
+		return;
+	}
+
+	if ((*work)->type == CD_WORK_SYNC) {
+		if ((*work)->user_data != NULL && !((*work)->flags & CD_WORK_FLAG_INLINE && (*work)->f_dtor == NULL)) {	/* inline payload needs no destructor */
+			if ((*work)->f_dtor) {
+				CD_LOG_CRIT("Unexpected user data left in SYNC work (destructor should have been already called), calling user's destructor...");
+				(*work)->f_dtor((*work)->user_data);
+				(*work)->f_dtor = NULL;
+				(*work)->user_data = NULL;
+			} else {
+				CD_LOG_ERR("User data left in SYNC work, freeing work without a call to user's destructor, leaving user's data intact...");
+			}
+		}
+	}
+
+	cd_free((*work)->allocator, *work, CD_ALLOC_TAG_WORK);
+	*work = NULL;
+}
+
+enum cd_error cd_wq_queue_work(struct cd_workqueue *wq, struct cd_work* work)
+{
+	struct cd_worker    *w = NULL;
+	uint32_t            idx, active_n, sanity = 0xFF;
+	int                 held = 0;
+	enum cd_error       err = CD_ERR_OK;
+
+	if (!wq || !work) {
+		return CD_ERR_BAD_CALL;
+	}
+
+	if (wq->completions || wq->trace)
+		work->submit_ns = cd_util_now_ns();
+
+	if (!(work->flags & CD_WORK_FLAG_STRAND_RUNNER))									/* strand's jobs fired it when submitted to strand */
+		CD_WQ_PROBE_WORK(work_enqueue, wq, work);
+
+	if (wq->group)
+		return cd_wq_group_queue_work(wq, work);
+
+	if (wq->options.CD_WQ_QUEUE_OPTION_START == CD_WQ_QUEUE_OPTION_START_LAZY && cd_wq_workers_want_more(wq))
+		cd_wq_workers_start(wq, 1);
+
+	active_n = __atomic_load_n(&wq->workers_active_n, __ATOMIC_RELAXED);
+	if (active_n == 0 && !cd_wq_worker_draining_self(wq)) {
+		CD_LOG_CRIT("NO ACTIVE WORKER THREAD in the workqueue [%s]", wq->name);
+		return CD_ERR_WORKQUEUE_ACTIVE;
+	}
+
+	if (__atomic_load_n(&wq->rate_limited, __ATOMIC_ACQUIRE) && !(work->flags & CD_WORK_FLAG_STRAND_RUNNER)) {
+		held = cd_wq_rate_admit(wq, work);
+		if (held < 0)
+			return CD_ERR_BUSY;
+		if (held > 0) {																/* it's the workers' job to pick it up once it conforms */
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (held > 1 && __atomic_load_n(&wq->workers_idle_n, __ATOMIC_SEQ_CST) > 0)
+				cd_wq_worker_wake_idle(wq, NULL);
+			return CD_ERR_OK;
+		}
+	}
 
-			pthread_mutex_lock(&w->mutex);
+	w = cd_wq_current_worker;
+	if (w && w->wq == wq && !(work->flags & CD_WORK_FLAG_SHARED)) {					/* submitted by a job of this workqueue, keep it local */
+		if (w->options.CD_WQ_QUEUE_OPTION_ORDER == CD_WQ_QUEUE_OPTION_ORDER_EDF) {		/* LIFO deque would break the deadline order, use own heap */
+			cd_wq_worker_lock(w);
+			err = cd_wq_worker_enqueue(w, work);
+			cd_wq_worker_unlock(w);
+			return err;
+		}
+		work->worker_idx = w->idx;														/* before push, thief may run it right away */
+		if (cd_wq_deque_push(&w->local, work) == 0) {
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&wq->workers_idle_n, __ATOMIC_SEQ_CST) > 0)
+				cd_wq_worker_wake_idle(wq, w);
+			return CD_ERR_OK;
 		}
+	}
 
-		// do not exit:
-		//	if is still active (regardless of CD_WQ_QUEUE_STOP_ type)
-		//		- if it's empty then sleep, if it's not empty then continue processing work
-		//	if not active but it's CD_WQ_QUEUE_STOP_SOFT and queue is not empty (continue to do work)
-		//
-		// Therefore to exit queue processing:
-		// if it's CD_WQ_QUEUE_STOP_HARD - set active to 0 (terminate processing, ignoring waiting work if any)
-		// if it's CD_WQ_QUEUE_STOP_SOFT - set active to 0 and wait till all work has been processed
+	if (active_n == 0) {															/* job of draining worker, the worker processes it before it exits */
+		w = cd_wq_current_worker;
+	} else if (active_n > 1) {														/* get next worker, from this producer's own cursor */
+		idx = cd_wq_producer_next(wq);
+		do {
+			w = &wq->workers[idx];
+			idx = (idx + 1) % wq->workers_n;
+		} while (w->active == 0 && (--sanity));
+	} else {																		/* there is only one active thread in the workers table */
+		w = &wq->workers[wq->first_active_worker_idx];
+	}
 
-		if (!w->active) {
+	cd_wq_worker_lock(w);													/* enqueue work (and move ownership to worker), this saves the worker's index into work */
+	err = cd_wq_worker_enqueue(w, work);
+	if (err == CD_ERR_OK)
+		cd_wq_worker_signal(w);
+	cd_wq_worker_unlock(w);
 
-			if ((w->options.CD_WQ_QUEUE_OPTION_STOP == CD_WQ_QUEUE_OPTION_STOP_HARD) || 
-					((w->options.CD_WQ_QUEUE_OPTION_STOP == CD_WQ_QUEUE_OPTION_STOP_SOFT) && cd_fifo_empty(q))) {
-				goto exit;
-			}
+	return err;
+}
 
-		} else {
+enum cd_error cd_wq_queue_work_coalesce(struct cd_workqueue *wq, struct cd_work* work, uint64_t key, void(*f_merge)(void *pending_user_data, void *user_data))
+{
+	struct cd_hlist_head	*bucket;
+	struct cd_work			*pending;
+	pthread_mutex_t			*lock;
+	enum cd_error			err;
+
+	if (!wq || !work) {
+		return CD_ERR_BAD_CALL;
+	}
 
-			if (cd_fifo_empty(q))
-				pthread_cond_wait(&w->signal, &w->mutex);
+	lock = cd_wq_coalesce_lock(wq, key, &bucket);
+	pthread_mutex_lock(lock);
+
+	cd_hlist_for_each_entry(pending, bucket, coalesce_node) {
+		if (pending->coalesce_key == key) {											/* pending work can't start while we hold the lock */
+			if (f_merge)
+				f_merge(pending->user_data, work->user_data);
+			pthread_mutex_unlock(lock);
+			__atomic_add_fetch(&wq->coalesced_n, 1, __ATOMIC_RELAXED);
+			cd_wq_call_dctor(wq, work, CD_WORK_SYNC);
+			cd_wq_work_done(&work);
+			return CD_ERR_OK;
 		}
 	}
 
-exit:
-	pthread_mutex_unlock(&w->mutex);
-	return NULL;
+	work->coalesce_key = key;
+	cd_hlist_add_head(&work->coalesce_node, bucket);
+	err = cd_wq_queue_work(wq, work);												/* enqueue under the lock, so work is never indexed but not queued */
+	if (err != CD_ERR_OK)
+		cd_hash_del(&work->coalesce_node);
+	pthread_mutex_unlock(lock);
+
+	return err;
 }
 
-static void cd_wq_worker_init(struct cd_worker *w, struct cd_workqueue *wq)
+/* @brief   Skip holes once they time out, so results behind them don't wait for more traffic. */
+static void* cd_wq_ordered_watch_f(void *arg)
 {
-	memset(w, 0, sizeof(struct cd_worker));
-	pthread_mutex_init(&w->mutex, NULL);
-	w->active = 0;
-	w->wq = wq;
-	w->options = wq->options;
-	CD_INIT_LIST_HEAD(&w->queue);
-	pthread_cond_init(&w->signal, NULL);
+	struct cd_wq_ordered	*o = (struct cd_wq_ordered*) arg;
+	struct timespec			ts;
+	uint64_t				since;
+
+	pthread_mutex_lock(&o->watch_lock);
+	while (o->watch_running) {
+		__atomic_store_n(&o->watch_idle, 1, __ATOMIC_SEQ_CST);						/* before the check, see cd_wq_ordered_hole_start() */
+		since = __atomic_load_n(&o->hole_since, __ATOMIC_SEQ_CST);
+		if (since == 0) {
+			pthread_cond_wait(&o->watch_signal, &o->watch_lock);
+			__atomic_store_n(&o->watch_idle, 0, __ATOMIC_SEQ_CST);
+			continue;
+		}
+		__atomic_store_n(&o->watch_idle, 0, __ATOMIC_SEQ_CST);
+		if (cd_util_now_ns() < since + o->hole_timeout_ns) {
+			cd_util_ns_to_timespec(since + o->hole_timeout_ns, &ts);
+			pthread_cond_timedwait(&o->watch_signal, &o->watch_lock, &ts);
+			continue;
+		}
+		pthread_mutex_unlock(&o->watch_lock);
+		cd_wq_ordered_emit(o);
+		if (__atomic_load_n(&o->hole_since, __ATOMIC_SEQ_CST) == since)
+			sched_yield();																/* emitter role was taken, its holder may be slow */
+		pthread_mutex_lock(&o->watch_lock);
+	}
+	pthread_mutex_unlock(&o->watch_lock);
+	return NULL;
 }
 
-static enum cd_error cd_wq_worker_deinit(struct cd_worker *w)
+struct cd_wq_ordered* cd_wq_ordered_create(struct cd_workqueue *wq, uint32_t window, uint64_t hole_timeout_ns, void (*f_emit)(void *user_data, void *ret))
 {
-	struct cd_list_head *it = NULL, *n = NULL;
+	struct cd_wq_ordered	*o;
+	pthread_condattr_t		attr;
+	uint64_t				n = 1, i;
 
-	if (w->options.CD_WQ_QUEUE_OPTION_STOP == CD_WQ_QUEUE_OPTION_STOP_SOFT) {
-		assert(cd_list_empty(&w->queue) != 0 && "Queue NOT EMPTY! Worker terminating processing of not empty queue...\n");
+	if (!wq || !f_emit || window == 0)
+		return NULL;
+
+	while (n < window)
+		n <<= 1;
+
+	o = cd_alloc(wq->allocator, sizeof(struct cd_wq_ordered), CD_ALLOC_TAG_QUEUE);
+	if (o == NULL)
+		return NULL;
+	memset(o, 0, sizeof(struct cd_wq_ordered));
+	o->allocator = wq->allocator;
+
+	o->slots = cd_alloc(o->allocator, n * sizeof(struct cd_wq_ordered_slot), CD_ALLOC_TAG_QUEUE);
+	if (o->slots == NULL) {
+		cd_free(o->allocator, o, CD_ALLOC_TAG_QUEUE);
+		return NULL;
+	}
+	for (i = 0; i < n; i++) {
+		o->slots[i].state = (i << 2) | CD_WQ_ORDERED_FREE;
+		o->slots[i].work = NULL;
 	}
 
-	if (!cd_list_empty(&w->queue)) {
-		CD_LOG_CRIT("Warning, worker [%u] terminating processing of not empty queue...", w->idx);
+	o->wq = wq;
+	o->f_emit = f_emit;
+	o->hole_timeout_ns = hole_timeout_ns;
+	o->size = n;
+	o->mask = n - 1;
+
+	if (hole_timeout_ns) {
+		pthread_mutex_init(&o->watch_lock, NULL);
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&o->watch_signal, &attr);
+		pthread_condattr_destroy(&attr);
+		o->watch_running = 1;
+		if (cd_launch_thread(&o->watch_tid, cd_wq_ordered_watch_f, o, PTHREAD_CREATE_JOINABLE) != CD_ERR_OK) {
+			pthread_mutex_destroy(&o->watch_lock);
+			pthread_cond_destroy(&o->watch_signal);
+			cd_free(o->allocator, o->slots, CD_ALLOC_TAG_QUEUE);
+			cd_free(o->allocator, o, CD_ALLOC_TAG_QUEUE);
+			return NULL;
+		}
 	}
+	return o;
+}
 
-	cd_list_for_each_safe(it, n, &w->queue)
-	{
-		struct cd_work *work = cd_container_of(it, struct cd_work, link);
-		cd_list_del_init(it);
+enum cd_error cd_wq_ordered_free(struct cd_wq_ordered **o)
+{
+	uint64_t i;
 
-		// Execute sync destructors.
-		// This will call user's destructor for the task which has not been processed.
-		cd_wq_call_dctor(work, CD_WORK_SYNC);
+	if (!o || !(*o))
+		return CD_ERR_OK;
 
-		cd_wq_work_free(&work);
+	if (__atomic_load_n(&(*o)->emit_seq, __ATOMIC_ACQUIRE) != __atomic_load_n(&(*o)->next_seq, __ATOMIC_ACQUIRE))
+		return CD_ERR_BUSY;
+	for (i = 0; i < (*o)->size; i++) {													/* late works of skipped holes still refer to it */
+		if (__atomic_load_n(&(*o)->slots[i].state, __ATOMIC_ACQUIRE) & CD_WQ_ORDERED_SKIPPED)
+			return CD_ERR_BUSY;
 	}
 
-	assert(cd_list_empty(&w->queue));
-
-	pthread_mutex_destroy(&w->mutex);
-	pthread_cond_destroy(&w->signal);
+	if ((*o)->watch_running) {
+		pthread_mutex_lock(&(*o)->watch_lock);
+		(*o)->watch_running = 0;
+		pthread_cond_signal(&(*o)->watch_signal);
+		pthread_mutex_unlock(&(*o)->watch_lock);
+		pthread_join((*o)->watch_tid, NULL);
+		pthread_mutex_destroy(&(*o)->watch_lock);
+		pthread_cond_destroy(&(*o)->watch_signal);
+	}
 
+	cd_free((*o)->allocator, (*o)->slots, CD_ALLOC_TAG_QUEUE);
+	cd_free((*o)->allocator, *o, CD_ALLOC_TAG_QUEUE);
+	*o = NULL;
 	return CD_ERR_OK;
 }
 
-enum cd_error cd_wq_workqueue_init(struct cd_workqueue *wq, uint32_t workers_n, const char *name, uint8_t option_stop)
+enum cd_error cd_wq_ordered_queue_work(struct cd_wq_ordered *o, struct cd_work *work)
 {
-	struct cd_worker    *w = NULL;
+	uint64_t		seq;
+	int				retried = 0;
+	enum cd_error	err;
 
-	memset(wq, 0, sizeof(struct cd_workqueue));
-	wq->workers = malloc(workers_n * sizeof(struct cd_worker));
-	if (wq->workers == NULL) {
-		return CD_ERR_MEM;
+	if (!o || !work) {
+		return CD_ERR_BAD_CALL;
 	}
-	wq->workers_n = workers_n;
 
-	wq->options.CD_WQ_QUEUE_OPTION_STOP = option_stop;
-
-	if (workers_n > 0) {
-		wq->workers_active_n = 0;
-		while (workers_n) {
-			--workers_n;
-			w = &wq->workers[workers_n];
-			cd_wq_worker_init(w, wq);
-			w->idx = workers_n;
-			w->active = 1;
-			if (cd_launch_thread(&w->tid, cd_wq_worker_f, w, PTHREAD_CREATE_JOINABLE) == CD_ERR_OK) {
-				wq->workers_active_n++;																	/* increase the number of running workers */
-				if (wq->first_active_worker_idx == 0)
-					wq->first_active_worker_idx = w->idx;
-			} else {
-				w->active = 0;
-			}
+	seq = __atomic_load_n(&o->next_seq, __ATOMIC_RELAXED);
+	while (1) {
+		if (__atomic_load_n(&o->slots[seq & o->mask].state, __ATOMIC_ACQUIRE) != ((seq << 2) | CD_WQ_ORDERED_FREE)) {
+			if (retried || o->hole_timeout_ns == 0)
+				return CD_ERR_FULL;														/* window is full */
+			cd_wq_ordered_emit(o);														/* give timed out hole a chance to be skipped */
+			retried = 1;
+			seq = __atomic_load_n(&o->next_seq, __ATOMIC_RELAXED);
+			continue;
 		}
+		if (__atomic_compare_exchange_n(&o->next_seq, &seq, seq + 1, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			break;
 	}
 
-	wq->name = strdup(name);
-	wq->running = 1;
+	if (seq == __atomic_load_n(&o->emit_seq, __ATOMIC_SEQ_CST))						/* nothing before it, its hole starts now */
+		cd_wq_ordered_hole_start(o);
 
-	wq->next_worker_idx_to_use = wq->first_active_worker_idx;
-	if (wq->workers_active_n > 0) {																		/* if we have at least one worker thread then queue creation was successful */
-		return CD_ERR_OK;
-	} else {
-		return CD_ERR_WORKQUEUE_CREATE;
+	work->ordered = o;
+	work->ordered_seq = seq;
+
+	err = cd_wq_queue_work(o->wq, work);
+	if (err != CD_ERR_OK) {																/* work stays with the caller, don't hold the order on it */
+		work->ordered = NULL;
+		cd_wq_ordered_complete(o, seq, NULL);
 	}
+	return err;
 }
 
-enum cd_error cd_wq_workqueue_default_init(struct cd_workqueue *wq, uint32_t workers_n, const char *name)
+enum cd_error cd_wq_ordered_queue_user(struct cd_wq_ordered *o, enum cd_work_sync_async_type type, void *user_data, int user_data_type, void*(*f)(void*), void(*f_dtor)(void*))
 {
-	return cd_wq_workqueue_init(wq, workers_n, name, CD_WQ_QUEUE_OPTION_STOP_SOFT);
+	enum cd_error err;
+	struct cd_work *work;
+
+	if (!o) {
+		return CD_ERR_BAD_CALL;
+	}
+
+	work = cd_wq_work_alloc(o->allocator, type, user_data, user_data_type, f, f_dtor);
+	if (!work) {
+		return CD_ERR_WORK_CREATE;
+	}
+
+	err = cd_wq_ordered_queue_work(o, work);
+	if (err != CD_ERR_OK)
+		cd_free(work->allocator, work, CD_ALLOC_TAG_WORK);
+	return err;
 }
 
-enum cd_error cd_wq_workqueue_deinit(struct cd_workqueue *wq)
+enum cd_error cd_wq_strand_init(struct cd_wq_strand *s, struct cd_workqueue *wq)
 {
-	struct cd_worker    *w = NULL;
-	uint32_t            workers_n = wq->workers_n;
+	if (!s || !wq)
+		return CD_ERR_BAD_CALL;
 
-	free((void*)wq->name);
-	while (workers_n) {
-		--workers_n;
-		w = &wq->workers[workers_n];
-		if (cd_wq_worker_deinit(w) != CD_ERR_OK) {
-			return CD_ERR_FAIL;
-		}
-	}
-	free(wq->workers);
+	s->wq = wq;
+	s->inbox = NULL;
+	CD_INIT_LIST_HEAD(&s->run);
+	s->pending_n = 0;
+	cd_wq_work_init(&s->runner, CD_WORK_ASYNC, s, 0, cd_wq_strand_run_f, NULL);
+	s->runner.flags = CD_WORK_FLAG_STRAND_RUNNER;
+	s->allocator = wq->allocator;
 	return CD_ERR_OK;
 }
 
-enum cd_error cd_wq_workqueue_free(struct cd_workqueue **wq)
+struct cd_wq_strand* cd_wq_strand_create(struct cd_workqueue *wq)
 {
-	enum cd_error err = CD_ERR_OK;
+	struct cd_wq_strand *s;
 
-	if (!wq || !(*wq))
-		return CD_ERR_OK;
+	if (!wq)
+		return NULL;
 
-	err = cd_wq_workqueue_deinit(*wq);
-	if (err != CD_ERR_OK)
-		return err;
+	s = cd_alloc(wq->allocator, sizeof(struct cd_wq_strand), CD_ALLOC_TAG_QUEUE);
+	if (s == NULL)
+		return NULL;
 
-	free(*wq);
-	*wq = NULL;
+	cd_wq_strand_init(s, wq);
+	return s;
+}
+
+enum cd_error cd_wq_strand_free(struct cd_wq_strand **s)
+{
+	if (!s || !(*s))
+		return CD_ERR_OK;
 
+	if (__atomic_load_n(&(*s)->pending_n, __ATOMIC_SEQ_CST) != 0)
+		return CD_ERR_BUSY;
+
+	cd_free((*s)->allocator, *s, CD_ALLOC_TAG_QUEUE);
+	*s = NULL;
 	return CD_ERR_OK;
 }
 
-struct cd_workqueue* cd_wq_workqueue_create(uint32_t workers_n, const char *name, uint8_t option_stop)
+enum cd_error cd_wq_strand_queue_work(struct cd_wq_strand *s, struct cd_work *work)
 {
-	enum cd_error   err = CD_ERR_OK;
-	struct cd_workqueue *wq;
-	wq = malloc(sizeof(struct cd_workqueue));
-	if (wq == NULL) {
-		return NULL;
-	}
-	memset(wq, 0, sizeof(struct cd_workqueue));
+	struct cd_work *head;
 
-	err = cd_wq_workqueue_init(wq, workers_n, name, option_stop);
-	if (err  != CD_ERR_OK) {
-		switch (err) {
+	if (!s || !work) {
+		return CD_ERR_BAD_CALL;
+	}
 
-			case CD_ERR_MEM:
-				free(wq);
-				return NULL;
+	if (s->wq->completions || s->wq->trace)
+		work->submit_ns = cd_util_now_ns();
 
-			case CD_ERR_WORKQUEUE_CREATE:
-				cd_wq_workqueue_free(&wq);
-				return NULL;
+	CD_WQ_PROBE_WORK(work_enqueue, s->wq, work);
+	head = __atomic_load_n(&s->inbox, __ATOMIC_RELAXED);
+	do {
+		work->link.next = (struct cd_list_head*) head;
+	} while (!__atomic_compare_exchange_n(&s->inbox, &head, work, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
 
-			default:
-				break;
+	if (__atomic_fetch_add(&s->pending_n, 1, __ATOMIC_SEQ_CST) == 0) {				/* strand was idle, we own the runner now */
+		s->runner.flags &= ~CD_WORK_FLAG_SHARED;										/* first batch may run locally */
+		if (cd_wq_queue_work(s->wq, &s->runner) != CD_ERR_OK) {
+			cd_wq_strand_cancel(s);
+			return CD_ERR_WORKQUEUE_ACTIVE;
 		}
 	}
-	return wq;
+	return CD_ERR_OK;
 }
 
-struct cd_workqueue* cd_wq_workqueue_default_create(uint32_t workers_n, const char *name)
+enum cd_error cd_wq_strand_queue_user(struct cd_wq_strand *s, enum cd_work_sync_async_type type, void *user_data, int user_data_type, void*(*f)(void*), void(*f_dtor)(void*))
 {
-	return cd_wq_workqueue_create(workers_n, name, CD_WQ_QUEUE_OPTION_STOP_SOFT);
+	struct cd_work *work;
+
+	if (!s) {
+		return CD_ERR_BAD_CALL;
+	}
+
+	work = cd_wq_work_alloc(s->allocator, type, user_data, user_data_type, f, f_dtor);
+	if (!work) {
+		return CD_ERR_WORK_CREATE;
+	}
+
+	return cd_wq_strand_queue_work(s, work);
 }
 
-enum cd_error cd_wq_workqueue_stop(struct cd_workqueue *wq)
+enum cd_error cd_wq_spawn(struct cd_workqueue *wq, struct cd_wq_wait_group *wg, struct cd_work *work)
 {
-	struct cd_worker    *w = NULL;
-	uint8_t             workers_n = 0;
-	enum cd_error       err = CD_ERR_OK;
+	enum cd_error err;
 
-	workers_n = wq->workers_n;
-	if ((workers_n > 0) && (wq->workers_active_n > 0)) {
-		while (workers_n) {
-			--workers_n;
-			w = &wq->workers[workers_n];
-			pthread_mutex_lock(&w->mutex);                                      /* lock worker thread */
-			if (w->active == 1) {
-				w->active = 0;                                                  /* tell the worker to stop */
-				pthread_cond_signal(&w->signal);                                /* signal the worker */
-				pthread_mutex_unlock(&w->mutex);                                /* let worker exit */
-				wq->workers_active_n--;                                         /* decrease the number of active/running workers */
-				if (pthread_join(w->tid, NULL) != CD_ERR_OK) {                  /* join worker thread */
-					err = CD_ERR_FAIL;
-				}
-			} else {
-				pthread_mutex_unlock(&w->mutex);
-			}
-		}
+	if (!wq || !wg || !work) {
+		return CD_ERR_BAD_CALL;
+	}
+
+	cd_wq_work_set_wait_group(work, wg);
+	err = cd_wq_queue_work(wq, work);
+	if (err != CD_ERR_OK) {
+		work->wait_group = NULL;
+		cd_wq_wait_group_done(wg);
 	}
 	return err;
 }
 
-struct cd_work* cd_wq_work_init(struct cd_work* work, enum cd_work_sync_async_type type, void *user_data, int user_data_type, void*(*f)(void*), void(*f_dtor)(void*))
+enum cd_error cd_wq_spawn_user(struct cd_workqueue *wq, struct cd_wq_wait_group *wg, enum cd_work_sync_async_type type, void *user_data, int user_data_type, void*(*f)(void*), void(*f_dtor)(void*))
 {
-	CD_INIT_LIST_HEAD(&work->link);
-	work->type = type;
-	work->user_data = user_data;
-	work->user_data_type = user_data_type;
-	work->f = f;
-	work->f_dtor = f_dtor;
-	return work;
-}
+	enum cd_error err;
+	struct cd_work *work;
 
-struct cd_work* cd_wq_work_create(enum cd_work_sync_async_type type, void *user_data, int user_data_type, void*(*f)(void*), void(*f_dtor)(void*))
-{
-	struct cd_work* work = malloc(sizeof(struct cd_work));
-	if (work == NULL)
-		return NULL;
+	if (!wq) {
+		return CD_ERR_BAD_CALL;
+	}
+
+	work = cd_wq_work_alloc(wq->allocator, type, user_data, user_data_type, f, f_dtor);
+	if (!work) {
+		return CD_ERR_WORK_CREATE;
+	}
 
-	return cd_wq_work_init(work, type, user_data, user_data_type, f, f_dtor);
+	err = cd_wq_spawn(wq, wg, work);
+	if (err != CD_ERR_OK)
+		cd_free(work->allocator, work, CD_ALLOC_TAG_WORK);
+	return err;
 }
 
-void cd_wq_work_free(struct cd_work **work)
+/* @brief   cd_wq_sync() called from a job on a thread of group @g: help by running group's queued work,
+ *          in the same order group's threads take it, children of the waiting job among it. */
+static enum cd_error cd_wq_group_sync(struct cd_wq_group *g, struct cd_wq_wait_group *wg)
 {
-	if (!work || !*work) {
-		return;
-	}
+	struct cd_workqueue	*wq;
+	struct cd_work		*work;
 
-	if ((*work)->type == CD_WORK_SYNC) {
-		if ((*work)->user_data != NULL) {
-			if ((*work)->f_dtor) {
-				CD_LOG_CRIT("Unexpected user data left in SYNC work (destructor should have been already called), calling user's destructor...");
-				(*work)->f_dtor((*work)->user_data);
-				(*work)->f_dtor = NULL;
-				(*work)->user_data = NULL;
-			} else {
-				CD_LOG_ERR("User data left in SYNC work, freeing work without a call to user's destructor, leaving user's data intact...");
-			}
+	while ((__atomic_load_n(&wg->n, __ATOMIC_SEQ_CST) & ~CD_WQ_WAIT_GROUP_WAITERS) != 0) {
+		pthread_mutex_lock(&g->mutex);
+		work = cd_wq_group_next(g, &wq);
+		pthread_mutex_unlock(&g->mutex);
+
+		if (work == NULL) {
+			cd_wq_wait_group_wait(wg, CD_WQ_SYNC_WAIT_NS);								/* children are running on other threads */
+			continue;
 		}
-	}
 
-	free(*work);
-	*work = NULL;
+		CD_WQ_PROBE_WORK(work_dequeue, wq, work);
+		cd_wq_work_execute(wq, work);
+
+		pthread_mutex_lock(&g->mutex);
+		cd_wq_group_work_done(g, wq);
+		pthread_mutex_unlock(&g->mutex);
+	}
+	return CD_ERR_OK;
 }
 
-enum cd_error cd_wq_queue_work(struct cd_workqueue *wq, struct cd_work* work)
+enum cd_error cd_wq_sync(struct cd_workqueue *wq, struct cd_wq_wait_group *wg)
 {
-	struct cd_worker    *w = NULL;
-	uint8_t             idx = wq->next_worker_idx_to_use, sanity = 0xFF;
+	struct cd_worker	*w = cd_wq_current_worker;
+	struct cd_work		*work;
 
-	if (!wq || !work) {
+	if (!wq || !wg) {
 		return CD_ERR_BAD_CALL;
 	}
 
-	if (wq->workers_active_n == 0) {
-		CD_LOG_CRIT("NO ACTIVE WORKER THREAD in the workqueue [%s]", wq->name);
-		return CD_ERR_WORKQUEUE_ACTIVE;
-	}
-
-	if (wq->workers_active_n > 1) {													/* get next worker */
-		do {
-			w = &wq->workers[idx];
-			idx = (idx + 1) % wq->workers_n;
-		} while (w->active == 0 && (--sanity));
-	} else {																		/* there is only one active thread in the workers table */
-		w = &wq->workers[wq->first_active_worker_idx];
-	}
+	if (wq->group && wq->group == cd_wq_current_group)
+		return cd_wq_group_sync(wq->group, wg);
 
-	work->worker_idx = w->idx;														/* save the worker's index into work */
-	wq->next_worker_idx_to_use = idx;												/* save next worker's index into workqueue */
+	if (w == NULL || w->wq != wq)
+		return cd_wq_wait_group_wait(wg, 0);
 
-	pthread_mutex_lock(&w->mutex);													/* enqueue work (and move ownership to worker) */
-	cd_fifo_enqueue(&work->link, &w->queue);
-	pthread_cond_signal(&w->signal);
-	pthread_mutex_unlock(&w->mutex);
+	// Blocking here would hold the worker (and with all workers syncing, deadlock),
+	// so help: children spawned by this job sit on top of own deque, run them first.
+	while ((__atomic_load_n(&wg->n, __ATOMIC_SEQ_CST) & ~CD_WQ_WAIT_GROUP_WAITERS) != 0) {
+		work = cd_wq_deque_pop(&w->local);
+		if (work == NULL) {
+			cd_wq_worker_lock(w);
+			work = cd_wq_worker_dequeue(w);
+			cd_wq_worker_unlock(w);
+		}
+		if (work == NULL)
+			work = cd_wq_worker_steal(w);
 
+		if (work) {
+			CD_WQ_PROBE_WORK(work_dequeue, wq, work);
+			cd_wq_work_execute(wq, work);
+		} else {
+			cd_wq_wait_group_wait(wg, CD_WQ_SYNC_WAIT_NS);								/* children are running on other workers */
+		}
+	}
 	return CD_ERR_OK;
 }
 
@@ -356,7 +3058,13 @@ void cd_wq_queue_delayed_work(struct cd_workqueue *q, struct cd_work* work, unsi
 
 enum cd_error cd_wq_queue_user(struct cd_workqueue *wq, enum cd_work_sync_async_type type, void *user_data, int user_data_type, void*(*f)(void*), void(*f_dtor)(void*))
 {
-	struct cd_work *work = cd_wq_work_create(type, user_data, user_data_type, f, f_dtor);
+	struct cd_work *work;
+
+	if (!wq) {
+		return CD_ERR_BAD_CALL;
+	}
+
+	work = cd_wq_work_alloc(wq->allocator, type, user_data, user_data_type, f, f_dtor);
 	if (!work) {
 		return CD_ERR_WORK_CREATE;
 	}
@@ -364,10 +3072,38 @@ enum cd_error cd_wq_queue_user(struct cd_workqueue *wq, enum cd_work_sync_async_
 	return cd_wq_queue_work(wq, work);
 }
 
+enum cd_error cd_wq_queue_user_inline(struct cd_workqueue *wq, enum cd_work_sync_async_type type, const void *payload, size_t size, int user_data_type, void*(*f)(void*), void(*f_dtor)(void*))
+{
+	enum cd_error err;
+	struct cd_work *work;
+
+	if (!wq) {
+		return CD_ERR_BAD_CALL;
+	}
+
+	work = cd_wq_work_alloc_inline(wq->allocator, type, payload, size, user_data_type, f, f_dtor);
+	if (!work) {
+		return CD_ERR_WORK_CREATE;
+	}
+
+	err = cd_wq_queue_work(wq, work);
+	if (err != CD_ERR_OK) {
+		work->f_dtor = NULL;															/* not processed, payload's references stay with the caller */
+		cd_wq_work_free(&work);
+	}
+	return err;
+}
+
 enum cd_error cd_launch_thread(pthread_t *t, void*(*f)(void*), void *arg, int detachstate)
+{
+	return cd_launch_thread_attr(t, f, arg, detachstate, NULL);
+}
+
+enum cd_error cd_launch_thread_attr(pthread_t *t, void*(*f)(void*), void *arg, int detachstate, const struct cd_wq_worker_attr *a)
 {
 	int                 err;
 	pthread_attr_t      attr;
+	struct sched_param  param;
 
 	err = pthread_attr_init(&attr);
 	if (err != 0)
@@ -377,9 +3113,42 @@ enum cd_error cd_launch_thread(pthread_t *t, void*(*f)(void*), void *arg, int de
 	if (err != 0)
 		goto fail;
 
+	if (a) {
+		if (a->stack_size) {
+			err = pthread_attr_setstacksize(&attr, a->stack_size);
+			if (err != 0)
+				goto fail;
+		}
+		if (a->guard_size) {
+			err = pthread_attr_setguardsize(&attr, a->guard_size);
+			if (err != 0)
+				goto fail;
+		}
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = a->sched_priority;
+		if (a->sched_policy == SCHED_FIFO || a->sched_policy == SCHED_RR) {			/* otherwise thread would inherit creator's scheduling */
+			err = pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+			if (err == 0)
+				err = pthread_attr_setschedpolicy(&attr, a->sched_policy);
+			if (err == 0)
+				err = pthread_attr_setschedparam(&attr, &param);
+			if (err != 0)
+				goto fail;
+		}
+	}
+
 	err = pthread_create(t, &attr, f, arg);
-	if (err != 0)
+	if (err != 0) {
+		if (err == EPERM)
+			CD_LOG_CRIT("Not permitted to create thread with scheduling policy [%d], priority [%d]", a ? a->sched_policy : 0, a ? a->sched_priority : 0);
 		goto fail;
+	}
+
+	if (a && a->sched_policy != SCHED_OTHER && a->sched_policy != SCHED_FIFO && a->sched_policy != SCHED_RR) {	/* pthread attr takes only these, set the others on the thread */
+		err = pthread_setschedparam(*t, a->sched_policy, &param);
+		if (err != 0)
+			CD_LOG_CRIT("Can't set scheduling policy [%d] of the thread: %s", a->sched_policy, strerror(err));
+	}
 
 	pthread_attr_destroy(&attr);
 
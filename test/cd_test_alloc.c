@@ -0,0 +1,228 @@
+/**
+ * cd_test_alloc.c - Unit tests for cd_alloc
+ *
+ * Part of the libcd - bringing you support for C programs with queue processors, from Data And Signal's Piotr Gregor
+ *
+ * Data And Signal - IT Solutions
+ * http://www.dataandsignal.com
+ * 2020
+ *
+ */
+
+#include "../include/cd_wq.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <string.h>
+
+
+#define TEST_ALLOC_WORKS_N 200
+
+static void* test_alloc_f(void *arg)
+{
+	char *p = cd_wq_arena_alloc(256);
+
+	assert(p != NULL);
+	memset(p, 0, 256);
+	(void) arg;
+	return NULL;
+}
+
+static void test_alloc_system(void)
+{
+	char	*p, *s;
+	void	*v;
+
+	printf("TEST ALLOC SYSTEM\n");
+
+	assert(cd_alloc_get_default() == &cd_alloc_system);
+	p = cd_alloc(NULL, 100, CD_ALLOC_TAG_QUEUE);
+	assert(p != NULL && ((uintptr_t) p % _Alignof(max_align_t)) == 0);
+	v = cd_alloc_aligned(&cd_alloc_system, 100, 256, CD_ALLOC_TAG_SCRATCH);
+	assert(v != NULL && ((uintptr_t) v % 256) == 0);
+	s = cd_alloc_strdup(NULL, "libcd", CD_ALLOC_TAG_WORKQUEUE);
+	assert(s != NULL && strcmp(s, "libcd") == 0);
+
+	cd_free(NULL, p, CD_ALLOC_TAG_QUEUE);
+	cd_free(&cd_alloc_system, v, CD_ALLOC_TAG_SCRATCH);
+	cd_free(NULL, s, CD_ALLOC_TAG_WORKQUEUE);
+	cd_free(NULL, NULL, CD_ALLOC_TAG_QUEUE);
+}
+
+static void test_alloc_debug_counts(void)
+{
+	struct cd_alloc_debug	d;
+	void					*p, *v;
+
+	printf("TEST ALLOC DEBUG COUNTS\n");
+
+	cd_alloc_debug_init(&d, NULL);
+	p = cd_alloc(&d.allocator, 100, CD_ALLOC_TAG_QUEUE);
+	v = cd_alloc_aligned(&d.allocator, 1000, 128, CD_ALLOC_TAG_SCRATCH);
+	assert(p != NULL && v != NULL && ((uintptr_t) v % 128) == 0);
+	assert(d.tags[CD_ALLOC_TAG_QUEUE].bytes == 100 && d.tags[CD_ALLOC_TAG_QUEUE].allocs_n == 1);
+	assert(d.tags[CD_ALLOC_TAG_SCRATCH].bytes == 1000);
+	assert(cd_alloc_debug_outstanding(&d) == 2);
+
+	cd_free(&d.allocator, v, CD_ALLOC_TAG_SCRATCH);
+	assert(d.tags[CD_ALLOC_TAG_SCRATCH].bytes == 0 && d.tags[CD_ALLOC_TAG_SCRATCH].bytes_peak == 1000);
+	cd_free(&d.allocator, p, CD_ALLOC_TAG_QUEUE);
+	assert(cd_alloc_debug_outstanding(&d) == 0);
+}
+
+static void test_alloc_workqueue(void)
+{
+	struct cd_alloc_debug		d;
+	struct cd_workqueue			*wq = NULL;
+	struct cd_wq_queue_options	options = { 0 };
+	struct cd_wq_strand			*s;
+	struct cd_wq_ordered		*o;
+	struct cd_wq_accumulator	*acc;
+	struct cd_wq_wait_group		wg = CD_WQ_WAIT_GROUP_INITIALIZER;
+	struct cd_wq_completion		c[16];
+	uint64_t					x = 7;
+	uint32_t					i;
+
+	printf("TEST ALLOC WORKQUEUE\n");
+
+	cd_alloc_debug_init(&d, NULL);
+	options.CD_WQ_QUEUE_OPTION_STOP = CD_WQ_QUEUE_OPTION_STOP_SOFT;
+	options.CD_WQ_QUEUE_OPTION_ORDER = CD_WQ_QUEUE_OPTION_ORDER_EDF;				/* worker heaps */
+	options.allocator = &d.allocator;
+	wq = cd_wq_workqueue_create_options(2, "Workqueue Test Alloc", &options);
+	assert(wq != NULL);
+	assert(d.tags[CD_ALLOC_TAG_WORKQUEUE].allocs_n >= 3);							/* workqueue, workers, name */
+	assert(CD_ERR_OK == cd_wq_workqueue_enable_completions(wq, 4, 0));
+
+	s = cd_wq_strand_create(wq);
+	o = cd_wq_ordered_create(wq, 8, 0, NULL);
+	assert(o == NULL);																/* needs f_emit, nothing leaks */
+	acc = cd_wq_accumulator_create(wq, CD_WQ_REDUCE_SUM, NULL, 0);
+	assert(s != NULL && acc != NULL);
+
+	for (i = 0; i < TEST_ALLOC_WORKS_N; i++) {
+		assert(CD_ERR_OK == cd_wq_queue_user(wq, CD_WORK_ASYNC, NULL, 0, test_alloc_f, NULL));
+		assert(CD_ERR_OK == cd_wq_queue_user_inline(wq, CD_WORK_ASYNC, &x, sizeof(x), 0, test_alloc_f, NULL));
+		assert(CD_ERR_OK == cd_wq_strand_queue_user(s, CD_WORK_ASYNC, NULL, 0, test_alloc_f, NULL));
+		assert(CD_ERR_OK == cd_wq_spawn_user(wq, &wg, CD_WORK_ASYNC, NULL, 0, test_alloc_f, NULL));
+		while (cd_wq_reap_completions(wq, c, 16) > 0)
+			;
+	}
+	assert(CD_ERR_OK == cd_wq_sync(wq, &wg));
+	assert(d.tags[CD_ALLOC_TAG_WORK].allocs_n == 4 * TEST_ALLOC_WORKS_N);
+	assert(d.tags[CD_ALLOC_TAG_QUEUE].allocs_n > 0);
+	assert(d.tags[CD_ALLOC_TAG_SCRATCH].allocs_n > 0);								/* arenas, accumulator */
+
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(wq));
+	while (cd_wq_reap_completions(wq, c, 16) > 0)
+		;
+	assert(CD_ERR_OK == cd_wq_strand_free(&s));
+	cd_wq_workqueue_free(&wq);
+	cd_wq_accumulator_free(&acc);													/* may outlive the workqueue */
+
+	cd_alloc_debug_print(&d, stdout);
+	for (i = 0; i < CD_ALLOC_TAG_N; i++)
+		assert(d.tags[i].bytes == 0 && d.tags[i].allocs_n == d.tags[i].frees_n);
+	assert(d.tags[CD_ALLOC_TAG_WORK].bytes_peak > 0);
+}
+
+static void test_alloc_default(void)
+{
+	struct cd_alloc_debug	d;
+	struct cd_workqueue		*wq = NULL;
+	struct cd_wq_group		*g = NULL;
+	struct cd_work			*work, *stat;
+	uint32_t				i;
+
+	printf("TEST ALLOC DEFAULT\n");
+
+	cd_alloc_debug_init(&d, NULL);
+	cd_alloc_set_default(&d.allocator);
+
+	g = cd_wq_group_create(2, "Group Test Alloc");
+	wq = cd_wq_workqueue_create_grouped(g, 1, "Workqueue Test Alloc Grouped", NULL);
+	assert(g != NULL && wq != NULL);
+	for (i = 0; i < TEST_ALLOC_WORKS_N; i++)
+		assert(CD_ERR_OK == cd_wq_queue_user(wq, CD_WORK_ASYNC, NULL, 0, test_alloc_f, NULL));
+	work = cd_wq_work_create(CD_WORK_ASYNC, NULL, 0, test_alloc_f, NULL);
+	assert(work != NULL && work->allocator == &d.allocator);
+
+	stat = malloc(sizeof(struct cd_work));											/* user's own memory, must not go to the default */
+	assert(stat != NULL);
+	*stat = (struct cd_work) CD_WORK_INITIALIZER(*stat, CD_WORK_ASYNC, NULL, 0, test_alloc_f, NULL);
+	assert(stat->allocator == &cd_alloc_system);
+	cd_wq_work_free(&stat);
+	assert(d.tags[CD_ALLOC_TAG_WORK].allocs_n == TEST_ALLOC_WORKS_N + 1);
+
+	cd_alloc_set_default(NULL);														/* objects keep allocator they were created with */
+	assert(cd_alloc_get_default() == &cd_alloc_system);
+	assert(CD_ERR_OK == cd_wq_queue_work(wq, work));
+
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(wq));
+	cd_wq_workqueue_free(&wq);
+	assert(CD_ERR_OK == cd_wq_group_free(&g));
+
+	assert(d.tags[CD_ALLOC_TAG_WORK].allocs_n == TEST_ALLOC_WORKS_N + 1);
+	assert(cd_alloc_debug_outstanding(&d) == 0);
+}
+
+static void test_alloc_huge(void)
+{
+	struct cd_alloc_huge		h;
+	struct cd_workqueue			*wq = NULL;
+	struct cd_wq_queue_options	options = { 0 };
+	char						*small[100], *big;
+	uint64_t					x = 7;
+	uint32_t					i;
+
+	printf("TEST ALLOC HUGE\n");
+
+	assert(CD_ERR_OK == cd_alloc_huge_init(&h));
+	for (i = 0; i < 100; i++) {
+		small[i] = cd_alloc(&h.allocator, 24 + i, CD_ALLOC_TAG_WORK);
+		assert(small[i] != NULL && ((uintptr_t) small[i] % 16) == 0);
+		memset(small[i], 0xab, 24 + i);
+	}
+	big = cd_alloc_aligned(&h.allocator, 3 * CD_ALLOC_HUGE_PAGE, 4096, CD_ALLOC_TAG_QUEUE);
+	assert(big != NULL && ((uintptr_t) big % 4096) == 0);
+	memset(big, 0xcd, 3 * CD_ALLOC_HUGE_PAGE);
+	assert(cd_alloc_aligned(&h.allocator, 3 * CD_ALLOC_HUGE_PAGE, CD_ALLOC_HUGE_PAGE, CD_ALLOC_TAG_QUEUE) == NULL);	/* free couldn't find its header */
+	assert(cd_alloc_aligned(&h.allocator, 64, CD_ALLOC_HUGE_PAGE, CD_ALLOC_TAG_QUEUE) == NULL);
+	assert(h.hugetlb_pages_n + h.thp_pages_n >= 1 + 1 + 4);							/* 32 B, 64 B, 128 B classes share no chunks, big one has 4 pages */
+	printf("HUGE: %lu MAP_HUGETLB pages, %lu THP pages\n", h.hugetlb_pages_n, h.thp_pages_n);
+
+	cd_free(&h.allocator, big, CD_ALLOC_TAG_QUEUE);
+	for (i = 0; i < 100; i++)
+		cd_free(&h.allocator, small[i], CD_ALLOC_TAG_WORK);
+	assert(cd_alloc(&h.allocator, 24, CD_ALLOC_TAG_WORK) == small[8]);				/* last freed block of 32 B class is reused first */
+
+	options.CD_WQ_QUEUE_OPTION_STOP = CD_WQ_QUEUE_OPTION_STOP_SOFT;
+	options.allocator = &h.allocator;
+	wq = cd_wq_workqueue_create_options(2, "Workqueue Test Alloc Huge", &options);
+	assert(wq != NULL);
+	for (i = 0; i < TEST_ALLOC_WORKS_N; i++)
+		assert(CD_ERR_OK == cd_wq_queue_user_inline(wq, CD_WORK_ASYNC, &x, sizeof(x), 0, test_alloc_f, NULL));
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(wq));
+	cd_wq_workqueue_free(&wq);
+
+	cd_alloc_huge_deinit(&h);
+	assert(h.hugetlb_pages_n == 0 && h.thp_pages_n == 0);
+}
+
+static void cd_test_alloc(void)
+{
+	test_alloc_system();
+	test_alloc_debug_counts();
+	test_alloc_workqueue();
+	test_alloc_default();
+	test_alloc_huge();
+}
+
+int main(void)
+{
+	cd_test_alloc();
+	printf("COOL!\n");
+	return 0;
+}
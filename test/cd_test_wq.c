@@ -9,10 +9,13 @@
  *
  */
 
+#define _GNU_SOURCE				/* pthread_getattr_np, pthread_getname_np */
+
 #include "../include/cd_wq.h"
 #include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <poll.h>
 
 
 struct test {
@@ -36,7 +39,6 @@ static void test_wq_create(void)
 	assert(wq->workers_active_n == workers_n);
 	assert(strcmp(wq->name, name) == 0);
 	assert(wq->first_active_worker_idx == workers_n - 1);
-	assert(wq->next_worker_idx_to_use == wq->first_active_worker_idx);
 	assert(wq->options.CD_WQ_QUEUE_OPTION_STOP == CD_WQ_QUEUE_OPTION_STOP_HARD);
 	assert(CD_ERR_OK == cd_wq_workqueue_stop(wq));
 
@@ -81,7 +83,6 @@ static void test_wq_queue_default(void)
 	assert(wq->workers_active_n == workers_n);
 	assert(strcmp(wq->name, name) == 0);
 	assert(wq->first_active_worker_idx == workers_n - 1);
-	assert(wq->next_worker_idx_to_use == wq->first_active_worker_idx);
 	assert(wq->options.CD_WQ_QUEUE_OPTION_STOP == CD_WQ_QUEUE_OPTION_STOP_SOFT);
 
 	w1 = cd_wq_work_create(CD_WORK_ASYNC, (void *) &test_wq_queue_default_counter, 555, test_wq_queue_default_f, NULL);
@@ -173,7 +174,6 @@ static void test_wq_queue_soft(void)
 	assert(wq->workers_active_n == workers_n);
 	assert(strcmp(wq->name, name) == 0);
 	assert(wq->first_active_worker_idx == workers_n - 1);
-	assert(wq->next_worker_idx_to_use == wq->first_active_worker_idx);
 	assert(wq->options.CD_WQ_QUEUE_OPTION_STOP == CD_WQ_QUEUE_OPTION_STOP_SOFT);
 
 	w1 = cd_wq_work_create(CD_WORK_ASYNC, (void *) &test_wq_queue_soft_counter, 555, test_wq_queue_soft_f, NULL);
@@ -323,7 +323,6 @@ static void test_wq_queue_default_sync(void)
 	assert(wq->workers_active_n == workers_n);
 	assert(strcmp(wq->name, name) == 0);
 	assert(wq->first_active_worker_idx == workers_n - 1);
-	assert(wq->next_worker_idx_to_use == wq->first_active_worker_idx);
 	assert(wq->options.CD_WQ_QUEUE_OPTION_STOP == CD_WQ_QUEUE_OPTION_STOP_SOFT);
 
 	w1 = cd_wq_work_create(CD_WORK_SYNC, (void *) user_data_1, 555, test_wq_queue_default_sync_f, test_wq_queue_default_sync_f_dtor);
@@ -471,7 +470,6 @@ static void test_wq_queue_hard_sync(void)
 	assert(wq->workers_active_n == workers_n);
 	assert(strcmp(wq->name, name) == 0);
 	assert(wq->first_active_worker_idx == workers_n - 1);
-	assert(wq->next_worker_idx_to_use == wq->first_active_worker_idx);
 	assert(wq->options.CD_WQ_QUEUE_OPTION_STOP == CD_WQ_QUEUE_OPTION_STOP_HARD);
 
 	w1 = cd_wq_work_create(CD_WORK_SYNC, (void *) user_data_1, 555, test_wq_queue_hard_sync_f, test_wq_queue_hard_sync_f_dtor);
@@ -680,7 +678,6 @@ static void test_wq_queue_hard_sync_async(void)
 	assert(wq->workers_active_n == workers_n);
 	assert(strcmp(wq->name, name) == 0);
 	assert(wq->first_active_worker_idx == workers_n - 1);
-	assert(wq->next_worker_idx_to_use == wq->first_active_worker_idx);
 	assert(wq->options.CD_WQ_QUEUE_OPTION_STOP == CD_WQ_QUEUE_OPTION_STOP_HARD);
 
 	w1 = cd_wq_work_create(CD_WORK_SYNC, (void *) user_data_1, 0, test_wq_queue_hard_sync_async_f, test_wq_queue_hard_sync_async_f_sync_dtor);
@@ -776,6 +773,1777 @@ static void test_wq_queue_hard_sync_async(void)
 	pthread_mutex_destroy(&test_wq_queue_hard_sync_async_counter_mutex);
 }
 
+uint32_t test_wq_queue_from_worker_counter;
+pthread_mutex_t test_wq_queue_from_worker_counter_mutex;
+struct cd_workqueue *test_wq_queue_from_worker_wq;
+
+static void test_wq_queue_from_worker_count(void)
+{
+    pthread_mutex_lock(&test_wq_queue_from_worker_counter_mutex);
+    test_wq_queue_from_worker_counter++;
+    pthread_mutex_unlock(&test_wq_queue_from_worker_counter_mutex);
+}
+
+static void* test_wq_queue_from_worker_leaf_f(void *arg)
+{
+    (void) arg;
+    test_wq_queue_from_worker_count();
+    return NULL;
+}
+
+static void* test_wq_queue_from_worker_tree_f(void *arg)
+{
+    uintptr_t depth = (uintptr_t) arg;
+
+    test_wq_queue_from_worker_count();
+    if (depth > 0) {
+        // Children go to this worker's local deque, other workers may steal them.
+        assert(CD_ERR_OK == cd_wq_queue_user(test_wq_queue_from_worker_wq, CD_WORK_ASYNC, (void *) (depth - 1), 0, test_wq_queue_from_worker_tree_f, NULL));
+        assert(CD_ERR_OK == cd_wq_queue_user(test_wq_queue_from_worker_wq, CD_WORK_ASYNC, (void *) (depth - 1), 0, test_wq_queue_from_worker_tree_f, NULL));
+    }
+    return NULL;
+}
+
+static void* test_wq_queue_from_worker_fan_out_f(void *arg)
+{
+    uintptr_t i, n = (uintptr_t) arg;
+
+    test_wq_queue_from_worker_count();
+
+    // More than fits in the local deque, the rest overflows to workers' queues.
+    for (i = 0; i < n; i++)
+        assert(CD_ERR_OK == cd_wq_queue_user(test_wq_queue_from_worker_wq, CD_WORK_ASYNC, NULL, 0, test_wq_queue_from_worker_leaf_f, NULL));
+    return NULL;
+}
+
+static void test_wq_queue_from_worker(void)
+{
+	uint32_t workers_n = 4;
+	const char *name = "Workqueue Test Queue From Worker";
+	uintptr_t depth = 8, fan_out = 3 * CD_WQ_DEQUE_SIZE;
+
+	printf("TEST WQ QUEUE FROM WORKER\n");
+
+	test_wq_queue_from_worker_counter = 0;
+	pthread_mutex_init(&test_wq_queue_from_worker_counter_mutex, NULL);
+	test_wq_queue_from_worker_wq = cd_wq_workqueue_default_create(workers_n, name);
+	assert(test_wq_queue_from_worker_wq != NULL);
+
+	assert(CD_ERR_OK == cd_wq_queue_user(test_wq_queue_from_worker_wq, CD_WORK_ASYNC, (void *) depth, 0, test_wq_queue_from_worker_tree_f, NULL));
+	assert(CD_ERR_OK == cd_wq_queue_user(test_wq_queue_from_worker_wq, CD_WORK_ASYNC, (void *) fan_out, 0, test_wq_queue_from_worker_fan_out_f, NULL));
+
+	// Let the queue process some of the tasks
+	usleep(2000);
+
+	// SOFT stop must drain local deques too.
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(test_wq_queue_from_worker_wq));
+
+	pthread_mutex_lock(&test_wq_queue_from_worker_counter_mutex);
+	assert(test_wq_queue_from_worker_counter == ((1u << (depth + 1)) - 1) + 1 + fan_out);
+	printf("QUEUE FROM WORKER: All %u jobs were executed\n", test_wq_queue_from_worker_counter);
+	pthread_mutex_unlock(&test_wq_queue_from_worker_counter_mutex);
+
+	cd_wq_workqueue_free(&test_wq_queue_from_worker_wq);
+	pthread_mutex_destroy(&test_wq_queue_from_worker_counter_mutex);
+}
+
+static void* test_wq_queue_from_worker_stopping_f(void *arg)
+{
+    struct cd_workqueue *wq = test_wq_queue_from_worker_wq;
+
+    // Fan out only once stop has taken the intake down
+    while (wq->group ? __atomic_load_n(&wq->running, __ATOMIC_ACQUIRE) : __atomic_load_n(&wq->workers_active_n, __ATOMIC_ACQUIRE) > 0)
+        usleep(100);
+    return test_wq_queue_from_worker_tree_f(arg);
+}
+
+static void test_wq_queue_from_worker_stopping_run(struct cd_workqueue *wq, uintptr_t depth)
+{
+	static char id = 'X';
+
+	test_wq_queue_from_worker_counter = 0;
+	test_wq_queue_from_worker_wq = wq;
+
+	assert(CD_ERR_OK == cd_wq_queue_user(wq, CD_WORK_ASYNC, (void *) depth, 0, test_wq_queue_from_worker_stopping_f, NULL));
+
+	// SOFT stop rejects other threads at once, but lets draining jobs spawn their children
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(wq));
+	assert(CD_ERR_WORKQUEUE_ACTIVE == cd_wq_queue_user(wq, CD_WORK_ASYNC, &id, 0, test_wq_queue_from_worker_leaf_f, NULL));
+
+	pthread_mutex_lock(&test_wq_queue_from_worker_counter_mutex);
+	assert(test_wq_queue_from_worker_counter == (1u << (depth + 1)) - 1);
+	printf("QUEUE FROM WORKER STOPPING: All %u jobs of [%s] were executed\n", test_wq_queue_from_worker_counter, wq->name);
+	pthread_mutex_unlock(&test_wq_queue_from_worker_counter_mutex);
+}
+
+static void test_wq_queue_from_worker_stopping(void)
+{
+	struct cd_workqueue *wq = NULL;
+	struct cd_wq_group *g = NULL;
+	uintptr_t depth = 6;
+
+	printf("TEST WQ QUEUE FROM WORKER STOPPING\n");
+
+	pthread_mutex_init(&test_wq_queue_from_worker_counter_mutex, NULL);
+
+	wq = cd_wq_workqueue_default_create(2, "Workqueue Test Queue From Worker Stopping");
+	assert(wq != NULL);
+	test_wq_queue_from_worker_stopping_run(wq, depth);
+	cd_wq_workqueue_free(&wq);
+
+	g = cd_wq_group_create(2, "Workqueue Test Queue From Worker Stopping Group");
+	assert(g != NULL);
+	wq = cd_wq_workqueue_create_grouped(g, 1, "Workqueue Test Queue From Worker Stopping Grouped", NULL);
+	assert(wq != NULL);
+	test_wq_queue_from_worker_stopping_run(wq, depth);
+	cd_wq_workqueue_free(&wq);
+	assert(CD_ERR_OK == cd_wq_group_free(&g));
+
+	test_wq_queue_from_worker_wq = NULL;
+	pthread_mutex_destroy(&test_wq_queue_from_worker_counter_mutex);
+}
+
+
+uint32_t test_wq_queue_coalesce_counter;
+uint32_t test_wq_queue_coalesce_merge_counter;
+uint32_t test_wq_queue_coalesce_dctor_counter;
+pthread_mutex_t test_wq_queue_coalesce_counter_mutex;
+pthread_mutex_t test_wq_queue_coalesce_gate;
+
+static void* test_wq_queue_coalesce_gate_f(void *arg)
+{
+    (void) arg;
+    // Hold the only worker, so all works enqueued meanwhile stay pending
+    pthread_mutex_lock(&test_wq_queue_coalesce_gate);
+    pthread_mutex_unlock(&test_wq_queue_coalesce_gate);
+    return NULL;
+}
+
+static void* test_wq_queue_coalesce_f(void *arg)
+{
+    int *refreshes = arg;
+
+    pthread_mutex_lock(&test_wq_queue_coalesce_counter_mutex);
+    test_wq_queue_coalesce_counter++;
+    printf("Coalesce: refresh covers %d requests\n", *refreshes);
+    fflush(stdout);
+    pthread_mutex_unlock(&test_wq_queue_coalesce_counter_mutex);
+    return NULL;
+}
+
+static void test_wq_queue_coalesce_merge(void *pending_user_data, void *user_data)
+{
+    *(int *) pending_user_data += *(int *) user_data;
+    test_wq_queue_coalesce_merge_counter++;
+}
+
+static void test_wq_queue_coalesce_f_dtor(void *arg)
+{
+    pthread_mutex_lock(&test_wq_queue_coalesce_counter_mutex);
+    test_wq_queue_coalesce_dctor_counter++;
+    pthread_mutex_unlock(&test_wq_queue_coalesce_counter_mutex);
+    free(arg);
+}
+
+static void test_wq_queue_coalesce(void)
+{
+	uint32_t workers_n = 1;
+	const char *name = "Workqueue Test Coalesce";
+	struct cd_workqueue *wq = NULL;
+	struct cd_work *w = NULL;
+	struct cd_wq_stats stats;
+	int i, *refreshes;
+
+	printf("TEST WQ QUEUE COALESCE\n");
+
+	test_wq_queue_coalesce_counter = 0;
+	test_wq_queue_coalesce_merge_counter = 0;
+	test_wq_queue_coalesce_dctor_counter = 0;
+	pthread_mutex_init(&test_wq_queue_coalesce_counter_mutex, NULL);
+	pthread_mutex_init(&test_wq_queue_coalesce_gate, NULL);
+	wq = cd_wq_workqueue_default_create(workers_n, name);
+	assert(wq != NULL);
+
+	pthread_mutex_lock(&test_wq_queue_coalesce_gate);
+	assert(CD_ERR_OK == cd_wq_queue_user(wq, CD_WORK_ASYNC, NULL, 0, test_wq_queue_coalesce_gate_f, NULL));
+
+	// 100 refreshes of X and one refresh of Y, while none of them can start
+	for (i = 0; i < 101; i++) {
+		refreshes = malloc(sizeof(int));
+		assert(refreshes != NULL);
+		*refreshes = 1;
+		w = cd_wq_work_create(CD_WORK_SYNC, refreshes, 0, test_wq_queue_coalesce_f, test_wq_queue_coalesce_f_dtor);
+		assert(w != NULL);
+		assert(CD_ERR_OK == cd_wq_queue_work_coalesce(wq, w, i < 100 ? 0x58 : 0x59, test_wq_queue_coalesce_merge));
+	}
+
+	assert(CD_ERR_OK == cd_wq_workqueue_stats(wq, &stats));
+	assert(stats.coalesced_n == 99);
+	assert(test_wq_queue_coalesce_merge_counter == 99);
+
+	pthread_mutex_unlock(&test_wq_queue_coalesce_gate);
+
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(wq));
+
+	pthread_mutex_lock(&test_wq_queue_coalesce_counter_mutex);
+	assert(test_wq_queue_coalesce_counter == 2);
+	assert(test_wq_queue_coalesce_dctor_counter == 101);
+	printf("QUEUE COALESCE: 101 requests, %u jobs were executed, all dctors were called\n", test_wq_queue_coalesce_counter);
+	pthread_mutex_unlock(&test_wq_queue_coalesce_counter_mutex);
+
+	cd_wq_workqueue_free(&wq);
+	pthread_mutex_destroy(&test_wq_queue_coalesce_gate);
+	pthread_mutex_destroy(&test_wq_queue_coalesce_counter_mutex);
+}
+
+
+uint32_t test_wq_queue_rate_limit_counter;
+pthread_mutex_t test_wq_queue_rate_limit_counter_mutex;
+
+static void* test_wq_queue_rate_limit_f(void *arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&test_wq_queue_rate_limit_counter_mutex);
+    test_wq_queue_rate_limit_counter++;
+    pthread_mutex_unlock(&test_wq_queue_rate_limit_counter_mutex);
+    return NULL;
+}
+
+static void test_wq_queue_rate_limit(void)
+{
+	uint32_t workers_n = 2;
+	const char *name = "Workqueue Test Rate Limit";
+	struct cd_workqueue *wq = NULL;
+	struct cd_wq_stats stats;
+	uint64_t t0, dt;
+	int i, accepted;
+
+	printf("TEST WQ RATE LIMIT\n");
+
+	test_wq_queue_rate_limit_counter = 0;
+	pthread_mutex_init(&test_wq_queue_rate_limit_counter_mutex, NULL);
+
+	// Hold: 21 jobs at 200 per second, burst of 1, must take at least 20 intervals of 5 ms
+	wq = cd_wq_workqueue_default_create(workers_n, name);
+	assert(wq != NULL);
+	assert(CD_ERR_OK == cd_wq_workqueue_set_rate_limit(wq, 200, 1, CD_WQ_RATE_HOLD));
+
+	t0 = cd_util_now_ns();
+	for (i = 0; i < 21; i++)
+		assert(CD_ERR_OK == cd_wq_queue_user(wq, CD_WORK_ASYNC, NULL, 0, test_wq_queue_rate_limit_f, NULL));
+
+	assert(CD_ERR_OK == cd_wq_workqueue_stats(wq, &stats));
+	assert(stats.throttled_n > 0);
+
+	// SOFT stop waits for held work to conform and be executed.
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(wq));
+	dt = cd_util_now_ns() - t0;
+
+	pthread_mutex_lock(&test_wq_queue_rate_limit_counter_mutex);
+	assert(test_wq_queue_rate_limit_counter == 21);
+	pthread_mutex_unlock(&test_wq_queue_rate_limit_counter_mutex);
+	assert(dt >= 95 * 1000 * 1000);
+	printf("RATE LIMIT HOLD: 21 jobs were executed in %lu ms\n", dt / 1000000);
+	cd_wq_workqueue_free(&wq);
+
+	// Reject: burst of 5 per queue, burst of 2 for user_data_type 7, nothing conforms again within the test
+	wq = cd_wq_workqueue_default_create(workers_n, name);
+	assert(wq != NULL);
+	assert(CD_ERR_OK == cd_wq_workqueue_set_rate_limit(wq, 1, 5, CD_WQ_RATE_REJECT));
+	assert(CD_ERR_OK == cd_wq_workqueue_set_type_rate_limit(wq, 7, 1, 2));
+
+	accepted = 0;
+	for (i = 0; i < 4; i++) {
+		if (cd_wq_queue_user(wq, CD_WORK_ASYNC, NULL, 7, test_wq_queue_rate_limit_f, NULL) == CD_ERR_OK)
+			accepted++;
+	}
+	assert(accepted == 2);
+
+	for (i = 0; i < 10; i++) {
+		if (cd_wq_queue_user(wq, CD_WORK_ASYNC, NULL, 8, test_wq_queue_rate_limit_f, NULL) == CD_ERR_OK)
+			accepted++;
+	}
+	assert(accepted == 5);
+
+	assert(CD_ERR_OK == cd_wq_workqueue_stats(wq, &stats));
+	assert(stats.rejected_n == 9);
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(wq));
+	printf("RATE LIMIT REJECT: %d jobs accepted, %lu rejected\n", accepted, stats.rejected_n);
+	cd_wq_workqueue_free(&wq);
+
+	pthread_mutex_destroy(&test_wq_queue_rate_limit_counter_mutex);
+}
+
+
+uint32_t test_wq_queue_edf_order[8];
+uint32_t test_wq_queue_edf_counter;
+uint32_t test_wq_queue_edf_expired_counter;
+uint32_t test_wq_queue_edf_dctor_counter;
+uint8_t test_wq_queue_edf_gate_started;
+pthread_mutex_t test_wq_queue_edf_counter_mutex;
+pthread_mutex_t test_wq_queue_edf_gate;
+
+static void* test_wq_queue_edf_gate_f(void *arg)
+{
+    (void) arg;
+    // Hold the only worker, so all works enqueued meanwhile stay pending
+    __atomic_store_n(&test_wq_queue_edf_gate_started, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&test_wq_queue_edf_gate);
+    pthread_mutex_unlock(&test_wq_queue_edf_gate);
+    return NULL;
+}
+
+static void* test_wq_queue_edf_f(void *arg)
+{
+    uint32_t *id = arg;
+
+    pthread_mutex_lock(&test_wq_queue_edf_counter_mutex);
+    test_wq_queue_edf_order[test_wq_queue_edf_counter++] = *id;
+    printf("EDF: job %u\n", *id);
+    fflush(stdout);
+    pthread_mutex_unlock(&test_wq_queue_edf_counter_mutex);
+    return NULL;
+}
+
+static void test_wq_queue_edf_expired(struct cd_work *work)
+{
+    pthread_mutex_lock(&test_wq_queue_edf_counter_mutex);
+    test_wq_queue_edf_expired_counter++;
+    printf("EDF: job %u expired\n", *(uint32_t *) work->user_data);
+    fflush(stdout);
+    pthread_mutex_unlock(&test_wq_queue_edf_counter_mutex);
+}
+
+static void test_wq_queue_edf_f_dtor(void *arg)
+{
+    pthread_mutex_lock(&test_wq_queue_edf_counter_mutex);
+    test_wq_queue_edf_dctor_counter++;
+    pthread_mutex_unlock(&test_wq_queue_edf_counter_mutex);
+    free(arg);
+}
+
+static void test_wq_queue_edf(void)
+{
+	const char *name = "Workqueue Test EDF";
+	struct cd_wq_queue_options options = { 0 };
+	struct cd_workqueue *wq = NULL;
+	struct cd_work *w = NULL;
+	struct cd_wq_stats stats;
+	uint64_t now;
+	uint32_t i, *id;
+
+	// Deadlines in ms from now, 0 is no deadline, -1 is already missed
+	int64_t deadline_ms[7] = { 5000, 0, 1000, -1, 3000, 2000, -1 };
+	uint32_t expected[5] = { 2, 5, 4, 0, 1 };
+
+	printf("TEST WQ QUEUE EDF\n");
+
+	test_wq_queue_edf_counter = 0;
+	test_wq_queue_edf_expired_counter = 0;
+	test_wq_queue_edf_dctor_counter = 0;
+	test_wq_queue_edf_gate_started = 0;
+	pthread_mutex_init(&test_wq_queue_edf_counter_mutex, NULL);
+	pthread_mutex_init(&test_wq_queue_edf_gate, NULL);
+
+	options.CD_WQ_QUEUE_OPTION_STOP = CD_WQ_QUEUE_OPTION_STOP_SOFT;
+	options.CD_WQ_QUEUE_OPTION_ORDER = CD_WQ_QUEUE_OPTION_ORDER_EDF;
+	options.f_expired = test_wq_queue_edf_expired;
+	wq = cd_wq_workqueue_create_options(1, name, &options);
+	assert(wq != NULL);
+
+	pthread_mutex_lock(&test_wq_queue_edf_gate);
+	assert(CD_ERR_OK == cd_wq_queue_user(wq, CD_WORK_ASYNC, NULL, 0, test_wq_queue_edf_gate_f, NULL));
+	while (!__atomic_load_n(&test_wq_queue_edf_gate_started, __ATOMIC_ACQUIRE))
+		usleep(1000);
+
+	now = cd_util_now_ns();
+	for (i = 0; i < 7; i++) {
+		id = malloc(sizeof(uint32_t));
+		assert(id != NULL);
+		*id = i;
+		w = cd_wq_work_create(CD_WORK_SYNC, id, 0, test_wq_queue_edf_f, test_wq_queue_edf_f_dtor);
+		assert(w != NULL);
+		if (deadline_ms[i] < 0)
+			cd_wq_work_set_deadline(w, now - 1000000);
+		else if (deadline_ms[i] > 0)
+			cd_wq_work_set_deadline(w, now + deadline_ms[i] * 1000000);
+		assert(CD_ERR_OK == cd_wq_queue_work(wq, w));
+	}
+
+	pthread_mutex_unlock(&test_wq_queue_edf_gate);
+
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(wq));
+
+	pthread_mutex_lock(&test_wq_queue_edf_counter_mutex);
+	assert(test_wq_queue_edf_counter == 5);
+	for (i = 0; i < 5; i++)
+		assert(test_wq_queue_edf_order[i] == expected[i]);
+	assert(test_wq_queue_edf_expired_counter == 2);
+	assert(test_wq_queue_edf_dctor_counter == 7);
+	pthread_mutex_unlock(&test_wq_queue_edf_counter_mutex);
+
+	assert(CD_ERR_OK == cd_wq_workqueue_stats(wq, &stats));
+	assert(stats.expired_n == 2);
+	printf("QUEUE EDF: 5 jobs executed in deadline order, %lu expired jobs dropped, all dctors were called\n", stats.expired_n);
+
+	cd_wq_workqueue_free(&wq);
+	pthread_mutex_destroy(&test_wq_queue_edf_gate);
+	pthread_mutex_destroy(&test_wq_queue_edf_counter_mutex);
+}
+
+
+char test_wq_group_order[32];
+uint32_t test_wq_group_counter;
+uint8_t test_wq_group_gate_started;
+pthread_mutex_t test_wq_group_counter_mutex;
+pthread_mutex_t test_wq_group_gate;
+
+static void* test_wq_group_gate_f(void *arg)
+{
+    (void) arg;
+    // Hold the only thread of the group, so all works enqueued meanwhile stay pending
+    __atomic_store_n(&test_wq_group_gate_started, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&test_wq_group_gate);
+    pthread_mutex_unlock(&test_wq_group_gate);
+    return NULL;
+}
+
+static void* test_wq_group_f(void *arg)
+{
+    pthread_mutex_lock(&test_wq_group_counter_mutex);
+    test_wq_group_order[test_wq_group_counter++] = *(char *) arg;
+    pthread_mutex_unlock(&test_wq_group_counter_mutex);
+    return NULL;
+}
+
+static void test_wq_group(void)
+{
+	struct cd_wq_group *g = NULL;
+	struct cd_workqueue *a = NULL, *b = NULL;
+	struct cd_wq_stats stats;
+	static char id_a = 'A', id_b = 'B';
+	uint32_t i;
+
+	// Weight 3 vs 1: A runs 3 jobs per each job of B, until A has no more work
+	const char *expected = "AAABAAABAAABAAABBBBBBBBB";
+
+	printf("TEST WQ GROUP\n");
+
+	test_wq_group_counter = 0;
+	test_wq_group_gate_started = 0;
+	memset(test_wq_group_order, 0, sizeof(test_wq_group_order));
+	pthread_mutex_init(&test_wq_group_counter_mutex, NULL);
+	pthread_mutex_init(&test_wq_group_gate, NULL);
+
+	g = cd_wq_group_create(1, "Workqueue Test Group");
+	assert(g != NULL);
+	a = cd_wq_workqueue_create_grouped(g, 3, "Workqueue Test Group A", NULL);
+	assert(a != NULL);
+	b = cd_wq_workqueue_create_grouped(g, 1, "Workqueue Test Group B", NULL);
+	assert(b != NULL);
+
+	assert(CD_ERR_OK == cd_wq_workqueue_stats(a, &stats));
+	assert(stats.workers_n == 1);
+	assert(CD_ERR_BAD_CALL == cd_wq_workqueue_set_rate_limit(a, 100, 1, CD_WQ_RATE_HOLD));
+
+	pthread_mutex_lock(&test_wq_group_gate);
+	assert(CD_ERR_OK == cd_wq_queue_user(a, CD_WORK_ASYNC, NULL, 0, test_wq_group_gate_f, NULL));
+	while (!__atomic_load_n(&test_wq_group_gate_started, __ATOMIC_ACQUIRE))
+		usleep(1000);
+
+	for (i = 0; i < 12; i++) {
+		assert(CD_ERR_OK == cd_wq_queue_user(a, CD_WORK_ASYNC, &id_a, 0, test_wq_group_f, NULL));
+		assert(CD_ERR_OK == cd_wq_queue_user(b, CD_WORK_ASYNC, &id_b, 0, test_wq_group_f, NULL));
+	}
+
+	pthread_mutex_unlock(&test_wq_group_gate);
+
+	// SOFT stop of a grouped queue waits for its work, other queues of the group keep running
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(b));
+	assert(CD_ERR_WORKQUEUE_ACTIVE == cd_wq_queue_user(b, CD_WORK_ASYNC, &id_b, 0, test_wq_group_f, NULL));
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(a));
+
+	pthread_mutex_lock(&test_wq_group_counter_mutex);
+	printf("GROUP: order of jobs %s\n", test_wq_group_order);
+	assert(test_wq_group_counter == 24);
+	assert(strcmp(test_wq_group_order, expected) == 0);
+	pthread_mutex_unlock(&test_wq_group_counter_mutex);
+
+	assert(CD_ERR_BUSY == cd_wq_group_free(&g));
+	cd_wq_workqueue_free(&a);
+	cd_wq_workqueue_free(&b);
+	assert(CD_ERR_OK == cd_wq_group_free(&g));
+	assert(g == NULL);
+
+	pthread_mutex_destroy(&test_wq_group_gate);
+	pthread_mutex_destroy(&test_wq_group_counter_mutex);
+}
+
+
+static void* test_wq_completions_f(void *arg)
+{
+    return (void *) ((uintptr_t) arg * 10);
+}
+
+static void test_wq_completions(void)
+{
+	struct cd_workqueue *wq = NULL;
+	struct cd_wq_completion c[8];
+	struct cd_wq_stats stats;
+	struct pollfd pfd;
+	uint8_t seen[40];
+	uint32_t i, j, n, reaped;
+
+	printf("TEST WQ COMPLETIONS\n");
+
+	// Ring of 8 is smaller than the batch of jobs, completions which don't fit overflow and are reaped too
+	wq = cd_wq_workqueue_default_create(1, "Workqueue Test Completions");
+	assert(wq != NULL);
+	assert(CD_ERR_OK == cd_wq_workqueue_enable_completions(wq, 8, 1));
+	assert(cd_wq_completion_fd(wq) >= 0);
+
+	for (i = 0; i < 20; i++)
+		assert(CD_ERR_OK == cd_wq_queue_user(wq, CD_WORK_ASYNC, (void *) (uintptr_t) i, 0, test_wq_completions_f, NULL));
+
+	memset(seen, 0, sizeof(seen));
+	reaped = 0;
+	pfd.fd = cd_wq_completion_fd(wq);
+	pfd.events = POLLIN;
+	while (reaped < 20) {
+		assert(poll(&pfd, 1, 5000) == 1);
+		while ((n = cd_wq_reap_completions(wq, c, 5)) > 0) {
+			for (j = 0; j < n; j++) {
+				i = (uintptr_t) c[j].user_data;
+				assert(i < 20 && seen[i] == 0);
+				assert((uintptr_t) c[j].ret == i * 10);
+				assert(c[j].submit_ns <= c[j].start_ns && c[j].start_ns <= c[j].end_ns);
+				seen[i] = 1;
+			}
+			reaped += n;
+		}
+	}
+	assert(cd_wq_reap_completions(wq, c, 8) == 0);
+
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(wq));
+	assert(CD_ERR_OK == cd_wq_workqueue_stats(wq, &stats));
+	printf("COMPLETIONS: %u reaped, %lu did not fit into the ring\n", reaped, stats.completions_overflow_n);
+	cd_wq_workqueue_free(&wq);
+}
+
+
+#define TEST_WQ_STRAND_N 8
+#define TEST_WQ_STRAND_JOBS_N 500
+
+struct test_wq_strand_job {
+    uint32_t strand;
+    uint32_t seq;
+};
+
+uint32_t test_wq_strand_running[TEST_WQ_STRAND_N];
+uint32_t test_wq_strand_next_seq[TEST_WQ_STRAND_N];
+uint32_t test_wq_strand_counter;
+
+static void* test_wq_strand_f(void *arg)
+{
+    struct test_wq_strand_job *job = arg;
+
+    // No other job of this strand is running, and all earlier ones have finished
+    assert(__atomic_add_fetch(&test_wq_strand_running[job->strand], 1, __ATOMIC_SEQ_CST) == 1);
+    assert(test_wq_strand_next_seq[job->strand] == job->seq);
+    test_wq_strand_next_seq[job->strand]++;
+    if (job->seq % 64 == 0)
+        sched_yield();
+    __atomic_sub_fetch(&test_wq_strand_running[job->strand], 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&test_wq_strand_counter, 1, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+static void test_wq_strand(void)
+{
+	struct cd_workqueue *wq = NULL;
+	struct cd_wq_strand *strands[TEST_WQ_STRAND_N];
+	struct test_wq_strand_job *job;
+	uint32_t i, j;
+
+	printf("TEST WQ STRAND\n");
+
+	memset(test_wq_strand_running, 0, sizeof(test_wq_strand_running));
+	memset(test_wq_strand_next_seq, 0, sizeof(test_wq_strand_next_seq));
+	test_wq_strand_counter = 0;
+
+	wq = cd_wq_workqueue_default_create(4, "Workqueue Test Strand");
+	assert(wq != NULL);
+	for (i = 0; i < TEST_WQ_STRAND_N; i++) {
+		strands[i] = cd_wq_strand_create(wq);
+		assert(strands[i] != NULL);
+	}
+
+	for (j = 0; j < TEST_WQ_STRAND_JOBS_N; j++) {
+		for (i = 0; i < TEST_WQ_STRAND_N; i++) {
+			job = malloc(sizeof(struct test_wq_strand_job));
+			assert(job != NULL);
+			job->strand = i;
+			job->seq = j;
+			assert(CD_ERR_OK == cd_wq_strand_queue_user(strands[i], CD_WORK_SYNC, job, 0, test_wq_strand_f, free));
+		}
+	}
+
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(wq));
+
+	assert(test_wq_strand_counter == TEST_WQ_STRAND_N * TEST_WQ_STRAND_JOBS_N);
+	for (i = 0; i < TEST_WQ_STRAND_N; i++) {
+		assert(test_wq_strand_next_seq[i] == TEST_WQ_STRAND_JOBS_N);
+		assert(CD_ERR_OK == cd_wq_strand_free(&strands[i]));
+	}
+	printf("STRAND: %u jobs in %u strands run in order, one at a time per strand\n", test_wq_strand_counter, TEST_WQ_STRAND_N);
+
+	cd_wq_workqueue_free(&wq);
+}
+
+
+#define TEST_WQ_STRAND_FAIR_JOBS_N (3 * CD_WQ_STRAND_BATCH)
+
+uint32_t test_wq_strand_fair_done;
+uint32_t test_wq_strand_fair_seen;
+uint8_t test_wq_strand_fair_started;
+pthread_mutex_t test_wq_strand_fair_gate;
+
+static void* test_wq_strand_fair_gate_f(void *arg)
+{
+    (void) arg;
+    __atomic_store_n(&test_wq_strand_fair_started, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&test_wq_strand_fair_gate);
+    pthread_mutex_unlock(&test_wq_strand_fair_gate);
+    return NULL;
+}
+
+static void* test_wq_strand_fair_f(void *arg)
+{
+    (void) arg;
+    __atomic_add_fetch(&test_wq_strand_fair_done, 1, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+static void* test_wq_strand_fair_other_f(void *arg)
+{
+    (void) arg;
+    test_wq_strand_fair_seen = __atomic_load_n(&test_wq_strand_fair_done, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+static void test_wq_strand_fair(void)
+{
+	struct cd_workqueue *wq = NULL;
+	struct cd_wq_strand *s;
+	struct cd_wq_wait_group wg = CD_WQ_WAIT_GROUP_INITIALIZER;
+	struct cd_work *w = NULL;
+	uint32_t i;
+
+	printf("TEST WQ STRAND FAIR\n");
+
+	test_wq_strand_fair_done = 0;
+	test_wq_strand_fair_seen = UINT32_MAX;
+	test_wq_strand_fair_started = 0;
+	pthread_mutex_init(&test_wq_strand_fair_gate, NULL);
+
+	wq = cd_wq_workqueue_create(1, "Workqueue Test Strand Fair", CD_WQ_QUEUE_OPTION_STOP_SOFT);
+	assert(wq != NULL);
+	s = cd_wq_strand_create(wq);
+	assert(s != NULL);
+
+	// Hold the only worker until strand's runner and the competing job are both queued
+	pthread_mutex_lock(&test_wq_strand_fair_gate);
+	assert(CD_ERR_OK == cd_wq_queue_user(wq, CD_WORK_ASYNC, NULL, 0, test_wq_strand_fair_gate_f, NULL));
+	while (!__atomic_load_n(&test_wq_strand_fair_started, __ATOMIC_ACQUIRE))
+		usleep(100);
+	for (i = 0; i < TEST_WQ_STRAND_FAIR_JOBS_N; i++) {
+		w = cd_wq_work_create(CD_WORK_ASYNC, NULL, 0, test_wq_strand_fair_f, NULL);
+		assert(w != NULL);
+		cd_wq_work_set_wait_group(w, &wg);
+		assert(CD_ERR_OK == cd_wq_strand_queue_work(s, w));
+	}
+	assert(CD_ERR_OK == cd_wq_spawn_user(wq, &wg, CD_WORK_ASYNC, NULL, 0, test_wq_strand_fair_other_f, NULL));
+	pthread_mutex_unlock(&test_wq_strand_fair_gate);
+
+	// Runner gives up fairness while workqueue is stopping, so it must run its batches before the stop
+	assert(CD_ERR_OK == cd_wq_wait_group_wait(&wg, 0));
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(wq));
+	assert(test_wq_strand_fair_done == TEST_WQ_STRAND_FAIR_JOBS_N);
+	assert(test_wq_strand_fair_seen == CD_WQ_STRAND_BATCH);								/* ran right after strand's first batch */
+	printf("STRAND FAIR: other job ran after %u of %u strand's jobs\n", test_wq_strand_fair_seen, TEST_WQ_STRAND_FAIR_JOBS_N);
+
+	assert(CD_ERR_OK == cd_wq_strand_free(&s));
+	cd_wq_workqueue_free(&wq);
+	pthread_mutex_destroy(&test_wq_strand_fair_gate);
+}
+
+
+#define TEST_WQ_ORDERED_JOBS_N 300
+#define TEST_WQ_ORDERED_HOLE_NS (50 * 1000000)
+
+uint32_t test_wq_ordered_emitted[TEST_WQ_ORDERED_JOBS_N];
+uint32_t test_wq_ordered_emitted_n;
+uint32_t test_wq_ordered_dctor_counter;
+uint8_t test_wq_ordered_gate_started;
+pthread_mutex_t test_wq_ordered_gate;
+
+static void* test_wq_ordered_f(void *arg)
+{
+    uint32_t id = *(uint32_t *) arg;
+
+    // Finish out of order
+    usleep((id * 7919) % 300);
+    return (void *) (uintptr_t) (id + 1000);
+}
+
+static void* test_wq_ordered_gate_f(void *arg)
+{
+    __atomic_store_n(&test_wq_ordered_gate_started, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&test_wq_ordered_gate);
+    pthread_mutex_unlock(&test_wq_ordered_gate);
+    return (void *) (uintptr_t) (*(uint32_t *) arg + 1000);
+}
+
+static void test_wq_ordered_emit(void *user_data, void *ret)
+{
+    uint32_t id = *(uint32_t *) user_data;
+
+    // Emitter role is held by one thread at a time
+    assert((uintptr_t) ret == id + 1000);
+    test_wq_ordered_emitted[test_wq_ordered_emitted_n++] = id;
+}
+
+static void test_wq_ordered_f_dtor(void *arg)
+{
+    __atomic_add_fetch(&test_wq_ordered_dctor_counter, 1, __ATOMIC_SEQ_CST);
+    free(arg);
+}
+
+static uint32_t* test_wq_ordered_id(uint32_t i)
+{
+    uint32_t *id = malloc(sizeof(uint32_t));
+
+    assert(id != NULL);
+    *id = i;
+    return id;
+}
+
+static void test_wq_ordered(void)
+{
+	struct cd_wq_group *g = NULL;
+	struct cd_workqueue *wq = NULL;
+	struct cd_wq_ordered *o = NULL;
+	uint32_t i, *id;
+	uint64_t t0;
+	enum cd_error err;
+
+	printf("TEST WQ ORDERED\n");
+
+	test_wq_ordered_emitted_n = 0;
+	test_wq_ordered_dctor_counter = 0;
+	wq = cd_wq_workqueue_default_create(4, "Workqueue Test Ordered");
+	assert(wq != NULL);
+
+	// Results are emitted in submit order, window of 16 bounds the jobs in flight
+	o = cd_wq_ordered_create(wq, 16, 0, test_wq_ordered_emit);
+	assert(o != NULL);
+	for (i = 0; i < TEST_WQ_ORDERED_JOBS_N; i++) {
+		id = test_wq_ordered_id(i);
+		while ((err = cd_wq_ordered_queue_user(o, CD_WORK_SYNC, id, 0, test_wq_ordered_f, test_wq_ordered_f_dtor)) == CD_ERR_FULL)
+			usleep(100);
+		assert(err == CD_ERR_OK);
+	}
+	while (__atomic_load_n(&test_wq_ordered_dctor_counter, __ATOMIC_SEQ_CST) < TEST_WQ_ORDERED_JOBS_N)
+		usleep(1000);
+	assert(test_wq_ordered_emitted_n == TEST_WQ_ORDERED_JOBS_N);
+	for (i = 0; i < TEST_WQ_ORDERED_JOBS_N; i++)
+		assert(test_wq_ordered_emitted[i] == i);
+	assert(CD_ERR_OK == cd_wq_ordered_free(&o));
+	printf("ORDERED: %u results emitted in submit order\n", test_wq_ordered_emitted_n);
+
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(wq));
+	cd_wq_workqueue_free(&wq);
+
+	// Hole: job 0 is stuck, jobs 1-5 wait behind it until it times out, then job 0's result is dropped.
+	// Group's threads take any queued job, so no job waits behind the stuck one.
+	test_wq_ordered_emitted_n = 0;
+	test_wq_ordered_dctor_counter = 0;
+	test_wq_ordered_gate_started = 0;
+	pthread_mutex_init(&test_wq_ordered_gate, NULL);
+	g = cd_wq_group_create(2, "Workqueue Test Ordered Group");
+	assert(g != NULL);
+	wq = cd_wq_workqueue_create_grouped(g, 1, "Workqueue Test Ordered Hole", NULL);
+	assert(wq != NULL);
+	o = cd_wq_ordered_create(wq, 8, TEST_WQ_ORDERED_HOLE_NS, test_wq_ordered_emit);
+	assert(o != NULL);
+
+	pthread_mutex_lock(&test_wq_ordered_gate);
+	t0 = cd_util_now_ns();
+	assert(CD_ERR_OK == cd_wq_ordered_queue_user(o, CD_WORK_SYNC, test_wq_ordered_id(0), 0, test_wq_ordered_gate_f, test_wq_ordered_f_dtor));
+	while (!__atomic_load_n(&test_wq_ordered_gate_started, __ATOMIC_ACQUIRE))
+		usleep(1000);
+	for (i = 1; i < 6; i++)
+		assert(CD_ERR_OK == cd_wq_ordered_queue_user(o, CD_WORK_SYNC, test_wq_ordered_id(i), 0, test_wq_ordered_f, test_wq_ordered_f_dtor));
+
+	// Nothing else is submitted, the hole is skipped once it times out
+	while (__atomic_load_n(&test_wq_ordered_dctor_counter, __ATOMIC_SEQ_CST) < 5)
+		usleep(1000);
+	assert(cd_util_now_ns() - t0 >= TEST_WQ_ORDERED_HOLE_NS);
+	assert(test_wq_ordered_emitted_n == 5);
+	for (i = 0; i < 5; i++)
+		assert(test_wq_ordered_emitted[i] == i + 1);
+	assert(o->skipped_n == 1);
+	assert(CD_ERR_BUSY == cd_wq_ordered_free(&o));
+
+	pthread_mutex_unlock(&test_wq_ordered_gate);
+	while (__atomic_load_n(&test_wq_ordered_dctor_counter, __ATOMIC_SEQ_CST) < 6)
+		usleep(1000);
+	assert(o->late_n == 1);
+	assert(test_wq_ordered_emitted_n == 5);
+	assert(CD_ERR_OK == cd_wq_ordered_free(&o));
+	printf("ORDERED: hole skipped after timeout, late result dropped\n");
+
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(wq));
+	cd_wq_workqueue_free(&wq);
+	assert(CD_ERR_OK == cd_wq_group_free(&g));
+	pthread_mutex_destroy(&test_wq_ordered_gate);
+}
+
+
+uint32_t test_wq_wait_group_counter;
+
+static void* test_wq_wait_group_f(void *arg)
+{
+    (void) arg;
+    usleep(200);
+    __atomic_add_fetch(&test_wq_wait_group_counter, 1, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+static void* test_wq_wait_group_nop_f(void *arg)
+{
+    (void) arg;
+    return NULL;
+}
+
+/* @brief   Wait group on the stack is gone once wait returns, done side must not touch it after waking the waiter. */
+static void __attribute__((noinline)) test_wq_wait_group_on_stack(struct cd_workqueue *wq)
+{
+	struct cd_wq_wait_group wg = CD_WQ_WAIT_GROUP_INITIALIZER;
+
+	assert(CD_ERR_OK == cd_wq_spawn_user(wq, &wg, CD_WORK_ASYNC, NULL, 0, test_wq_wait_group_nop_f, NULL));
+	assert(CD_ERR_OK == cd_wq_wait_group_wait(&wg, 0));
+	assert(wg.n == 0);
+	memset(&wg, 0xff, sizeof(wg));														/* like the stack being reused */
+}
+
+static void test_wq_wait_group(void)
+{
+	struct cd_workqueue *wq = NULL;
+	struct cd_wq_wait_group wg = CD_WQ_WAIT_GROUP_INITIALIZER;
+	struct cd_work *w = NULL;
+	uint32_t i;
+
+	printf("TEST WQ WAIT GROUP\n");
+
+	test_wq_wait_group_counter = 0;
+	wq = cd_wq_workqueue_default_create(4, "Workqueue Test Wait Group");
+	assert(wq != NULL);
+
+	// Nothing to wait for
+	assert(CD_ERR_OK == cd_wq_wait_group_wait(&wg, 0));
+
+	for (i = 0; i < 100; i++) {
+		w = cd_wq_work_create(CD_WORK_ASYNC, NULL, 0, test_wq_wait_group_f, NULL);
+		assert(w != NULL);
+		cd_wq_work_set_wait_group(w, &wg);
+		assert(CD_ERR_OK == cd_wq_queue_work(wq, w));
+	}
+	assert(CD_ERR_OK == cd_wq_wait_group_wait(&wg, 0));
+	assert(__atomic_load_n(&test_wq_wait_group_counter, __ATOMIC_SEQ_CST) == 100);
+	assert(wg.n == 0);
+	printf("WAIT GROUP: waited for %u jobs\n", test_wq_wait_group_counter);
+
+	// Timeout
+	cd_wq_wait_group_add(&wg, 1);
+	assert(CD_ERR_BUSY == cd_wq_wait_group_wait(&wg, 10 * 1000000));
+	cd_wq_wait_group_done(&wg);
+	assert(CD_ERR_OK == cd_wq_wait_group_wait(&wg, 10 * 1000000));
+
+	// Work which is dropped instead of processed is done too
+	for (i = 0; i < 10; i++) {
+		w = cd_wq_work_create(CD_WORK_ASYNC, NULL, 0, test_wq_wait_group_f, NULL);
+		assert(w != NULL);
+		cd_wq_work_set_deadline(w, 1);
+		cd_wq_work_set_wait_group(w, &wg);
+		assert(CD_ERR_OK == cd_wq_queue_work(wq, w));
+	}
+	assert(CD_ERR_OK == cd_wq_wait_group_wait(&wg, 0));
+	assert(__atomic_load_n(&test_wq_wait_group_counter, __ATOMIC_SEQ_CST) == 100);
+	printf("WAIT GROUP: dropped jobs are done\n");
+
+	for (i = 0; i < 10000; i++)
+		test_wq_wait_group_on_stack(wq);
+
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(wq));
+	cd_wq_workqueue_free(&wq);
+	printf("WAIT GROUP: released on the stack right after wait\n");
+}
+
+
+struct test_wq_fork_join_task {
+    struct cd_workqueue *wq;
+    uint32_t n;
+    uint64_t result;
+};
+
+static uint64_t test_wq_fork_join_fib_serial(uint32_t n)
+{
+    return n < 2 ? n : test_wq_fork_join_fib_serial(n - 1) + test_wq_fork_join_fib_serial(n - 2);
+}
+
+static void* test_wq_fork_join_fib_f(void *arg)
+{
+    struct test_wq_fork_join_task *t = arg, a, b;
+    struct cd_wq_wait_group wg = CD_WQ_WAIT_GROUP_INITIALIZER;
+
+    if (t->n < 10) {
+        t->result = test_wq_fork_join_fib_serial(t->n);
+        return NULL;
+    }
+
+    // Children live on this job's stack, sync returns only after both are done
+    a.wq = b.wq = t->wq;
+    a.n = t->n - 1;
+    b.n = t->n - 2;
+    assert(CD_ERR_OK == cd_wq_spawn_user(t->wq, &wg, CD_WORK_ASYNC, &a, 0, test_wq_fork_join_fib_f, NULL));
+    assert(CD_ERR_OK == cd_wq_spawn_user(t->wq, &wg, CD_WORK_ASYNC, &b, 0, test_wq_fork_join_fib_f, NULL));
+    assert(CD_ERR_OK == cd_wq_sync(t->wq, &wg));
+    t->result = a.result + b.result;
+    return NULL;
+}
+
+static void test_wq_fork_join(void)
+{
+	struct cd_wq_group *g = NULL;
+	struct cd_workqueue *wq = NULL;
+	struct cd_wq_wait_group wg = CD_WQ_WAIT_GROUP_INITIALIZER;
+	struct test_wq_fork_join_task root;
+	uint32_t workers_n;
+
+	printf("TEST WQ FORK JOIN\n");
+
+	// With a single worker every sync must be helped through, blocking would deadlock
+	for (workers_n = 1; workers_n <= 4; workers_n *= 2) {
+		wq = cd_wq_workqueue_default_create(workers_n, "Workqueue Test Fork Join");
+		assert(wq != NULL);
+
+		root.wq = wq;
+		root.n = 24;
+		root.result = 0;
+		assert(CD_ERR_OK == cd_wq_spawn_user(wq, &wg, CD_WORK_ASYNC, &root, 0, test_wq_fork_join_fib_f, NULL));
+		assert(CD_ERR_OK == cd_wq_sync(wq, &wg));
+		assert(root.result == test_wq_fork_join_fib_serial(24));
+		printf("FORK JOIN: fib(24) = %lu with %u workers\n", root.result, workers_n);
+
+		assert(CD_ERR_OK == cd_wq_workqueue_stop(wq));
+		cd_wq_workqueue_free(&wq);
+	}
+
+	// Group's threads help too, with a single thread blocking would deadlock
+	for (workers_n = 1; workers_n <= 2; workers_n *= 2) {
+		g = cd_wq_group_create(workers_n, "Group Test Fork Join");
+		assert(g != NULL);
+		wq = cd_wq_workqueue_create_grouped(g, 1, "Workqueue Test Fork Join Grouped", NULL);
+		assert(wq != NULL);
+
+		root.wq = wq;
+		root.n = 20;
+		root.result = 0;
+		assert(CD_ERR_OK == cd_wq_spawn_user(wq, &wg, CD_WORK_ASYNC, &root, 0, test_wq_fork_join_fib_f, NULL));
+		assert(CD_ERR_OK == cd_wq_sync(wq, &wg));
+		assert(root.result == test_wq_fork_join_fib_serial(20));
+		printf("FORK JOIN: fib(20) = %lu with %u group threads\n", root.result, workers_n);
+
+		assert(CD_ERR_OK == cd_wq_workqueue_stop(wq));
+		cd_wq_workqueue_free(&wq);
+		assert(CD_ERR_OK == cd_wq_group_free(&g));
+	}
+}
+
+
+uint32_t test_wq_stop_timeout_counter;
+uint32_t test_wq_stop_timeout_dtor_counter;
+
+static void* test_wq_stop_timeout_f(void *arg)
+{
+    (void) arg;
+    usleep(1000);
+    __atomic_add_fetch(&test_wq_stop_timeout_counter, 1, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+static void test_wq_stop_timeout_f_dtor(void *arg)
+{
+    (void) arg;
+    __atomic_add_fetch(&test_wq_stop_timeout_dtor_counter, 1, __ATOMIC_SEQ_CST);
+}
+
+static void test_wq_stop_timeout_queue(struct cd_workqueue *wq, uint32_t n)
+{
+	uint32_t i;
+
+	test_wq_stop_timeout_counter = 0;
+	test_wq_stop_timeout_dtor_counter = 0;
+	for (i = 0; i < n; i++)
+		assert(CD_ERR_OK == cd_wq_queue_user(wq, CD_WORK_SYNC, NULL, 0, test_wq_stop_timeout_f, test_wq_stop_timeout_f_dtor));
+}
+
+static void test_wq_stop_timeout(void)
+{
+	struct cd_workqueue *wq = NULL;
+	struct cd_wq_group *g = NULL;
+	struct cd_wq_stop_report r;
+
+	printf("TEST WQ STOP TIMEOUT\n");
+
+	// Enough time to drain everything
+	wq = cd_wq_workqueue_create(2, "Workqueue Test Stop Timeout", CD_WQ_QUEUE_OPTION_STOP_HARD);
+	assert(wq != NULL);
+	test_wq_stop_timeout_queue(wq, 50);
+	assert(CD_ERR_OK == cd_wq_workqueue_stop_timeout(wq, 10ULL * 1000000000, &r));
+	assert(r.timed_out == 0 && r.drained_n == 50 && r.dropped_n == 0);
+	assert(test_wq_stop_timeout_counter == 50 && test_wq_stop_timeout_dtor_counter == 50);
+	assert(CD_ERR_WORKQUEUE_ACTIVE == cd_wq_queue_user(wq, CD_WORK_ASYNC, NULL, 0, test_wq_stop_timeout_f, NULL));
+	cd_wq_workqueue_free(&wq);
+	printf("STOP TIMEOUT: drained %lu in %lu us\n", r.drained_n, r.duration_ns / 1000);
+
+	// Not enough time, the rest is cancelled and destructed
+	wq = cd_wq_workqueue_create(2, "Workqueue Test Stop Timeout", CD_WQ_QUEUE_OPTION_STOP_SOFT);
+	assert(wq != NULL);
+	test_wq_stop_timeout_queue(wq, 400);
+	assert(CD_ERR_OK == cd_wq_workqueue_stop_timeout(wq, 20 * 1000000, &r));
+	assert(r.timed_out == 1 && r.dropped_n > 0);
+	assert(r.drained_n + r.dropped_n == 400);
+	assert(test_wq_stop_timeout_counter == r.drained_n && test_wq_stop_timeout_dtor_counter == 400);
+	cd_wq_workqueue_free(&wq);
+	printf("STOP TIMEOUT: drained %lu, dropped %lu in %lu us\n", r.drained_n, r.dropped_n, r.duration_ns / 1000);
+
+	// Grouped workqueue
+	g = cd_wq_group_create(1, "Group Test Stop Timeout");
+	assert(g != NULL);
+	wq = cd_wq_workqueue_create_grouped(g, 1, "Workqueue Test Stop Timeout Grouped", NULL);
+	assert(wq != NULL);
+	test_wq_stop_timeout_queue(wq, 400);
+	assert(CD_ERR_OK == cd_wq_workqueue_stop_timeout(wq, 20 * 1000000, &r));
+	assert(r.timed_out == 1 && r.dropped_n > 0);
+	assert(r.drained_n + r.dropped_n == 400);
+	assert(test_wq_stop_timeout_counter == r.drained_n && test_wq_stop_timeout_dtor_counter == 400);
+	cd_wq_workqueue_free(&wq);
+	assert(CD_ERR_OK == cd_wq_group_free(&g));
+	printf("STOP TIMEOUT: grouped drained %lu, dropped %lu in %lu us\n", r.drained_n, r.dropped_n, r.duration_ns / 1000);
+}
+
+
+uint32_t test_wq_lazy_counter;
+
+static void* test_wq_lazy_f(void *arg)
+{
+    (void) arg;
+    __atomic_add_fetch(&test_wq_lazy_counter, 1, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+static void test_wq_lazy(void)
+{
+	struct cd_workqueue *wq = NULL;
+	struct cd_wq_queue_options options = { 0 };
+	struct cd_wq_wait_group wg = CD_WQ_WAIT_GROUP_INITIALIZER;
+	struct cd_wq_stats stats;
+	struct cd_work *w = NULL;
+	uint32_t i;
+
+	printf("TEST WQ LAZY START\n");
+
+	options.CD_WQ_QUEUE_OPTION_STOP = CD_WQ_QUEUE_OPTION_STOP_SOFT;
+	options.CD_WQ_QUEUE_OPTION_START = CD_WQ_QUEUE_OPTION_START_LAZY;
+
+	// No threads until there is work
+	test_wq_lazy_counter = 0;
+	wq = cd_wq_workqueue_create_options(4, "Workqueue Test Lazy", &options);
+	assert(wq != NULL);
+	assert(CD_ERR_OK == cd_wq_workqueue_stats(wq, &stats));
+	assert(stats.workers_n == 4 && stats.workers_active_n == 0);
+
+	w = cd_wq_work_create(CD_WORK_ASYNC, NULL, 0, test_wq_lazy_f, NULL);
+	assert(w != NULL);
+	cd_wq_work_set_wait_group(w, &wg);
+	assert(CD_ERR_OK == cd_wq_queue_work(wq, w));
+	assert(CD_ERR_OK == cd_wq_wait_group_wait(&wg, 0));
+	assert(CD_ERR_OK == cd_wq_workqueue_stats(wq, &stats));
+	assert(stats.workers_active_n >= 1 && stats.workers_active_n <= 4);
+	printf("LAZY START: %u of %u workers started by first work\n", stats.workers_active_n, stats.workers_n);
+
+	// Pre-warm the rest
+	assert(CD_ERR_OK == cd_wq_workqueue_prewarm(wq, 0));
+	assert(CD_ERR_OK == cd_wq_workqueue_stats(wq, &stats));
+	assert(stats.workers_active_n == 4);
+
+	for (i = 0; i < 100; i++) {
+		w = cd_wq_work_create(CD_WORK_ASYNC, NULL, 0, test_wq_lazy_f, NULL);
+		assert(w != NULL);
+		cd_wq_work_set_wait_group(w, &wg);
+		assert(CD_ERR_OK == cd_wq_queue_work(wq, w));
+	}
+	assert(CD_ERR_OK == cd_wq_wait_group_wait(&wg, 0));
+	assert(test_wq_lazy_counter == 101);
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(wq));
+	cd_wq_workqueue_free(&wq);
+
+	// Stopped before any work, no worker is started afterwards
+	wq = cd_wq_workqueue_create_options(2, "Workqueue Test Lazy", &options);
+	assert(wq != NULL);
+	assert(CD_ERR_OK == cd_wq_workqueue_prewarm(wq, 1));
+	assert(CD_ERR_OK == cd_wq_workqueue_stats(wq, &stats));
+	assert(stats.workers_active_n == 1);
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(wq));
+	assert(CD_ERR_WORKQUEUE_ACTIVE == cd_wq_queue_user(wq, CD_WORK_ASYNC, NULL, 0, test_wq_lazy_f, NULL));
+	assert(CD_ERR_WORKQUEUE_ACTIVE == cd_wq_workqueue_prewarm(wq, 0));
+	cd_wq_workqueue_free(&wq);
+	printf("LAZY START: no workers after stop\n");
+}
+
+
+struct test_wq_worker_attr_seen {
+    size_t stack_size;
+    int policy;
+    char name[CD_WQ_WORKER_NAME_LEN];
+};
+
+static void* test_wq_worker_attr_f(void *arg)
+{
+    struct test_wq_worker_attr_seen *seen = arg;
+    struct sched_param param;
+    pthread_attr_t attr;
+
+    assert(pthread_getattr_np(pthread_self(), &attr) == 0);
+    assert(pthread_attr_getstacksize(&attr, &seen->stack_size) == 0);
+    pthread_attr_destroy(&attr);
+    assert(pthread_getschedparam(pthread_self(), &seen->policy, &param) == 0);
+    assert(pthread_getname_np(pthread_self(), seen->name, sizeof(seen->name)) == 0);
+    return NULL;
+}
+
+static void test_wq_worker_attr(void)
+{
+	struct cd_workqueue *wq = NULL;
+	struct cd_wq_queue_options options = { 0 };
+	struct cd_wq_worker_attr attr = { 0 };
+	struct cd_wq_wait_group wg = CD_WQ_WAIT_GROUP_INITIALIZER;
+	struct test_wq_worker_attr_seen seen;
+	struct cd_wq_stats stats;
+	struct cd_work *w = NULL;
+
+	printf("TEST WQ WORKER ATTR\n");
+
+	// Defaults are reported
+	wq = cd_wq_workqueue_default_create(1, "Workqueue Test Attr");
+	assert(wq != NULL);
+	assert(CD_ERR_OK == cd_wq_workqueue_stats(wq, &stats));
+	assert(stats.worker_attr.stack_size > 0);
+	assert(stats.worker_attr.sched_policy == SCHED_OTHER);
+	assert(strcmp(stats.worker_attr.name, "Workqueue Test ") == 0);
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(wq));
+	cd_wq_workqueue_free(&wq);
+
+	// Small stack, batch scheduling (doesn't need privileges) and a name
+	attr.stack_size = 256 * 1024;
+	attr.sched_policy = SCHED_BATCH;
+	snprintf(attr.name, sizeof(attr.name), "%s", "cdtest");
+	options.CD_WQ_QUEUE_OPTION_STOP = CD_WQ_QUEUE_OPTION_STOP_SOFT;
+	options.worker_attr = &attr;
+	wq = cd_wq_workqueue_create_options(2, "Workqueue Test Attr", &options);
+	assert(wq != NULL);
+
+	memset(&seen, 0, sizeof(seen));
+	w = cd_wq_work_create(CD_WORK_ASYNC, &seen, 0, test_wq_worker_attr_f, NULL);
+	assert(w != NULL);
+	cd_wq_work_set_wait_group(w, &wg);
+	assert(CD_ERR_OK == cd_wq_queue_work(wq, w));
+	assert(CD_ERR_OK == cd_wq_wait_group_wait(&wg, 0));
+
+	assert(seen.stack_size >= 256 * 1024 && seen.stack_size < 1024 * 1024);
+	assert(seen.policy == SCHED_BATCH);
+	assert(strncmp(seen.name, "cdtest/", 7) == 0);
+	assert(CD_ERR_OK == cd_wq_workqueue_stats(wq, &stats));
+	assert(stats.worker_attr.stack_size == 256 * 1024 && stats.worker_attr.sched_policy == SCHED_BATCH);
+	printf("WORKER ATTR: [%s] stack %zu, policy %d\n", seen.name, seen.stack_size, seen.policy);
+
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(wq));
+	cd_wq_workqueue_free(&wq);
+
+	// Policy which can't be set is logged, workers run (and are reported) with the one they got
+	attr.sched_policy = 77;
+	wq = cd_wq_workqueue_create_options(1, "Workqueue Test Attr", &options);
+	assert(wq != NULL);
+	assert(CD_ERR_OK == cd_wq_workqueue_stats(wq, &stats));
+	assert(stats.worker_attr.sched_policy == SCHED_OTHER);
+	printf("WORKER ATTR: policy 77 refused, effective policy %d\n", stats.worker_attr.sched_policy);
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(wq));
+	cd_wq_workqueue_free(&wq);
+}
+
+
+struct test_wq_arena_job {
+    size_t size;
+    uint32_t n;
+    char *first;
+};
+
+static void* test_wq_arena_f(void *arg)
+{
+    struct test_wq_arena_job *job = arg;
+    char *p = NULL;
+    uint32_t i;
+
+    for (i = 0; i < job->n; i++) {
+        p = cd_wq_arena_alloc(job->size);
+        assert(p != NULL);
+        assert(((uintptr_t) p % CD_WQ_ARENA_ALIGN) == 0);
+        memset(p, 0xA5, job->size);
+        if (i == 0)
+            job->first = p;
+    }
+    return NULL;
+}
+
+static void test_wq_arena_run(struct cd_workqueue *wq, struct test_wq_arena_job *job, size_t size, uint32_t n)
+{
+	struct cd_wq_wait_group wg = CD_WQ_WAIT_GROUP_INITIALIZER;
+	struct cd_work *w = NULL;
+
+	job->size = size;
+	job->n = n;
+	job->first = NULL;
+	w = cd_wq_work_create(CD_WORK_ASYNC, job, 0, test_wq_arena_f, NULL);
+	assert(w != NULL);
+	cd_wq_work_set_wait_group(w, &wg);
+	assert(CD_ERR_OK == cd_wq_queue_work(wq, w));
+	assert(CD_ERR_OK == cd_wq_wait_group_wait(&wg, 0));
+}
+
+static void test_wq_arena(void)
+{
+	struct cd_workqueue *wq = NULL;
+	struct cd_wq_group *g = NULL;
+	struct test_wq_arena_job a, b;
+
+	printf("TEST WQ ARENA\n");
+
+	// Not from a job
+	assert(cd_wq_arena_alloc(16) == NULL);
+
+	wq = cd_wq_workqueue_default_create(1, "Workqueue Test Arena");
+	assert(wq != NULL);
+
+	// Arena is reset after each job, next job gets the same memory
+	test_wq_arena_run(wq, &a, 24, 100);
+	test_wq_arena_run(wq, &b, 24, 100);
+	assert(a.first == b.first);
+
+	// Job which doesn't fit spills to malloc, then arena grows to fit it
+	test_wq_arena_run(wq, &a, 1000, 200);
+	test_wq_arena_run(wq, &a, 1000, 200);
+	test_wq_arena_run(wq, &b, 8, 1);
+	assert(a.first == b.first);
+
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(wq));
+	cd_wq_workqueue_free(&wq);
+
+	// Group threads have arenas too
+	g = cd_wq_group_create(1, "Group Test Arena");
+	assert(g != NULL);
+	wq = cd_wq_workqueue_create_grouped(g, 1, "Workqueue Test Arena Grouped", NULL);
+	assert(wq != NULL);
+	test_wq_arena_run(wq, &a, 64, 10);
+	test_wq_arena_run(wq, &b, 64, 10);
+	assert(a.first == b.first);
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(wq));
+	cd_wq_workqueue_free(&wq);
+	assert(CD_ERR_OK == cd_wq_group_free(&g));
+	printf("ARENA: scratch memory reused across jobs\n");
+}
+
+
+struct test_wq_worker_ctx {
+    uint32_t idx;
+    uint32_t count;
+};
+
+uint32_t test_wq_worker_ctx_init_n;
+uint32_t test_wq_worker_ctx_deinit_n;
+uint32_t test_wq_worker_ctx_total;
+
+static void* test_wq_worker_ctx_init(uint32_t worker_idx, void *worker_arg)
+{
+    struct test_wq_worker_ctx *ctx = calloc(1, sizeof(struct test_wq_worker_ctx));
+
+    assert(ctx != NULL);
+    assert(worker_arg == &test_wq_worker_ctx_total);
+    ctx->idx = worker_idx;
+    __atomic_add_fetch(&test_wq_worker_ctx_init_n, 1, __ATOMIC_SEQ_CST);
+    return ctx;
+}
+
+static void test_wq_worker_ctx_deinit(void *arg, uint32_t worker_idx, void *worker_arg)
+{
+    struct test_wq_worker_ctx *ctx = arg;
+
+    assert(ctx->idx == worker_idx);
+    __atomic_add_fetch((uint32_t *) worker_arg, ctx->count, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&test_wq_worker_ctx_deinit_n, 1, __ATOMIC_SEQ_CST);
+    free(ctx);
+}
+
+static void* test_wq_worker_ctx_f(void *arg)
+{
+    struct test_wq_worker_ctx *ctx = cd_wq_worker_context();
+
+    (void) arg;
+    assert(ctx != NULL);
+    assert((int) ctx->idx == cd_wq_worker_idx());
+    ctx->count++;                                   /* only this worker touches it */
+    return NULL;
+}
+
+static void test_wq_worker_ctx(void)
+{
+	struct cd_workqueue *wq = NULL;
+	struct cd_wq_queue_options options = { 0 };
+	uint32_t i;
+
+	printf("TEST WQ WORKER CONTEXT\n");
+
+	assert(cd_wq_worker_context() == NULL);
+	assert(cd_wq_worker_idx() == -1);
+
+	test_wq_worker_ctx_init_n = 0;
+	test_wq_worker_ctx_deinit_n = 0;
+	test_wq_worker_ctx_total = 0;
+
+	options.CD_WQ_QUEUE_OPTION_STOP = CD_WQ_QUEUE_OPTION_STOP_SOFT;
+	options.f_worker_init = test_wq_worker_ctx_init;
+	options.f_worker_deinit = test_wq_worker_ctx_deinit;
+	options.worker_arg = &test_wq_worker_ctx_total;
+	wq = cd_wq_workqueue_create_options(4, "Workqueue Test Worker Context", &options);
+	assert(wq != NULL);
+
+	for (i = 0; i < 1000; i++)
+		assert(CD_ERR_OK == cd_wq_queue_user(wq, CD_WORK_ASYNC, NULL, 0, test_wq_worker_ctx_f, NULL));
+
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(wq));
+	assert(test_wq_worker_ctx_init_n == 4 && test_wq_worker_ctx_deinit_n == 4);
+	assert(test_wq_worker_ctx_total == 1000);
+	cd_wq_workqueue_free(&wq);
+	printf("WORKER CONTEXT: %u jobs counted without locks by %u workers\n", test_wq_worker_ctx_total, test_wq_worker_ctx_init_n);
+}
+
+
+struct cd_wq_accumulator *test_wq_accumulator_sum;
+struct cd_wq_accumulator *test_wq_accumulator_min;
+struct cd_wq_accumulator *test_wq_accumulator_max;
+struct cd_wq_accumulator *test_wq_accumulator_xor;
+
+static int64_t test_wq_accumulator_xor_f(int64_t a, int64_t b)
+{
+    return a ^ b;
+}
+
+static void* test_wq_accumulator_f(void *arg)
+{
+    int64_t v = (int64_t) (uintptr_t) arg;
+
+    cd_wq_accumulator_update(test_wq_accumulator_sum, v);
+    cd_wq_accumulator_update(test_wq_accumulator_min, v);
+    cd_wq_accumulator_update(test_wq_accumulator_max, v);
+    cd_wq_accumulator_update(test_wq_accumulator_xor, v);
+    return NULL;
+}
+
+static void test_wq_accumulator(void)
+{
+	struct cd_workqueue *wq = NULL;
+	int64_t i, xor = 0;
+
+	printf("TEST WQ ACCUMULATOR\n");
+
+	wq = cd_wq_workqueue_default_create(4, "Workqueue Test Accumulator");
+	assert(wq != NULL);
+	test_wq_accumulator_sum = cd_wq_accumulator_create(wq, CD_WQ_REDUCE_SUM, NULL, 0);
+	test_wq_accumulator_min = cd_wq_accumulator_create(wq, CD_WQ_REDUCE_MIN, NULL, 0);
+	test_wq_accumulator_max = cd_wq_accumulator_create(wq, CD_WQ_REDUCE_MAX, NULL, 0);
+	test_wq_accumulator_xor = cd_wq_accumulator_create(wq, CD_WQ_REDUCE_CUSTOM, test_wq_accumulator_xor_f, 0);
+	assert(test_wq_accumulator_sum && test_wq_accumulator_min && test_wq_accumulator_max && test_wq_accumulator_xor);
+	assert(cd_wq_accumulator_create(wq, CD_WQ_REDUCE_CUSTOM, NULL, 0) == NULL);
+
+	for (i = 1; i <= 10000; i++) {
+		assert(CD_ERR_OK == cd_wq_queue_user(wq, CD_WORK_ASYNC, (void *) (uintptr_t) i, 0, test_wq_accumulator_f, NULL));
+		xor ^= i;
+	}
+	test_wq_accumulator_f((void *) (uintptr_t) 20000);								/* not a worker, shared slot */
+	xor ^= 20000;
+
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(wq));
+	assert(cd_wq_accumulator_read(test_wq_accumulator_sum) == 10000 * 10001 / 2 + 20000);
+	assert(cd_wq_accumulator_read(test_wq_accumulator_min) == 1);
+	assert(cd_wq_accumulator_read(test_wq_accumulator_max) == 20000);
+	assert(cd_wq_accumulator_read(test_wq_accumulator_xor) == xor);
+	printf("ACCUMULATOR: sum %ld, min %ld, max %ld\n", cd_wq_accumulator_read(test_wq_accumulator_sum),
+			cd_wq_accumulator_read(test_wq_accumulator_min), cd_wq_accumulator_read(test_wq_accumulator_max));
+
+	cd_wq_accumulator_reset(test_wq_accumulator_sum);
+	assert(cd_wq_accumulator_read(test_wq_accumulator_sum) == 0);
+
+	cd_wq_accumulator_free(&test_wq_accumulator_sum);
+	cd_wq_accumulator_free(&test_wq_accumulator_min);
+	cd_wq_accumulator_free(&test_wq_accumulator_max);
+	cd_wq_accumulator_free(&test_wq_accumulator_xor);
+	assert(test_wq_accumulator_sum == NULL);
+	cd_wq_workqueue_free(&wq);
+}
+
+
+#define TEST_WQ_PRODUCERS_N 8
+#define TEST_WQ_PRODUCER_JOBS 5000
+
+uint32_t test_wq_producers_counter;
+
+static void* test_wq_producers_job_f(void *arg)
+{
+    (void) arg;
+    __atomic_add_fetch(&test_wq_producers_counter, 1, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+static void* test_wq_producers_f(void *arg)
+{
+    struct cd_workqueue *wq = arg;
+    uint32_t i;
+
+    for (i = 0; i < TEST_WQ_PRODUCER_JOBS; i++)
+        assert(CD_ERR_OK == cd_wq_queue_user(wq, CD_WORK_ASYNC, NULL, 0, test_wq_producers_job_f, NULL));
+    return NULL;
+}
+
+static void test_wq_producers(void)
+{
+	struct cd_workqueue *wq = NULL;
+	pthread_t tids[TEST_WQ_PRODUCERS_N];
+	uint32_t i;
+
+	printf("TEST WQ MANY PRODUCERS\n");
+
+	test_wq_producers_counter = 0;
+	wq = cd_wq_workqueue_default_create(4, "Workqueue Test Producers");
+	assert(wq != NULL);
+
+	for (i = 0; i < TEST_WQ_PRODUCERS_N; i++)
+		assert(CD_ERR_OK == cd_launch_thread(&tids[i], test_wq_producers_f, wq, PTHREAD_CREATE_JOINABLE));
+	for (i = 0; i < TEST_WQ_PRODUCERS_N; i++)
+		pthread_join(tids[i], NULL);
+
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(wq));
+	assert(test_wq_producers_counter == TEST_WQ_PRODUCERS_N * TEST_WQ_PRODUCER_JOBS);
+	cd_wq_workqueue_free(&wq);
+	printf("MANY PRODUCERS: %u jobs from %u producers\n", test_wq_producers_counter, TEST_WQ_PRODUCERS_N);
+}
+
+uint32_t test_wq_producers_per_worker[2][3];
+
+static void* test_wq_producers_count_f(void *arg)
+{
+    __atomic_add_fetch(&test_wq_producers_per_worker[(uintptr_t) arg][cd_wq_worker_idx()], 1, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+static void test_wq_producers_alternate(void)
+{
+	struct cd_workqueue *a = NULL, *b = NULL;
+	uint32_t i;
+
+	printf("TEST WQ PRODUCER ALTERNATE\n");
+
+	memset(test_wq_producers_per_worker, 0, sizeof(test_wq_producers_per_worker));
+	a = cd_wq_workqueue_default_create(2, "Workqueue Test Producer Alternate A");
+	b = cd_wq_workqueue_default_create(3, "Workqueue Test Producer Alternate B");
+	assert(a != NULL && b != NULL);
+
+	// One producer alternating between queues of different sizes still goes round-robin over each of them
+	for (i = 0; i < 6 * TEST_WQ_PRODUCER_JOBS; i++) {
+		assert(CD_ERR_OK == cd_wq_queue_user(a, CD_WORK_ASYNC, (void *) 0, 0, test_wq_producers_count_f, NULL));
+		assert(CD_ERR_OK == cd_wq_queue_user(b, CD_WORK_ASYNC, (void *) 1, 0, test_wq_producers_count_f, NULL));
+	}
+
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(a));
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(b));
+	for (i = 0; i < 2; i++)
+		assert(test_wq_producers_per_worker[0][i] == 3 * TEST_WQ_PRODUCER_JOBS);
+	for (i = 0; i < 3; i++)
+		assert(test_wq_producers_per_worker[1][i] == 2 * TEST_WQ_PRODUCER_JOBS);
+	printf("PRODUCER ALTERNATE: %u jobs spread evenly over workers of each queue\n", 12 * TEST_WQ_PRODUCER_JOBS);
+
+	cd_wq_workqueue_free(&a);
+	cd_wq_workqueue_free(&b);
+}
+
+
+static void* test_wq_trace_f(void *arg)
+{
+    (void) arg;
+    usleep(100);
+    return NULL;
+}
+
+static void test_wq_trace(void)
+{
+	struct cd_workqueue *wq = NULL;
+	struct cd_wq_trace_header h;
+	struct cd_wq_trace_record rec;
+	char path[] = "/tmp/cd_test_wq_trace_XXXXXX";
+	uint32_t i, n = 0, types[3] = { 0 };
+	FILE *f;
+	int fd;
+
+	printf("TEST WQ TRACE\n");
+
+	fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+
+	wq = cd_wq_workqueue_default_create(2, "Workqueue Test Trace");
+	assert(wq != NULL);
+	assert(CD_ERR_OK == cd_wq_workqueue_trace_start(wq, path));
+	assert(CD_ERR_BAD_CALL == cd_wq_workqueue_trace_start(wq, path));
+
+	for (i = 0; i < 3 * CD_WQ_TRACE_BUF_N; i++)										/* fills and flushes buffers */
+		assert(CD_ERR_OK == cd_wq_queue_user(wq, CD_WORK_ASYNC, NULL, i % 3, test_wq_trace_f, NULL));
+
+	assert(CD_ERR_BUSY == cd_wq_workqueue_trace_stop(wq));
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(wq));
+	assert(CD_ERR_OK == cd_wq_workqueue_trace_stop(wq));
+	cd_wq_workqueue_free(&wq);
+
+	f = fopen(path, "rb");
+	assert(f != NULL);
+	assert(fread(&h, sizeof(h), 1, f) == 1);
+	assert(memcmp(h.magic, CD_WQ_TRACE_MAGIC, sizeof(h.magic)) == 0);
+	assert(h.version == CD_WQ_TRACE_VERSION && h.workers_n == 2);
+	while (fread(&rec, sizeof(rec), 1, f) == 1) {
+		assert(rec.submit_ns <= rec.start_ns && rec.start_ns <= rec.end_ns);
+		assert(rec.end_ns - rec.start_ns >= 100 * 1000);
+		assert(rec.worker < 2);
+		assert(rec.user_data_type >= 0 && rec.user_data_type < 3);
+		types[rec.user_data_type]++;
+		n++;
+	}
+	fclose(f);
+	unlink(path);
+
+	assert(n == 3 * CD_WQ_TRACE_BUF_N);
+	assert(types[0] == CD_WQ_TRACE_BUF_N && types[1] == CD_WQ_TRACE_BUF_N && types[2] == CD_WQ_TRACE_BUF_N);
+	printf("TRACE: %u jobs recorded\n", n);
+}
+
+
+#define TEST_WQ_DEFERRED_N 500
+
+uint32_t test_wq_deferred_dtor_calls[TEST_WQ_DEFERRED_N];
+uint32_t test_wq_deferred_dtor_on_worker;
+
+static void* test_wq_deferred_f(void *arg)
+{
+	(void) arg;
+	usleep(50);
+	return NULL;
+}
+
+static void test_wq_deferred_f_dtor(void *arg)
+{
+	uint32_t *calls = arg;
+
+	if (cd_wq_worker_idx() >= 0)
+		__atomic_add_fetch(&test_wq_deferred_dtor_on_worker, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(calls, 1, __ATOMIC_SEQ_CST);
+}
+
+static void test_wq_deferred_run(uint8_t option_stop)
+{
+	struct cd_workqueue *wq = NULL;
+	struct cd_wq_queue_options options = { 0 };
+	struct cd_wq_stats stats;
+	uint32_t i, n = 0, executed = 0;
+
+	memset(test_wq_deferred_dtor_calls, 0, sizeof(test_wq_deferred_dtor_calls));
+	test_wq_deferred_dtor_on_worker = 0;
+
+	options.CD_WQ_QUEUE_OPTION_STOP = option_stop;
+	options.CD_WQ_QUEUE_OPTION_DTOR = CD_WQ_QUEUE_OPTION_DTOR_DEFERRED;
+	wq = cd_wq_workqueue_create_options(2, "Workqueue Test Deferred", &options);
+	assert(wq != NULL);
+
+	for (i = 0; i < TEST_WQ_DEFERRED_N; i++)
+		assert(CD_ERR_OK == cd_wq_queue_user(wq, CD_WORK_SYNC, &test_wq_deferred_dtor_calls[i], 0, test_wq_deferred_f, test_wq_deferred_f_dtor));
+	usleep(5000);
+
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(wq));
+	assert(CD_ERR_OK == cd_wq_workqueue_stats(wq, &stats));
+	executed = stats.deferred_n;
+	for (i = 0; i < TEST_WQ_DEFERRED_N; i++)
+		n += test_wq_deferred_dtor_calls[i];
+	assert(n == executed);															/* all deferred destructors have run when stop returns */
+	if (option_stop == CD_WQ_QUEUE_OPTION_STOP_SOFT)
+		assert(executed == TEST_WQ_DEFERRED_N);
+	cd_wq_workqueue_free(&wq);														/* cancels what HARD stop left queued */
+
+	for (i = 0; i < TEST_WQ_DEFERRED_N; i++)
+		assert(test_wq_deferred_dtor_calls[i] == 1);								/* exactly once, processed or cancelled */
+	// None of destructors ran on worker threads
+	assert(test_wq_deferred_dtor_on_worker == 0);
+	printf("DEFERRED DTOR: %s stop, %u deferred, %u cancelled\n", option_stop == CD_WQ_QUEUE_OPTION_STOP_SOFT ? "SOFT" : "HARD",
+			executed, TEST_WQ_DEFERRED_N - executed);
+}
+
+static void test_wq_deferred(void)
+{
+	printf("TEST WQ DEFERRED DTOR\n");
+	test_wq_deferred_run(CD_WQ_QUEUE_OPTION_STOP_SOFT);
+	test_wq_deferred_run(CD_WQ_QUEUE_OPTION_STOP_HARD);
+}
+
+
+#define TEST_WQ_INLINE_N 1000
+
+struct test_wq_inline_params {
+	uint32_t	idx;
+	uint32_t	check;
+	uint64_t	pad[5];
+};
+
+uint32_t test_wq_inline_seen[TEST_WQ_INLINE_N];
+uint32_t test_wq_inline_dtor_n;
+
+static void* test_wq_inline_f(void *arg)
+{
+	struct test_wq_inline_params *p = arg;
+
+	assert(((uintptr_t) p % 16) == 0);
+	assert(p->check == p->idx * 7 + 1);												/* copy of the caller's buffer, not the buffer */
+	__atomic_add_fetch(&test_wq_inline_seen[p->idx], 1, __ATOMIC_SEQ_CST);
+	return NULL;
+}
+
+static void test_wq_inline_f_dtor(void *arg)
+{
+	struct test_wq_inline_params *p = arg;
+
+	assert(p->check == p->idx * 7 + 1);
+	__atomic_add_fetch(&test_wq_inline_dtor_n, 1, __ATOMIC_SEQ_CST);
+}
+
+static void test_wq_inline(void)
+{
+	struct cd_workqueue *wq = NULL;
+	struct cd_wq_queue_options options = { 0 };
+	struct test_wq_inline_params p;
+	struct cd_work *work;
+	uint32_t i;
+
+	printf("TEST WQ INLINE PAYLOAD\n");
+
+	options.CD_WQ_QUEUE_OPTION_STOP = CD_WQ_QUEUE_OPTION_STOP_SOFT;
+	wq = cd_wq_workqueue_create_options(3, "Workqueue Test Inline", &options);
+	assert(wq != NULL);
+
+	memset(&p, 0, sizeof(p));
+	for (i = 0; i < TEST_WQ_INLINE_N; i++) {
+		p.idx = i;
+		p.check = i * 7 + 1;
+		assert(CD_ERR_OK == cd_wq_queue_user_inline(wq, i % 2 ? CD_WORK_SYNC : CD_WORK_ASYNC, &p, sizeof(p), 0, test_wq_inline_f,
+					i % 4 == 1 ? test_wq_inline_f_dtor : NULL));								/* SYNC with and without destructor */
+	}
+	p.check = 0;																		/* caller's buffer is free to reuse */
+
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(wq));
+	for (i = 0; i < TEST_WQ_INLINE_N; i++)
+		assert(test_wq_inline_seen[i] == 1);
+	assert(test_wq_inline_dtor_n == TEST_WQ_INLINE_N / 4);
+
+	// Not queued, released by the call, destructor not called
+	p.idx = 0;
+	p.check = 1;
+	assert(CD_ERR_WORKQUEUE_ACTIVE == cd_wq_queue_user_inline(wq, CD_WORK_SYNC, &p, sizeof(p), 0, test_wq_inline_f, test_wq_inline_f_dtor));
+	assert(test_wq_inline_dtor_n == TEST_WQ_INLINE_N / 4);
+	cd_wq_workqueue_free(&wq);
+
+	// Created but never queued, SYNC destructor is called on free
+	work = cd_wq_work_create_inline(CD_WORK_SYNC, &p, sizeof(p), 0, test_wq_inline_f, test_wq_inline_f_dtor);
+	assert(work != NULL && (work->flags & CD_WORK_FLAG_INLINE) && work->user_data == ((struct cd_work_inline*) work)->payload);
+	cd_wq_work_free(&work);
+	assert(test_wq_inline_dtor_n == TEST_WQ_INLINE_N / 4 + 1);
+	printf("INLINE PAYLOAD: %u jobs, %u destructors\n", TEST_WQ_INLINE_N, test_wq_inline_dtor_n);
+}
+
+
+static void* test_wq_lock_stats_f(void *arg)
+{
+	(void) arg;
+	usleep(10);
+	return NULL;
+}
+
+static void test_wq_lock_stats(void)
+{
+	struct cd_workqueue *wq = NULL;
+	struct cd_wq_stats stats;
+	struct cd_wq_lock_stats ls, sum = { 0 };
+	uint32_t i;
+
+	printf("TEST WQ LOCK STATS\n");
+
+	wq = cd_wq_workqueue_create(3, "Workqueue Test Lock Stats", CD_WQ_QUEUE_OPTION_STOP_SOFT);
+	assert(wq != NULL);
+	for (i = 0; i < 1000; i++)
+		assert(CD_ERR_OK == cd_wq_queue_user(wq, CD_WORK_ASYNC, NULL, 0, test_wq_lock_stats_f, NULL));
+	assert(CD_ERR_OK == cd_wq_workqueue_stop(wq));
+
+	assert(CD_ERR_BAD_CALL == cd_wq_worker_lock_stats(wq, 3, &ls));
+	assert(CD_ERR_OK == cd_wq_workqueue_stats(wq, &stats));
+	for (i = 0; i < 3; i++) {
+		assert(CD_ERR_OK == cd_wq_worker_lock_stats(wq, i, &ls));
+		assert(ls.contended_n <= ls.acquired_n);
+		sum.acquired_n += ls.acquired_n;
+		sum.contended_n += ls.contended_n;
+		sum.signaled_n += ls.signaled_n;
+	}
+	assert(stats.lock_stats.acquired_n == sum.acquired_n && stats.lock_stats.contended_n == sum.contended_n);
+
+#ifdef CD_TEST_LOCK_STATS
+	assert(stats.lock_stats_enabled);															/* make test-lockstats */
+#endif
+	if (!stats.lock_stats_enabled) {
+		assert(sum.acquired_n == 0 && sum.signaled_n == 0 && stats.lock_stats.parked_n == 0);
+		printf("LOCK STATS: skipped, library built without CD_WQ_LOCK_STATS (run make test-lockstats), counters stay zero\n");
+		cd_wq_workqueue_free(&wq);
+		return;
+	}
+
+	assert(sum.acquired_n >= 1000);														/* at least each enqueue */
+	assert(sum.signaled_n >= 1000);
+	printf("LOCK STATS: acquired %lu, contended %lu, waited %lu ns, parked %lu times\n",
+			stats.lock_stats.acquired_n, stats.lock_stats.contended_n, stats.lock_stats.wait_ns, stats.lock_stats.parked_n);
+	cd_wq_workqueue_free(&wq);
+}
+
 
 int main(void)
 {
@@ -785,6 +2553,30 @@ int main(void)
 	test_wq_queue_default_sync();
 	test_wq_queue_hard_sync();
 	test_wq_queue_hard_sync_async();
+	test_wq_queue_from_worker();
+	test_wq_queue_from_worker_stopping();
+	test_wq_queue_coalesce();
+	test_wq_queue_rate_limit();
+	test_wq_queue_edf();
+	test_wq_group();
+	test_wq_completions();
+	test_wq_strand();
+	test_wq_strand_fair();
+	test_wq_ordered();
+	test_wq_wait_group();
+	test_wq_fork_join();
+	test_wq_stop_timeout();
+	test_wq_lazy();
+	test_wq_worker_attr();
+	test_wq_arena();
+	test_wq_worker_ctx();
+	test_wq_accumulator();
+	test_wq_producers();
+	test_wq_producers_alternate();
+	test_wq_trace();
+	test_wq_deferred();
+	test_wq_inline();
+	test_wq_lock_stats();
 	printf("That's nice!\n");
 	return 0;
 }